@@ -4,22 +4,26 @@
 #include <cstring>
 
 #include <filesystem>
+#include <span>
 #include <string>
 #include <string_view>
 #include <vector>
 
 struct ByteBuffer {
 public:
+	ByteBuffer() = default;
+	// Reads straight from caller owned memory, which has to outlive the buffer, only the get functions may be used
+	ByteBuffer(std::span<const std::uint8_t> view) : pView(view.data()), viewSize(view.size()) { }
+
 	void readFromFile(const std::filesystem::path& filename);
 
 	auto getOffset() const { return this->offset; }
 	void setOffset(std::size_t offset) { this->offset = offset; }
-	auto size() const { return this->bytes.size(); }
-	auto data() { return this->bytes.data(); }
-	auto data() const { return this->bytes.data(); }
+	std::size_t size() const { return this->pView ? this->viewSize : this->bytes.size(); }
+	const std::uint8_t* data() const { return this->pView ? this->pView : this->bytes.data(); }
 
 	std::uint8_t getUI1(std::size_t position) const {
-		if (position < this->bytes.size()) return this->bytes[position];
+		if (position < size()) return data()[position];
 		return 0;
 	}
 	std::uint16_t getUI2(std::size_t position) const { return getUI1(position) | getUI1(position + 1) << 8; }
@@ -37,7 +41,7 @@ public:
 	std::string_view getString(std::size_t position, std::size_t length) const;
 	std::string_view getStringNT(std::size_t position) {
 		std::size_t length = 0;
-		while ((position + length) < this->bytes.size() && this->bytes[position + length] != 0)
+		while ((position + length) < size() && data()[position + length] != 0)
 			length++;
 		return getString(position, length);
 	}
@@ -228,6 +232,8 @@ public:
 	}
 
 private:
-	std::size_t offset = 0;
+	std::size_t offset        = 0;
+	const std::uint8_t* pView = nullptr;
+	std::size_t viewSize      = 0;
 	std::vector<std::uint8_t> bytes;
 };
\ No newline at end of file
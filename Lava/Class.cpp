@@ -1,22 +1,14 @@
 #include "Class.h"
+#include "ByteBuffer.h"
+#include "CodeHeap.h"
+#include "ThreadPool.h"
 
 #include <cstring>
 
+#include <algorithm>
+#include <mutex>
 #include <sstream>
 
-#if LAVA_SYSTEM_windows
-	#include <Windows.h>
-#elif LAVA_SYSTEM_linux
-	#include <sys/mman.h>
-#else
-	#error Requires executable memory allocation, which isnt supported by your system
-#endif
-
-static void* allocateReadWriteMemory(std::size_t bytes);
-static void makeExecutableMemory(void* p, std::size_t bytes);
-static void makeNonExecutableMemory(void* p, std::size_t bytes);
-static void deallocateMemory(void* p, std::size_t bytes);
-
 //-------------
 // Class Flags
 //-------------
@@ -109,30 +101,315 @@ std::ostream& operator<<(std::ostream& stream, EAccessFlags flags) {
 // Class structures
 //------------------
 
-Method::~Method() {
-	if (this->allocated)
-		deallocateMemory(this->pCode, this->codeLength);
+static std::size_t alignUp(std::size_t value, std::size_t alignment) {
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+bool getFieldDescriptorLayout(std::string_view descriptor, std::size_t& size, std::size_t& alignment) {
+	if (descriptor.empty()) return false;
+	switch (descriptor[0]) {
+	case 'Z': // Boolean
+	case 'B': // Byte
+		size = 1;
+		break;
+	case 'C': // Char
+	case 'S': // Short
+		size = 2;
+		break;
+	case 'I': // Int
+	case 'F': // Float
+		size = 4;
+		break;
+	case 'J': // Long
+	case 'D': // Double
+		size = 8;
+		break;
+	case 'L': // Reference 'L<ClassName>;'
+		if (descriptor.size() < 3 || descriptor.back() != ';') return false;
+		size      = 8;
+		alignment = 8;
+		return true;
+	case '[': { // Array reference '[<Descriptor>'
+		std::size_t elementSize, elementAlignment;
+		if (!getFieldDescriptorLayout(descriptor.substr(1), elementSize, elementAlignment)) return false;
+		size      = 8;
+		alignment = 8;
+		return true;
+	}
+	default: return false;
+	}
+	alignment = size;
+	return descriptor.size() == 1;
+}
+
+MethodInfo::MethodInfo(MethodInfo&& other, const allocator_type& allocator) : MethodInfo(allocator) {
+	this->name           = std::move(other.name);
+	this->descriptor     = std::move(other.descriptor);
+	this->accessFlags    = other.accessFlags;
+	this->codeLength     = other.codeLength;
+	this->pBlock         = std::exchange(other.pBlock, nullptr);
+	this->pHeap          = other.pHeap;
+	this->inlinable      = other.inlinable;
+	this->inlineLength   = other.inlineLength;
+	this->slotReferences = std::move(other.slotReferences);
+	this->batchDrivers   = std::move(other.batchDrivers);
 }
 
-void Method::allocateCode(std::vector<std::uint8_t>& code) {
+MethodInfo::~MethodInfo() {
+	if (this->pBlock)
+		this->pHeap->release(this->pBlock);
+}
+
+void Method::allocateCode(CodeHeap& heap, std::vector<std::uint8_t>& code, const std::vector<CodeLiteral>& literals, const std::vector<CodeNearCall>& nearCalls, const std::vector<CodeDataReference>& dataReferences) {
 	if (this->pCode) return;
-	this->allocated  = true;
-	this->codeLength = code.size();
-	this->pCode      = reinterpret_cast<std::uint8_t*>(allocateReadWriteMemory(this->codeLength));
-	std::memcpy(this->pCode, code.data(), this->codeLength);
+	MethodInfo& info = *this->pInfo;
+	info.pHeap       = &heap;
+	info.pBlock      = heap.allocate(code, literals, nearCalls, dataReferences);
+	info.codeLength  = info.pBlock->length;
+	this->pCode      = info.pBlock->pCode;
 }
 
-void Method::makeCodeReadWrite() {
-	makeNonExecutableMemory(this->pCode, this->codeLength);
+void Method::swapCode(Method& other) {
+	std::swap(this->pCode, other.pCode);
+	std::swap(this->pInfo->codeLength, other.pInfo->codeLength);
+	std::swap(this->pInfo->pBlock, other.pInfo->pBlock);
+	std::swap(this->pInfo->pHeap, other.pInfo->pHeap);
+	std::swap(this->pInfo->inlinable, other.pInfo->inlinable);
+	std::swap(this->pInfo->inlineLength, other.pInfo->inlineLength);
+	// The lists live in the regions of their classes, which never free, so swap their contents and let the live class reuse its
+	// storage on every reload instead of allocating new storage in its region
+	std::vector<std::uint32_t> slotReferences(this->pInfo->slotReferences.begin(), this->pInfo->slotReferences.end());
+	this->pInfo->slotReferences.assign(other.pInfo->slotReferences.begin(), other.pInfo->slotReferences.end());
+	other.pInfo->slotReferences.assign(slotReferences.begin(), slotReferences.end());
 }
 
-void Method::makeCodeExecutable() {
-	makeExecutableMemory(this->pCode, this->codeLength);
+void Method::makeCodePatchable() {
+	MethodInfo& info = *this->pInfo;
+	if (!info.pBlock || (info.pBlock->refCount == 1 && info.pBlock->pRegion)) return;
+
+	// Other methods share this code or it has no writable view, give this method a private copy in a region before it gets
+	// patched. Other threads might still run the old code, so it is only retired.
+	CodeBlock* block = info.pHeap->allocateUnique(info.pBlock);
+	info.pHeap->retire(info.pBlock);
+	info.pBlock = block;
+	this->pCode = block->pCode;
+}
+
+std::uint8_t* Method::getWritableCode() const {
+	return this->pInfo->pBlock ? this->pInfo->pHeap->getWritable(this->pInfo->pBlock) : this->pCode;
+}
+
+std::uint32_t hashMethodDescriptor(std::string_view descriptor) {
+	std::uint32_t hash = 0x811C9DC5U;
+	for (char c : descriptor)
+		hash = (hash ^ static_cast<std::uint8_t>(c)) * 0x01000193U;
+	return hash;
+}
+
+Class::Class(MetadataRegion& region) : pRegion(&region), name(&region), supers(&region), fields(&region), methods(&region), methodInfos(&region), superOffsets(&region), vtable(&region), vtableSlots(&region) {}
+
+void Class::operator delete(Class* clazz, std::destroying_delete_t) {
+	MetadataRegion* region = clazz->pRegion;
+	clazz->~Class();
+	region->getArena().releaseRegion(region);
+}
+
+Class::~Class() {
+	if (this->pStaticData)
+		this->pDataHeap->releaseData(this->pStaticData, this->staticSize);
+	if (this->pReadOnlyData)
+		this->pDataHeap->releaseReadOnlyData(this->pReadOnlyData, this->readOnlySize);
+}
+
+void Class::setMethodCount(std::size_t count) {
+	this->methodInfos.resize(count);
+	this->methods.resize(count);
+	for (std::size_t i = 0; i < count; i++)
+		this->methods[i].pInfo = &this->methodInfos[i];
+}
+
+void Class::link() {
+	this->vtable.clear();
+	this->vtableSlots.clear();
+
+	// Methods constructed by hand have no descriptor hash yet
+	for (auto& method : this->methods)
+		if (!method.descriptorHash) method.descriptorHash = hashMethodDescriptor(method.pInfo->descriptor);
+
+	// Inherit every slot of the supers, the first super keeps its slot numbers and later supers only add new descriptors
+	for (auto super : this->supers) {
+		for (auto method : super->vtable) {
+			if (this->vtableSlots.find(method->pInfo->descriptor) != this->vtableSlots.end()) continue;
+			this->vtableSlots.insert({ method->pInfo->descriptor, static_cast<std::uint32_t>(this->vtable.size()) });
+			this->vtable.push_back(method);
+		}
+	}
+
+	// Override inherited slots with this class' methods or append new slots
+	for (auto& method : this->methods) {
+		auto itr = this->vtableSlots.find(method.pInfo->descriptor);
+		if (itr != this->vtableSlots.end()) {
+			this->vtable[itr->second] = &method;
+		} else {
+			this->vtableSlots.insert({ method.pInfo->descriptor, static_cast<std::uint32_t>(this->vtable.size()) });
+			this->vtable.push_back(&method);
+		}
+	}
+}
+
+std::uint32_t Class::getVTableSlot(std::string_view descriptor) const {
+	auto itr = this->vtableSlots.find(descriptor);
+	if (itr != this->vtableSlots.end()) return itr->second;
+	return InvalidSlot;
+}
+
+bool Class::computeLayout() {
+	std::size_t offset    = 0;
+	std::size_t alignment = 1;
+
+	// Super class instances are embedded first, in declaration order
+	this->superOffsets.resize(this->supers.size());
+	for (std::size_t i = 0; i < this->supers.size(); i++) {
+		Class* super          = this->supers[i];
+		offset                = alignUp(offset, super->instanceAlignment);
+		this->superOffsets[i] = offset;
+		offset += super->instanceSize;
+		alignment = std::max(alignment, super->instanceAlignment);
+	}
+
+	// Resolve field sizes and split the fields into static, hot and cold groups
+	std::vector<Field*> hotFields;
+	std::vector<Field*> coldFields;
+	std::vector<Field*> staticFields;
+	for (auto& field : this->fields) {
+		if (!getFieldDescriptorLayout(field.descriptor, field.size, field.alignment)) return false;
+		if (field.accessFlags & EAccessFlag::Static)
+			staticFields.push_back(&field);
+		else if (field.hot)
+			hotFields.push_back(&field);
+		else
+			coldFields.push_back(&field);
+	}
+
+	// Pack each group by decreasing alignment so no padding is needed between fields
+	auto byAlignment = [](Field* lhs, Field* rhs) -> bool {
+		return lhs->alignment > rhs->alignment;
+	};
+	std::stable_sort(hotFields.begin(), hotFields.end(), byAlignment);
+	std::stable_sort(coldFields.begin(), coldFields.end(), byAlignment);
+	std::stable_sort(staticFields.begin(), staticFields.end(), byAlignment);
+
+	// Static fields are offsets into the static storage of the class instead of the instance
+	std::size_t staticOffset = 0;
+	for (auto field : staticFields) {
+		field->offset = staticOffset;
+		staticOffset += field->size;
+	}
+	this->staticSize = staticOffset;
+
+	// Hot fields share their own cache lines, so writes to cold fields never evict them
+	if (!hotFields.empty()) {
+		offset    = alignUp(offset, LavaCacheLineSize);
+		alignment = std::max(alignment, LavaCacheLineSize);
+		for (auto field : hotFields) {
+			field->offset = offset;
+			offset += field->size;
+		}
+		offset = alignUp(offset, LavaCacheLineSize);
+	}
+	for (auto field : coldFields) {
+		offset        = alignUp(offset, field->alignment);
+		field->offset = offset;
+		offset += field->size;
+		alignment = std::max(alignment, field->alignment);
+	}
+
+	this->instanceSize      = alignUp(offset, alignment);
+	this->instanceAlignment = alignment;
+	this->instancePool      = std::make_unique<SlabPool>(this->instanceSize, this->instanceAlignment);
+	return true;
+}
+
+void Class::allocateStaticData(CodeHeap& heap) {
+	if (this->pStaticData || this->staticSize == 0) return;
+	this->pDataHeap   = &heap;
+	this->pStaticData = heap.allocateData(this->staticSize);
+}
+
+void Class::allocateReadOnlyData(CodeHeap& heap, const std::uint8_t* pData, std::size_t size, std::size_t alignment) {
+	if (this->pReadOnlyData || size == 0) return;
+	this->pDataHeap     = &heap;
+	this->pReadOnlyData = heap.allocateReadOnlyData(pData, size, alignment);
+	this->readOnlySize  = this->pReadOnlyData ? size : 0;
+}
+
+void Class::swapReadOnlyData(Class& other) {
+	std::swap(this->pReadOnlyData, other.pReadOnlyData);
+	std::swap(this->readOnlySize, other.readOnlySize);
+	// Either class might not have had data of its own before
+	if (!this->pDataHeap) this->pDataHeap = other.pDataHeap;
+	if (!other.pDataHeap) other.pDataHeap = this->pDataHeap;
+}
+
+Field* Class::getField(std::string_view name) {
+	for (auto& field : this->fields)
+		if (field.name == name)
+			return &field;
+	return nullptr;
+}
+
+bool Class::getFieldOffset(std::string_view name, std::size_t& offset) const {
+	for (auto& field : this->fields) {
+		if (field.name == name && !(field.accessFlags & EAccessFlag::Static)) {
+			offset = field.offset;
+			return true;
+		}
+	}
+	for (std::size_t i = 0; i < this->supers.size(); i++) {
+		if (this->supers[i]->getFieldOffset(name, offset)) {
+			offset += this->superOffsets[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+std::size_t Class::getFieldOffsetError(std::string_view name) const {
+	std::size_t offset;
+	if (getFieldOffset(name, offset)) return offset;
+	std::ostringstream stream;
+	stream << "Instance field '" << name << "' not found in class '" << this->name << "'";
+	throw std::runtime_error(stream.str());
+}
+
+void* Class::getStaticField(std::string_view name) {
+	Field* field = getField(name);
+	if (!field || !(field->accessFlags & EAccessFlag::Static) || !this->pStaticData) return nullptr;
+	return this->pStaticData + field->offset;
+}
+
+void* Class::getStaticFieldError(std::string_view name) {
+	void* pField = getStaticField(name);
+	if (pField) return pField;
+	std::ostringstream stream;
+	stream << "Static field '" << name << "' not found in class '" << this->name << "'";
+	throw std::runtime_error(stream.str());
+}
+
+void* Class::allocateInstance() {
+	// Classes constructed by hand get their layout on first use
+	if (!this->instancePool && !computeLayout())
+		throw std::runtime_error("Class '" + std::string(this->name) + "' has a field with an invalid descriptor");
+	return this->instancePool->allocate();
+}
+
+void Class::deallocateInstance(void* instance) {
+	if (this->instancePool) this->instancePool->deallocate(instance);
 }
 
 Method* Class::getMethod(std::string_view name) {
 	for (auto& method : this->methods)
-		if (method.name == name)
+		if (method.pInfo->name == name)
 			return &method;
 	return nullptr;
 }
@@ -143,7 +420,7 @@ Method* Class::getMethodc(const char* name) {
 
 Method& Class::getMethodError(std::string_view name) {
 	for (auto& method : this->methods)
-		if (method.name == name)
+		if (method.pInfo->name == name)
 			return method;
 	std::ostringstream stream;
 	stream << "Method name '" << name << "' not found";
@@ -155,8 +432,11 @@ Method& Class::getMethodErrorc(const char* name) {
 }
 
 Method* Class::getMethodFromDescriptor(std::string_view descriptor) {
+	if (Method* method = getVirtualMethod(getVTableSlot(descriptor))) return method;
+	// Classes that have not been linked yet only know their own methods
+	std::uint32_t descriptorHash = hashMethodDescriptor(descriptor);
 	for (auto& method : this->methods)
-		if (method.descriptor == descriptor)
+		if ((!method.descriptorHash || method.descriptorHash == descriptorHash) && method.pInfo->descriptor == descriptor)
 			return &method;
 	return nullptr;
 }
@@ -166,9 +446,8 @@ Method* Class::getMethodFromDescriptorc(const char* descriptor) {
 }
 
 Method& Class::getMethodFromDescriptorError(std::string_view descriptor) {
-	for (auto& method : this->methods)
-		if (method.descriptor == descriptor)
-			return method;
+	Method* method = getMethodFromDescriptor(descriptor);
+	if (method) return *method;
 	std::ostringstream stream;
 	stream << "Method descriptor '" << descriptor << "' not found";
 	throw std::runtime_error(stream.str());
@@ -178,48 +457,145 @@ Method& Class::getMethodFromDescriptorErrorc(const char* descriptor) {
 	return getMethodFromDescriptorError(descriptor);
 }
 
-//----------------------------
-// Windows execute allocation
-//----------------------------
+//--------------------
+// Batched invocation
+//--------------------
 
-#if LAVA_SYSTEM_windows
-void* allocateReadWriteMemory(std::size_t bytes) {
-	return VirtualAlloc(nullptr, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
-}
+// Guards the batch drivers of every method, they are only built on the first batch of a layout
+static std::mutex batchDriverMutex;
 
-void makeExecutableMemory(void* p, std::size_t bytes) {
-	DWORD old;
-	VirtualProtect(p, bytes, PAGE_EXECUTE_READ, &old);
+std::shared_ptr<BatchDriver> Method::getBatchDriver(const BatchLayout& layout) {
+	if (!this->pInfo) return std::make_shared<BatchDriver>(*this, layout);
+	std::lock_guard<std::mutex> lock(batchDriverMutex);
+	auto& drivers = this->pInfo->batchDrivers;
+	for (auto& driver : drivers) {
+		if (driver->getLayout() != layout) continue;
+		// A reload or relocation moved the method, batches still running keep the old driver alive
+		if (driver->getTarget() != this->pCode) driver = std::make_shared<BatchDriver>(*this, layout);
+		return driver;
+	}
+	return drivers.emplace_back(std::make_shared<BatchDriver>(*this, layout));
 }
 
-void makeNonExecutableMemory(void* p, std::size_t bytes) {
-	DWORD old;
-	VirtualProtect(p, bytes, PAGE_READWRITE, &old);
-}
+BatchDriver::BatchDriver(Method& method, const BatchLayout& layout) : layout(layout) {
+	if (!method.isInvokable())
+		throw std::runtime_error("Method '" + std::string(method.pInfo->name) + "' has no code to invoke");
+	if (layout.argCount > 4)
+		throw std::runtime_error("Batched invocation only supports up to 4 register arguments");
 
-void deallocateMemory(void* p, std::size_t bytes) {
-	VirtualFree(p, 0, MEM_RELEASE);
-}
-#endif
+	// Argument registers in the Microsoft x64 calling convention: RCX, RDX, R8, R9
+	static constexpr std::uint8_t argRegisters[4]  = { 1, 2, 0, 1 };
+	static constexpr bool argRegistersExtended[4] = { false, false, true, true };
 
-//----------------------------
-// Linux execute allocation
-//----------------------------
+	// Driver signature: void driver(const void* pArgs, void* pResults, std::size_t count)
+	ByteBuffer driver;
+	driver.addUI1s({ 0x53 });                   // PUSH RBX
+	driver.addUI1s({ 0x56 });                   // PUSH RSI
+	driver.addUI1s({ 0x57 });                   // PUSH RDI
+	driver.addUI1s({ 0x48, 0x83, 0xEC, 0x20 }); // SUB RSP, 20h
+	driver.addUI1s({ 0x48, 0x89, 0xCE });       // MOV RSI, RCX
+	driver.addUI1s({ 0x48, 0x89, 0xD7 });       // MOV RDI, RDX
+	driver.addUI1s({ 0x4C, 0x89, 0xC3 });       // MOV RBX, R8
+	driver.addUI1s({ 0x48, 0x85, 0xDB });       // TEST RBX, RBX
+	driver.addUI1s({ 0x74, 0x00 });             // JZ done
+	std::size_t skipJumpEnd = driver.size();
 
-#if LAVA_SYSTEM_linux
-void* allocateReadWriteMemory(std::size_t bytes) {
-	return mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-}
+	// Loop body, loads every argument relative to RSI
+	std::size_t loopBegin = driver.size();
+	for (std::size_t i = 0; i < layout.argCount; i++) {
+		std::uint8_t modrm = static_cast<std::uint8_t>(0x40 | (argRegisters[i] << 3) | 0x06);
+		std::uint8_t rex   = argRegistersExtended[i] ? 0x44 : 0x00;
+		switch (layout.argSizes[i]) {
+		case 8: // MOV r64, [RSI + ??]
+			driver.addUI1s({ static_cast<std::uint8_t>(0x48 | rex), 0x8B, modrm });
+			break;
+		case 4: // MOV r32, [RSI + ??]
+			if (rex) driver.addUI1(rex);
+			driver.addUI1s({ 0x8B, modrm });
+			break;
+		case 2: // MOVZX r32, WORD [RSI + ??]
+			if (rex) driver.addUI1(rex);
+			driver.addUI1s({ 0x0F, 0xB7, modrm });
+			break;
+		case 1: // MOVZX r32, BYTE [RSI + ??]
+			if (rex) driver.addUI1(rex);
+			driver.addUI1s({ 0x0F, 0xB6, modrm });
+			break;
+		default: throw std::runtime_error("Batched invocation argument has an unsupported size");
+		}
+		driver.addUI1(layout.argOffsets[i]); // Argument offset
+	}
+	// Align the call to 8 bytes, the code heap only makes it a near call if it does not straddle a qword
+	std::size_t padding = (8 - driver.size() % 8) % 8;
+	driver.addUI1s(std::vector<std::uint8_t>(padding, 0x90), loopBegin); // NOP
+	loopBegin += padding;
+	std::size_t callOffset = driver.size();
+	driver.addUI1s({ 0xFF, 0x15 }); // CALL [REL ??]
+	std::size_t calleeOffsetPosition = driver.size();
+	driver.addI4(0); // Offset to address of method to call
+	std::size_t calleeOffsetEnd = driver.size();
+	switch (layout.resultSize) {
+	case 0: break;
+	case 8: driver.addUI1s({ 0x48, 0x89, 0x07 }); break; // MOV [RDI], RAX
+	case 4: driver.addUI1s({ 0x89, 0x07 }); break;       // MOV [RDI], EAX
+	case 2: driver.addUI1s({ 0x66, 0x89, 0x07 }); break; // MOV [RDI], AX
+	case 1: driver.addUI1s({ 0x88, 0x07 }); break;       // MOV [RDI], AL
+	default: throw std::runtime_error("Batched invocation result has an unsupported size");
+	}
+	driver.addUI1s({ 0x48, 0x81, 0xC6 }); // ADD RSI, ??
+	driver.addUI4(layout.argStride);      // Argument stride
+	if (layout.resultSize) {
+		driver.addUI1s({ 0x48, 0x81, 0xC7 }); // ADD RDI, ??
+		driver.addUI4(layout.resultStride);   // Result stride
+	}
+	driver.addUI1s({ 0x48, 0xFF, 0xCB }); // DEC RBX
+	driver.addUI1s({ 0x75 });             // JNZ loop
+	driver.addI1(static_cast<std::int8_t>(static_cast<std::int64_t>(loopBegin) - static_cast<std::int64_t>(driver.size() + 1)));
+
+	// done:
+	driver.setUI1(static_cast<std::uint8_t>(driver.size() - skipJumpEnd), skipJumpEnd - 1);
+	driver.addUI1s({ 0x48, 0x83, 0xC4, 0x20 }); // ADD RSP, 20h
+	driver.addUI1s({ 0x5F });                   // POP RDI
+	driver.addUI1s({ 0x5E });                   // POP RSI
+	driver.addUI1s({ 0x5B });                   // POP RBX
+	driver.addUI1s({ 0xC3 });                   // RET
 
-void makeExecutableMemory(void* p, std::size_t bytes) {
-	mprotect(p, bytes, PROT_EXEC | PROT_READ);
+	// Store the address of the method after the driver
+	while (driver.size() % 8) driver.addUI1(0xCC);
+	std::size_t slotOffset = driver.size();
+	driver.setUI4(static_cast<std::uint32_t>(slotOffset - calleeOffsetEnd), calleeOffsetPosition);
+	driver.addUI8(LavaUBCast<std::uint8_t*, std::uint64_t>(method.pCode).right);
+
+	this->pTarget    = method.pCode;
+	this->pHeap      = method.pInfo ? method.pInfo->pHeap : nullptr;
+	this->codeLength = driver.size();
+	if (this->pHeap) {
+		std::vector<std::uint8_t> code(driver.data(), driver.data() + driver.size());
+		this->pBlock = this->pHeap->allocateNear(method.pCode, code, { { static_cast<std::uint32_t>(callOffset), static_cast<std::uint32_t>(slotOffset) } });
+		this->pCode  = this->pBlock->pCode;
+		return;
+	}
+	this->pCode = reinterpret_cast<std::uint8_t*>(allocateReadWriteMemory(this->codeLength));
+	std::memcpy(this->pCode, driver.data(), this->codeLength);
+	makeExecutableMemory(this->pCode, this->codeLength);
 }
 
-void makeNonExecutableMemory(void* p, std::size_t bytes) {
-	mprotect(p, bytes, PROT_READ | PROT_WRITE);
+BatchDriver::~BatchDriver() {
+	if (this->pBlock)
+		this->pHeap->release(this->pBlock);
+	else if (this->pCode)
+		deallocateMemory(this->pCode, this->codeLength);
 }
 
-void deallocateMemory(void* p, std::size_t bytes) {
-	munmap(p, bytes);
+void BatchDriver::run(const void* pArgs, void* pResults, std::size_t count) const {
+	if (count == 0) return;
+	LavaUBCast<std::uint8_t*, void(LAVA_MICROSOFT_CALL_ABI*)(const void*, void*, std::size_t)>(this->pCode).right(pArgs, pResults, count);
 }
-#endif
\ No newline at end of file
+
+void BatchDriver::run(const void* pArgs, void* pResults, std::size_t count, ThreadPool& pool, std::size_t grainSize) const {
+	auto pArgBytes    = reinterpret_cast<const std::uint8_t*>(pArgs);
+	auto pResultBytes = reinterpret_cast<std::uint8_t*>(pResults);
+	pool.parallelFor(count, grainSize, [&](std::size_t begin, std::size_t end) {
+		run(pArgBytes + begin * this->layout.argStride, pResultBytes ? pResultBytes + begin * this->layout.resultStride : nullptr, end - begin);
+	});
+}
\ No newline at end of file
@@ -1,9 +1,24 @@
 #pragma once
 
+#include "CodeHeap.h"
+#include "MetadataArena.h"
+#include "SlabPool.h"
+
+#include <atomic>
 #include <cstdint>
 
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <optional>
 #include <ostream>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #if LAVA_TOOLSET_gcc && !LAVA_SYSTEM_windows
@@ -87,48 +102,171 @@ union LavaUBCast {
 	Right right;
 };
 
+class ThreadPool;
+
 struct Field;
 struct Method;
 struct Class;
+struct BatchLayout;
+class BatchDriver;
+
+// Cache line size used to isolate hot fields inside an instance
+static constexpr std::size_t LavaCacheLineSize = 64;
 
+// Gets the size and alignment of a value described by a field descriptor, returns false if the descriptor is invalid
+bool getFieldDescriptorLayout(std::string_view descriptor, std::size_t& size, std::size_t& alignment);
+// FNV-1a hash of a method descriptor, version 2 class files store it precomputed in their method table
+std::uint32_t hashMethodDescriptor(std::string_view descriptor);
+
+// Metadata records live in the metadata region of their class, containers of them hand the region down to their strings
 struct Field {
-	std::string name;
-	std::string descriptor;
+	using allocator_type = std::pmr::polymorphic_allocator<>;
+
+	Field(const allocator_type& allocator = {}) : name(allocator), descriptor(allocator) {}
+	Field(const Field& other, const allocator_type& allocator = {}) : Field(allocator) { *this = other; }
+	Field(Field&& other, const allocator_type& allocator) : Field(allocator) { *this = std::move(other); }
+	Field& operator=(const Field& other) = default;
+	Field& operator=(Field&& other)      = default;
+
+	std::pmr::string name;
+	std::pmr::string descriptor;
 	EAccessFlags accessFlags = EAccessFlag::Public;
+	bool hot                 = false;
+	std::size_t offset       = 0;
+	std::size_t size         = 0;
+	std::size_t alignment    = 1;
 };
 
-struct Method {
-	~Method();
+// Cold part of a method, only touched while linking, patching code and looking methods up by name
+struct MethodInfo {
+	using allocator_type = std::pmr::polymorphic_allocator<>;
+
+	MethodInfo(const allocator_type& allocator = {}) : name(allocator), descriptor(allocator), slotReferences(allocator) {}
+	// Moving hands the code block over, so only one of the two releases it
+	MethodInfo(MethodInfo&& other, const allocator_type& allocator);
+	MethodInfo(const MethodInfo&) = delete;
+	MethodInfo& operator=(const MethodInfo&) = delete;
+	~MethodInfo();
 
-	std::string name;
-	std::string descriptor;
+	std::pmr::string name;
+	std::pmr::string descriptor;
 	EAccessFlags accessFlags = EAccessFlag::Public;
 	std::size_t codeLength   = 0;
-	std::uint8_t* pCode      = nullptr;
-	bool allocated           = false;
+	CodeBlock* pBlock        = nullptr;
+	CodeHeap* pHeap          = nullptr;
+	// Leaf methods that pass the decoder check can have their first 'inlineLength' bytes copied into callers in place of a call
+	bool inlinable           = false;
+	std::size_t inlineLength = 0;
+	// Offsets of the RIP relative displacements in the code that address its absolute pointer slots
+	std::pmr::vector<std::uint32_t> slotReferences;
+	// Batch drivers built for the method, one per argument layout
+	std::vector<std::shared_ptr<BatchDriver>> batchDrivers;
+};
+
+// Hot part of a method, classes keep these densely packed so dispatch and descriptor lookups stay within a few cache lines,
+// get call stubs load the entry point from offset 0 of the method they resolved
+struct Method {
+	std::uint8_t* pCode          = nullptr;
+	std::uint32_t descriptorHash = 0;
+	MethodInfo* pInfo            = nullptr;
 
 	template <class T>
 	void setMethod(T method) { pCode = LavaUBCast<T, std::uint8_t*>(method).right; }
 
-	void allocateCode(std::vector<std::uint8_t>& code);
-	void makeCodeReadWrite();
-	void makeCodeExecutable();
+	void allocateCode(CodeHeap& heap, std::vector<std::uint8_t>& code, const std::vector<CodeLiteral>& literals, const std::vector<CodeNearCall>& nearCalls, const std::vector<CodeDataReference>& dataReferences);
+	void swapCode(Method& other);
+	// Gives the method a private copy of its code in a dual mapped region, so call slots can be patched while it runs
+	void makeCodePatchable();
+	// Address to patch the code through, only differs from pCode when the code is in a region
+	std::uint8_t* getWritableCode() const;
 	bool isInvokable() const { return this->pCode; }
 	template <class R, class... Ts>
 	R invoke(Ts&&... args) {
+		// Keeps code this call might still run, e.g. after a hot reload on another thread, from being reclaimed
+		std::optional<CodeHeap::InvocationScope> scope;
+		if (this->pInfo && this->pInfo->pHeap) scope.emplace(*this->pInfo->pHeap);
 		if constexpr (std::is_void_v<R>)
 			LavaUBCast<void*, void(LAVA_MICROSOFT_CALL_ABI*)(Ts...)>(this->pCode).right(args...);
 		else
 			return LavaUBCast<void*, R(LAVA_MICROSOFT_CALL_ABI*)(Ts...)>(this->pCode).right(args...);
 	}
+
+	// The driver every batch with 'layout' shares, it is built again once the method runs other code
+	std::shared_ptr<BatchDriver> getBatchDriver(const BatchLayout& layout);
+	template <class R, class... Ts>
+	void invokeBatch(std::type_identity_t<std::span<const std::tuple<Ts...>>> args, std::type_identity_t<std::span<R>> results, ThreadPool* pool = nullptr);
+	template <class... Ts>
+	void invokeBatch(std::type_identity_t<std::span<const std::tuple<Ts...>>> args, ThreadPool* pool = nullptr);
+};
+
+// Target of a get call stub, the first call resolves it through the vtable of the called class and later calls reuse it
+struct LazyCall {
+	LazyCall(std::string className, std::string methodDescriptor) : className(std::move(className)), methodDescriptor(std::move(methodDescriptor)) {}
+
+	std::string className;
+	std::string methodDescriptor;
+	std::atomic<Method*> method = nullptr;
 };
 
+// Classes are allocated in a metadata region of their own, 'new (region) Class(region)' creates one and deleting it releases the region
 struct Class {
-	std::string name;
+	Class(MetadataRegion& region);
+	Class(const Class&) = delete;
+	Class(Class&&)      = delete;
+	Class& operator=(const Class&) = delete;
+	Class& operator=(Class&&) = delete;
+
+	static void* operator new(std::size_t size, MetadataRegion& region) { return region.allocate(size, alignof(Class)); }
+	static void operator delete(void*, MetadataRegion&) {}
+	static void operator delete(Class* clazz, std::destroying_delete_t);
+	~Class();
+
+	MetadataRegion* pRegion = nullptr;
+	std::pmr::string name;
 	EAccessFlags accessFlags = EAccessFlag::Public;
-	std::vector<Class*> supers;
-	std::vector<Field> fields;
-	std::vector<Method> methods;
+	std::pmr::vector<Class*> supers;
+	std::pmr::vector<Field> fields;
+	std::pmr::vector<Method> methods;
+	std::pmr::vector<MethodInfo> methodInfos;
+	std::pmr::vector<std::size_t> superOffsets;
+	std::size_t instanceSize      = 0;
+	std::size_t instanceAlignment = 1;
+	std::unique_ptr<SlabPool> instancePool;
+	// Storage of the static fields and the read only data section, code refers to both RIP relatively so they come from the code heap
+	std::size_t staticSize      = 0;
+	std::uint8_t* pStaticData   = nullptr;
+	std::size_t readOnlySize    = 0;
+	std::uint8_t* pReadOnlyData = nullptr;
+	CodeHeap* pDataHeap         = nullptr;
+	// Flattened dispatch table, inherited methods first in super order, overridden slots point at this class' methods
+	std::pmr::vector<Method*> vtable;
+	std::pmr::unordered_map<std::string_view, std::uint32_t> vtableSlots;
+	// Targets of the get call stubs in the code of the class, they move with the code on a reload
+	std::vector<std::unique_ptr<LazyCall>> lazyCalls;
+
+	static constexpr std::uint32_t InvalidSlot = ~0U;
+
+	// Allocates the hot and cold records of every method, the class can only do this once
+	void setMethodCount(std::size_t count);
+	void link();
+	bool ownsMethod(const Method* method) const { return method >= this->methods.data() && method < this->methods.data() + this->methods.size(); }
+	std::uint32_t getVTableSlot(std::string_view descriptor) const;
+	Method* getVirtualMethod(std::uint32_t slot) const { return slot < this->vtable.size() ? this->vtable[slot] : nullptr; }
+
+	bool computeLayout();
+	// Allocates the zeroed storage of the static fields after the layout has been computed
+	void allocateStaticData(CodeHeap& heap);
+	// Copies the read only data section at the alignment it asks for, up to DataAlignment
+	void allocateReadOnlyData(CodeHeap& heap, const std::uint8_t* pData, std::size_t size, std::size_t alignment);
+	// Hands the read only data section over together with the code referring to it
+	void swapReadOnlyData(Class& other);
+	Field* getField(std::string_view name);
+	bool getFieldOffset(std::string_view name, std::size_t& offset) const;
+	std::size_t getFieldOffsetError(std::string_view name) const;
+	void* getStaticField(std::string_view name);
+	void* getStaticFieldError(std::string_view name);
+	void* allocateInstance();
+	void deallocateInstance(void* instance);
 
 	Method* getMethod(std::string_view name);
 	Method* getMethodc(const char* name);
@@ -138,4 +276,103 @@ struct Class {
 	Method* getMethodFromDescriptorc(const char* descriptor);
 	Method& getMethodFromDescriptorError(std::string_view descriptor);
 	Method& getMethodFromDescriptorErrorc(const char* descriptor);
-};
\ No newline at end of file
+};
+
+//--------------------
+// Batched invocation
+//--------------------
+
+// Describes where the register arguments of each element live inside an argument tuple
+// and how results are stored, arguments are loaded into RCX, RDX, R8 and R9 in order
+struct BatchLayout {
+	std::uint32_t argStride    = 0;
+	std::uint32_t resultStride = 0;
+	std::uint8_t argCount      = 0;
+	std::uint8_t argOffsets[4] = { 0, 0, 0, 0 };
+	std::uint8_t argSizes[4]   = { 0, 0, 0, 0 };
+	std::uint8_t resultSize    = 0;
+
+	bool operator==(const BatchLayout& other) const = default;
+
+	template <class R, class... Ts>
+	static BatchLayout Make();
+};
+
+// A generated loop that calls a method once per argument tuple, so a batch only pays for one host call. It is placed next
+// to the code of the method when that is in a region of the code heap, so the loop calls it directly.
+class BatchDriver {
+public:
+	BatchDriver(Method& method, const BatchLayout& layout);
+	BatchDriver(const BatchDriver&) = delete;
+	BatchDriver(BatchDriver&&)      = delete;
+	BatchDriver& operator=(const BatchDriver&) = delete;
+	BatchDriver& operator=(BatchDriver&&) = delete;
+	~BatchDriver();
+
+	void run(const void* pArgs, void* pResults, std::size_t count) const;
+	void run(const void* pArgs, void* pResults, std::size_t count, ThreadPool& pool, std::size_t grainSize = 4096) const;
+
+	auto& getLayout() const { return this->layout; }
+	// Entry point of the method the driver calls
+	auto getTarget() const { return this->pTarget; }
+
+private:
+	BatchLayout layout;
+	std::uint8_t* pTarget  = nullptr;
+	CodeHeap* pHeap        = nullptr;
+	CodeBlock* pBlock      = nullptr;
+	std::size_t codeLength = 0;
+	std::uint8_t* pCode    = nullptr;
+};
+
+template <class R, class... Ts>
+BatchLayout BatchLayout::Make() {
+	static_assert(sizeof...(Ts) <= 4, "Batched invocation only supports up to 4 register arguments");
+	static_assert(((std::is_integral_v<Ts> || std::is_enum_v<Ts> || std::is_pointer_v<Ts>) && ...), "Batched invocation only supports integer and pointer arguments");
+	static_assert(((sizeof(Ts) == 1 || sizeof(Ts) == 2 || sizeof(Ts) == 4 || sizeof(Ts) == 8) && ...));
+	static_assert(std::is_void_v<R> || std::is_integral_v<R> || std::is_enum_v<R> || std::is_pointer_v<R>, "Batched invocation only supports integer and pointer results");
+
+	BatchLayout layout;
+	layout.argStride = static_cast<std::uint32_t>(sizeof(std::tuple<Ts...>));
+	layout.argCount  = static_cast<std::uint8_t>(sizeof...(Ts));
+	if constexpr (!std::is_void_v<R>) {
+		static_assert(sizeof(R) == 1 || sizeof(R) == 2 || sizeof(R) == 4 || sizeof(R) == 8);
+		layout.resultStride = static_cast<std::uint32_t>(sizeof(R));
+		layout.resultSize   = static_cast<std::uint8_t>(sizeof(R));
+	}
+
+	// The element order inside a std::tuple is implementation defined, so measure it
+	std::tuple<Ts...> probe {};
+	auto pProbe = reinterpret_cast<const std::uint8_t*>(&probe);
+	[&]<std::size_t... Is>(std::index_sequence<Is...>) {
+		((layout.argOffsets[Is] = static_cast<std::uint8_t>(reinterpret_cast<const std::uint8_t*>(&std::get<Is>(probe)) - pProbe),
+		  layout.argSizes[Is]   = static_cast<std::uint8_t>(sizeof(std::tuple_element_t<Is, std::tuple<Ts...>>))),
+		 ...);
+	}(std::index_sequence_for<Ts...> {});
+	return layout;
+}
+
+template <class R, class... Ts>
+void Method::invokeBatch(std::type_identity_t<std::span<const std::tuple<Ts...>>> args, std::type_identity_t<std::span<R>> results, ThreadPool* pool) {
+	if (results.size() < args.size())
+		throw std::runtime_error("Batched invocation requires a result for every argument tuple");
+
+	std::optional<CodeHeap::InvocationScope> scope;
+	if (this->pInfo && this->pInfo->pHeap) scope.emplace(*this->pInfo->pHeap);
+	auto driver = getBatchDriver(BatchLayout::Make<R, Ts...>());
+	if (pool)
+		driver->run(args.data(), results.data(), args.size(), *pool);
+	else
+		driver->run(args.data(), results.data(), args.size());
+}
+
+template <class... Ts>
+void Method::invokeBatch(std::type_identity_t<std::span<const std::tuple<Ts...>>> args, ThreadPool* pool) {
+	std::optional<CodeHeap::InvocationScope> scope;
+	if (this->pInfo && this->pInfo->pHeap) scope.emplace(*this->pInfo->pHeap);
+	auto driver = getBatchDriver(BatchLayout::Make<void, Ts...>());
+	if (pool)
+		driver->run(args.data(), nullptr, args.size(), *pool);
+	else
+		driver->run(args.data(), nullptr, args.size());
+}
\ No newline at end of file
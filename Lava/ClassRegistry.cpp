@@ -1,12 +1,26 @@
 #include "ClassRegistry.h"
 #include "ByteBuffer.h"
+#include "Compression.h"
+#include "StubTemplates.h"
+#include "UTF8.h"
+#include "X64Decoder.h"
 
 #include <cassert>
 #include <cstring>
 
+#include <algorithm>
+#include <chrono>
 #include <set>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_set>
 
+static Class* loadClassVersion(ClassRegistry* registry, ByteBuffer& buffer, EClassLoadStatus* loadStatus);
 static Class* loadClassV1(ClassRegistry* registry, ByteBuffer& buffer, EClassLoadStatus* loadStatus);
+static Class* loadClassV2(ClassRegistry* registry, ByteBuffer& buffer, EClassLoadStatus* loadStatus);
+static bool readClassName(const ByteBuffer& buffer, std::string_view& className);
+static bool readClassNameV1(const ByteBuffer& buffer, std::string_view& className);
+static bool readClassNameV2(const ByteBuffer& buffer, std::string_view& className);
 
 std::ostream& operator<<(std::ostream& stream, EClassLoadStatus status) {
 	switch (status) {
@@ -17,6 +31,7 @@ std::ostream& operator<<(std::ostream& stream, EClassLoadStatus status) {
 	case EClassLoadStatus::InvalidConstantPool: return stream << "InvalidConstantPool";
 	case EClassLoadStatus::InvalidConstantPoolEntry: return stream << "InvalidConstantPoolEntry";
 	case EClassLoadStatus::InvalidThisClassEntry: return stream << "InvalidThisClassEntry";
+	case EClassLoadStatus::InvalidSuperClassEntry: return stream << "InvalidSuperClassEntry";
 	case EClassLoadStatus::InvalidFieldName: return stream << "InvalidFieldName";
 	case EClassLoadStatus::InvalidFieldDescriptor: return stream << "InvalidFieldDescriptor";
 	case EClassLoadStatus::InvalidAttributeName: return stream << "InvalidAttributeName";
@@ -24,48 +39,183 @@ std::ostream& operator<<(std::ostream& stream, EClassLoadStatus status) {
 	case EClassLoadStatus::InvalidMethodDescriptor: return stream << "InvalidMethodDescriptor";
 	case EClassLoadStatus::InvalidMethodRefClassName: return stream << "InvalidMethodRefClassName";
 	case EClassLoadStatus::InvalidMethodRefMethodDescriptor: return stream << "InvalidMethodRefMethodDescriptor";
+	case EClassLoadStatus::InvalidFieldRefClassName: return stream << "InvalidFieldRefClassName";
+	case EClassLoadStatus::InvalidFieldRefFieldName: return stream << "InvalidFieldRefFieldName";
+	case EClassLoadStatus::InvalidReadOnlyData: return stream << "InvalidReadOnlyData";
+	case EClassLoadStatus::InvalidSection: return stream << "InvalidSection";
+	case EClassLoadStatus::InvalidRelocation: return stream << "InvalidRelocation";
+	case EClassLoadStatus::InvalidCompressedCode: return stream << "InvalidCompressedCode";
+	case EClassLoadStatus::InvalidUTF8String: return stream << "InvalidUTF8String";
+	case EClassLoadStatus::IncompatibleClassReload: return stream << "IncompatibleClassReload";
+	case EClassLoadStatus::LinkFailed: return stream << "LinkFailed";
+	}
+	return stream;
+}
+
+std::ostream& operator<<(std::ostream& stream, EClassUnloadStatus status) {
+	switch (status) {
+	case EClassUnloadStatus::Success: return stream << "Success";
+	case EClassUnloadStatus::NotLoaded: return stream << "NotLoaded";
+	case EClassUnloadStatus::HasDependents: return stream << "HasDependents";
+	case EClassUnloadStatus::Deferred: return stream << "Deferred";
 	}
 	return stream;
 }
 
 ClassRegistry* globalClassRegistry = new ClassRegistry();
 
+ClassRegistry::~ClassRegistry() {
+	// Finish loads still in flight before the classes go away
+	this->loadThread.reset();
+	for (auto& clazz : this->classes)
+		delete clazz.second;
+}
+
 Class* ClassRegistry::newClass(const std::string& className) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
 	auto itr = this->classes.find(className);
 	if (itr != this->classes.end()) return nullptr;
 
-	Class* clazz = new Class();
+	Class* clazz = constructClass();
 	clazz->name  = className;
 	this->classes.insert({ className, clazz });
 	return clazz;
 }
 
+Class* ClassRegistry::constructClass() {
+	MetadataRegion* region = this->metadataArena.newRegion();
+	return new (*region) Class(*region);
+}
+
 void ClassRegistry::addClassPath(const std::filesystem::path classPath) {
 	this->classPaths.push_back(classPath);
 }
 
+void ClassRegistry::addClassSource(std::shared_ptr<ClassSource> classSource) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	this->classSources.push_back(std::move(classSource));
+}
+
 Class* ClassRegistry::getClass(const std::string& className) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
 	auto itr = this->classes.find(className);
 	if (itr != this->classes.end()) return itr->second;
 	return nullptr;
 }
 
 Class* ClassRegistry::loadClass(const std::string& className, EClassLoadStatus* loadStatus) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
 	// Look for the class in the registry
 	Class* clazz = getClass(className);
 	if (clazz) return clazz;
 
+	// Use the file read ahead of time if another class already refered to this one
+	auto readaheadItr = this->readaheadFiles.find(className);
+	if (readaheadItr != this->readaheadFiles.end()) {
+		ClassFile classFile = readaheadItr->second.classFile;
+		ByteBuffer buffer   = readReadaheadFile(readaheadItr->second);
+		this->readaheadFiles.erase(readaheadItr);
+
+		clazz = loadClassBuffer(buffer, loadStatus);
+		if (clazz) {
+			this->classes.insert({ std::string(clazz->name), clazz });
+			this->classFiles.insert({ std::string(clazz->name), classFile });
+		}
+		return clazz;
+	}
+
 	std::filesystem::path filename = findClass(className);
 	if (filename.empty()) {
-		// .lclass file was not found
-		if (loadStatus) *loadStatus = EClassLoadStatus::FileNotFound;
-		return nullptr;
+		ByteBuffer buffer;
+		if (!readClassFromSources(className, buffer)) {
+			// .lclass file was not found
+			if (loadStatus) *loadStatus = EClassLoadStatus::FileNotFound;
+			return nullptr;
+		}
+
+		// Classes from a class source have no file to hot reload from
+		clazz = loadClassBuffer(buffer, loadStatus);
+		if (clazz) this->classes.insert({ std::string(clazz->name), clazz });
+		return clazz;
+	}
+
+	// Remember the file and its write time before reading so later changes are picked up by hot reloading
+	std::error_code error;
+	auto lastWriteTime = std::filesystem::last_write_time(filename, error);
+
+	clazz = loadClassFile(filename, loadStatus);
+	if (clazz) {
+		this->classes.insert({ std::string(clazz->name), clazz });
+		this->classFiles.insert({ std::string(clazz->name), { filename, lastWriteTime } });
 	}
+	return clazz;
+}
+
+void ClassRegistry::readaheadClass(std::string_view className) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	if (!this->readahead) return;
+	std::string name(className);
+	if (getClass(name) || this->readaheadFiles.find(name) != this->readaheadFiles.end()) return;
+
+	std::filesystem::path filename = findClass(className);
+	if (filename.empty()) return;
+
+	// Only the read happens in the background, parsing and linking stay on the loading thread
+	std::error_code error;
+	auto lastWriteTime      = std::filesystem::last_write_time(filename, error);
+	auto claimed            = std::make_shared<std::atomic<bool>>(false);
+	auto promise            = std::make_shared<std::promise<ByteBuffer>>();
+	auto& readaheadFile     = this->readaheadFiles[std::move(name)];
+	readaheadFile.classFile = { filename, lastWriteTime };
+	readaheadFile.claimed   = claimed;
+	readaheadFile.buffer    = promise->get_future();
+	getThreadPool().submit([filename, claimed, promise]() {
+		if (claimed->exchange(true)) return;
+		ByteBuffer buffer;
+		buffer.readFromFile(filename);
+		promise->set_value(std::move(buffer));
+	});
+}
+
+ByteBuffer ClassRegistry::readReadaheadFile(ReadaheadFile& readaheadFile) {
+	// Read it here if no worker got to it yet
+	if (readaheadFile.claimed->exchange(true)) return readaheadFile.buffer.get();
+	ByteBuffer buffer;
+	buffer.readFromFile(readaheadFile.classFile.filename);
+	return buffer;
+}
 
+Class* ClassRegistry::loadClassFile(const std::filesystem::path& filename, EClassLoadStatus* loadStatus) {
 	// Read .lclass file into a ByteBuffer
 	ByteBuffer buffer;
 	buffer.readFromFile(filename);
+	return loadClassBuffer(buffer, loadStatus);
+}
+
+Class* ClassRegistry::loadClassBuffer(ByteBuffer& buffer, EClassLoadStatus* loadStatus) {
+	// Only the outermost load adds its time, loads of the classes it depends on are part of it. Linking can throw, so the depth
+	// is restored on the way out either way.
+	struct LoadTimer {
+		LoadTimer(ClassRegistry& registry) : registry(registry) { this->registry.loadDepth++; }
+		~LoadTimer() {
+			if (--this->registry.loadDepth == 0)
+				this->registry.loadStats.loadTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - this->start).count();
+		}
+
+		ClassRegistry& registry;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	};
+
+	Class* clazz = nullptr;
+	{
+		LoadTimer timer(*this);
+		clazz = loadClassVersion(this, buffer, loadStatus);
+	}
+	if (clazz) this->loadStats.classCount++;
+	return clazz;
+}
 
+static Class* loadClassVersion(ClassRegistry* registry, ByteBuffer& buffer, EClassLoadStatus* loadStatus) {
 	// Read magic number and check that it is the string "HOTL"
 	std::uint32_t magic = buffer.getUI4();
 	if (magic != 0x484F544C) {
@@ -77,15 +227,46 @@ Class* ClassRegistry::loadClass(const std::string& className, EClassLoadStatus*
 	// Read version and load class using that version
 	std::uint16_t version = buffer.getUI2();
 	switch (version) {
-	case 1:
-		clazz = loadClassV1(this, buffer, loadStatus);
-		break;
+	case 1: return loadClassV1(registry, buffer, loadStatus);
+	case 2: return loadClassV2(registry, buffer, loadStatus);
 	default:
 		// Version is not one of the loadable versions
 		if (loadStatus) *loadStatus = EClassLoadStatus::InvalidVersion;
 		return nullptr;
 	}
-	if (clazz) this->classes.insert({ clazz->name, clazz });
+}
+
+// Reads the name of the class without parsing the rest of the file, returns false if the file is not one that could be loaded
+static bool readClassName(const ByteBuffer& buffer, std::string_view& className) {
+	if (buffer.getUI4(0) != 0x484F544C) return false;
+	switch (buffer.getUI2(4)) {
+	case 1: return readClassNameV1(buffer, className);
+	case 2: return readClassNameV2(buffer, className);
+	default: return false;
+	}
+}
+
+Class* ClassRegistry::loadClassFromMemory(std::span<const std::uint8_t> classFile, EClassLoadStatus* loadStatus) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	ByteBuffer buffer(classFile);
+	// Hand out a loaded class before parsing and linking the file again
+	std::string_view className;
+	if (readClassName(buffer, className)) {
+		if (Class* loadedClazz = getClass(std::string(className))) {
+			if (loadStatus) *loadStatus = EClassLoadStatus::Success;
+			return loadedClazz;
+		}
+	}
+	Class* clazz = loadClassBuffer(buffer, loadStatus);
+	if (!clazz) return nullptr;
+
+	// Linking might have loaded a class of the same name from the class paths
+	if (Class* loadedClazz = getClass(std::string(clazz->name))) {
+		forgetClass(clazz);
+		delete clazz;
+		return loadedClazz;
+	}
+	this->classes.insert({ std::string(clazz->name), clazz });
 	return clazz;
 }
 
@@ -108,6 +289,113 @@ Class& ClassRegistry::loadClassErrorc(const char* className) {
 	return loadClassError(std::string(className));
 }
 
+std::shared_future<ClassLoadResult> ClassRegistry::loadClassAsync(const std::string& className, std::function<void(const ClassLoadResult&)> onLoaded) {
+	// Skip the round trip through the load thread for loaded classes, unless a load is holding the registry
+	std::unique_lock<std::recursive_mutex> lock(this->mutex, std::try_to_lock);
+	Class* clazz = lock.owns_lock() ? getClass(className) : nullptr;
+	if (lock.owns_lock()) lock.unlock();
+	if (clazz) {
+		ClassLoadResult result { clazz, EClassLoadStatus::Success };
+		std::promise<ClassLoadResult> promise;
+		promise.set_value(result);
+		if (onLoaded) onLoaded(result);
+		return promise.get_future().share();
+	}
+
+	std::lock_guard<std::mutex> pendingLock(this->pendingLoadsMutex);
+	auto itr = this->pendingLoads.find(className);
+	if (itr != this->pendingLoads.end()) {
+		// Join the load already in flight
+		if (onLoaded) itr->second.onLoaded.push_back(std::move(onLoaded));
+		return itr->second.result;
+	}
+
+	auto promise       = std::make_shared<std::promise<ClassLoadResult>>();
+	auto& pendingLoad  = this->pendingLoads[className];
+	pendingLoad.result = promise->get_future().share();
+	if (onLoaded) pendingLoad.onLoaded.push_back(std::move(onLoaded));
+
+	// Loads run one at a time on their own thread, so they never tie up the workers their readahead depends on
+	if (!this->loadThread) this->loadThread = std::make_unique<ThreadPool>(1);
+	this->loadThread->submit([this, className, promise]() {
+		ClassLoadResult result;
+		try {
+			result = loadClassInBackground(className);
+		} catch (...) {
+			// Linking throws when a class it calls cannot be loaded, the load still has to finish for everyone waiting on it
+			result = { nullptr, EClassLoadStatus::LinkFailed };
+		}
+		std::vector<std::function<void(const ClassLoadResult&)>> onLoaded;
+		{
+			std::lock_guard<std::mutex> pendingLock(this->pendingLoadsMutex);
+			auto itr = this->pendingLoads.find(className);
+			onLoaded = std::move(itr->second.onLoaded);
+			this->pendingLoads.erase(itr);
+		}
+		promise->set_value(result);
+		for (auto& callback : onLoaded)
+			callback(result);
+	});
+	return pendingLoad.result;
+}
+
+ClassLoadResult ClassRegistry::loadClassInBackground(const std::string& className) {
+	ClassLoadResult result;
+	ClassFile classFile;
+	ReadaheadFile readaheadFile;
+	{
+		std::lock_guard<std::recursive_mutex> lock(this->mutex);
+		result.clazz = getClass(className);
+		if (result.clazz) return result;
+
+		auto readaheadItr = this->readaheadFiles.find(className);
+		if (readaheadItr != this->readaheadFiles.end()) {
+			readaheadFile = std::move(readaheadItr->second);
+			this->readaheadFiles.erase(readaheadItr);
+		} else {
+			classFile.filename = findClass(className);
+			std::error_code error;
+			if (!classFile.filename.empty()) classFile.lastWriteTime = std::filesystem::last_write_time(classFile.filename, error);
+		}
+	}
+
+	// Read the file without holding the registry, only parsing and linking need it
+	ByteBuffer buffer;
+	if (readaheadFile.claimed) {
+		classFile = readaheadFile.classFile;
+		buffer    = readReadaheadFile(readaheadFile);
+	} else if (!classFile.filename.empty()) {
+		buffer.readFromFile(classFile.filename);
+	} else if (!readClassFromSources(className, buffer)) {
+		result.status = EClassLoadStatus::FileNotFound;
+		return result;
+	}
+
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	// Another thread might have loaded it synchronously in the meantime
+	result.clazz = getClass(className);
+	if (result.clazz) return result;
+	result.clazz = loadClassBuffer(buffer, &result.status);
+	if (result.clazz) {
+		this->classes.insert({ std::string(result.clazz->name), result.clazz });
+		if (!classFile.filename.empty()) this->classFiles.insert({ std::string(result.clazz->name), classFile });
+	}
+	return result;
+}
+
+bool ClassRegistry::ClassLoadAwaiter::await_ready() {
+	std::unique_lock<std::recursive_mutex> lock(this->registry.mutex, std::try_to_lock);
+	if (lock.owns_lock()) this->result.clazz = this->registry.getClass(this->className);
+	return this->result.clazz != nullptr;
+}
+
+void ClassRegistry::ClassLoadAwaiter::await_suspend(std::coroutine_handle<> handle) {
+	this->registry.loadClassAsync(this->className, [this, handle](const ClassLoadResult& result) {
+		this->result = result;
+		this->registry.getThreadPool().submit([handle]() { handle.resume(); });
+	});
+}
+
 Method& ClassRegistry::getMethodErrorc(const char* className, const char* methodName) {
 	Class& clazz = loadClassErrorc(className);
 	return clazz.getMethodErrorc(methodName);
@@ -118,7 +406,320 @@ Method& ClassRegistry::getMethodFromDescriptorErrorc(const char* className, cons
 	return clazz.getMethodFromDescriptorErrorc(methodDescriptor);
 }
 
+Method& ClassRegistry::resolveLazyCallc(LazyCall* lazyCall) {
+	if (Method* method = lazyCall->method.load(std::memory_order_acquire)) return *method;
+	// Unloading a class clears the calls resolved into it under the same lock
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	Method& method = loadClassError(lazyCall->className).getMethodFromDescriptorError(lazyCall->methodDescriptor);
+	lazyCall->method.store(&method, std::memory_order_release);
+	return method;
+}
+
+ThreadPool& ClassRegistry::getThreadPool() {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	if (!this->threadPool) this->threadPool = std::make_unique<ThreadPool>();
+	return *this->threadPool;
+}
+
+static bool isReloadCompatible(const Class& oldClass, const Class& newClass) {
+	// Instances and call sites outlive a reload, so only method bodies may change
+	if (oldClass.name != newClass.name || oldClass.supers != newClass.supers) return false;
+	if (oldClass.fields.size() != newClass.fields.size() || oldClass.methods.size() != newClass.methods.size()) return false;
+	for (std::size_t i = 0; i < oldClass.fields.size(); i++) {
+		auto& oldField = oldClass.fields[i];
+		auto& newField = newClass.fields[i];
+		if (oldField.name != newField.name || oldField.descriptor != newField.descriptor || oldField.accessFlags != newField.accessFlags || oldField.offset != newField.offset)
+			return false;
+	}
+	for (auto& oldMethod : oldClass.methods) {
+		auto itr = std::find_if(newClass.methods.begin(), newClass.methods.end(), [&](const Method& newMethod) -> bool {
+			return newMethod.pInfo->descriptor == oldMethod.pInfo->descriptor && newMethod.pInfo->name == oldMethod.pInfo->name;
+		});
+		if (itr == newClass.methods.end()) return false;
+	}
+	return true;
+}
+
+std::vector<std::string> ClassRegistry::getModifiedClasses() const {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	std::vector<std::string> modifiedClasses;
+	for (auto& classFile : this->classFiles) {
+		std::error_code error;
+		auto lastWriteTime = std::filesystem::last_write_time(classFile.second.filename, error);
+		if (!error && lastWriteTime != classFile.second.lastWriteTime)
+			modifiedClasses.push_back(classFile.first);
+	}
+	return modifiedClasses;
+}
+
+bool ClassRegistry::reloadClass(const std::string& className, EClassLoadStatus* loadStatus) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	Class* clazz  = getClass(className);
+	auto fileItr = this->classFiles.find(className);
+	if (!clazz || fileItr == this->classFiles.end()) {
+		// Only classes loaded from a file can be reloaded
+		if (loadStatus) *loadStatus = EClassLoadStatus::FileNotFound;
+		return false;
+	}
+	auto& classFile = fileItr->second;
+
+	std::error_code error;
+	auto lastWriteTime = std::filesystem::last_write_time(classFile.filename, error);
+	if (error) {
+		if (loadStatus) *loadStatus = EClassLoadStatus::FileNotFound;
+		return false;
+	}
+
+	// Parse and link the new version next to the old one, calls to its own class still resolve to the old methods
+	std::unique_ptr<Class> newClazz(loadClassFile(classFile.filename, loadStatus));
+	if (!newClazz) return false;
+
+	if (!isReloadCompatible(*clazz, *newClazz)) {
+		// Forget the call sites and dependencies of the rejected code before it is freed
+		forgetClass(newClazz.get());
+		if (loadStatus) *loadStatus = EClassLoadStatus::IncompatibleClassReload;
+		return false;
+	}
+
+	// The call sites inside the old code are retired with it, the ones in the new code move to the live methods
+	forgetClass(clazz);
+	for (auto& callSite : this->callSites) {
+		if (!newClazz->ownsMethod(callSite.second.caller)) continue;
+		auto method = std::find_if(clazz->methods.begin(), clazz->methods.end(), [&](const Method& method) -> bool {
+			return method.pInfo->descriptor == callSite.second.caller->pInfo->descriptor;
+		});
+		callSite.second.caller = &*method;
+	}
+	for (auto& dependent : this->dependents)
+		if (dependent.second == newClazz.get())
+			dependent.second = clazz;
+
+	// Swap in the new method bodies and the data they refer to, and point every linked call site at them
+	for (auto& method : clazz->methods) {
+		auto newMethod = std::find_if(newClazz->methods.begin(), newClazz->methods.end(), [&](const Method& newMethod) -> bool {
+			return newMethod.pInfo->descriptor == method.pInfo->descriptor;
+		});
+		method.swapCode(*newMethod);
+		retargetCallSites(&method);
+	}
+	clazz->swapReadOnlyData(*newClazz);
+	clazz->lazyCalls.swap(newClazz->lazyCalls);
+
+	// The old code might still be running, keep it until the next quiescent point
+	this->retiredClasses.push_back(std::move(newClazz));
+	classFile.lastWriteTime = lastWriteTime;
+	relinkInliningClasses();
+	if (loadStatus) *loadStatus = EClassLoadStatus::Success;
+	return true;
+}
+
+std::size_t ClassRegistry::hotReload() {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	std::size_t reloadedCount = 0;
+	for (auto& className : getModifiedClasses())
+		if (reloadClass(className))
+			reloadedCount++;
+	reclaimRetiredCode();
+	return reloadedCount;
+}
+
+EClassUnloadStatus ClassRegistry::unloadClass(const std::string& className) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	auto itr = this->classes.find(className);
+	if (itr == this->classes.end()) return EClassUnloadStatus::NotLoaded;
+	Class* clazz = itr->second;
+
+	// Classes that inherit from or directly call into this class would be left with dangling pointers
+	if (!getDependents(clazz).empty()) return EClassUnloadStatus::HasDependents;
+
+	// Make the class unreachable, lazy call stubs will load it again on their next call
+	this->classes.erase(itr);
+	this->classFiles.erase(className);
+	forgetClass(clazz);
+	for (auto& loaded : this->classes)
+		for (auto& lazyCall : loaded.second->lazyCalls)
+			if (clazz->ownsMethod(lazyCall->method.load()))
+				lazyCall->method.store(nullptr);
+
+	// Code of the class may still be running on another thread, so defer freeing it until the next quiescent point
+	this->retiredClasses.emplace_back(clazz);
+	if (reclaimRetiredCode() == 0) return EClassUnloadStatus::Deferred;
+	return EClassUnloadStatus::Success;
+}
+
+std::vector<Class*> ClassRegistry::getDependents(Class* clazz) const {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	std::vector<Class*> classes;
+	auto range = this->dependents.equal_range(clazz);
+	for (auto itr = range.first; itr != range.second; ++itr)
+		classes.push_back(itr->second);
+	return classes;
+}
+
+void ClassRegistry::addDependency(Class* dependent, Class* dependency) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	auto range = this->dependents.equal_range(dependency);
+	for (auto itr = range.first; itr != range.second; ++itr)
+		if (itr->second == dependent)
+			return;
+	this->dependents.insert({ dependency, dependent });
+}
+
+void ClassRegistry::forgetClass(Class* clazz) {
+	for (auto itr = this->callSites.begin(); itr != this->callSites.end();) {
+		if (clazz->ownsMethod(itr->second.caller))
+			itr = this->callSites.erase(itr);
+		else
+			++itr;
+	}
+	for (auto itr = this->dependents.begin(); itr != this->dependents.end();) {
+		if (itr->second == clazz)
+			itr = this->dependents.erase(itr);
+		else
+			++itr;
+	}
+}
+
+void ClassRegistry::relinkInliningClasses() {
+	// Relinking a class only makes the classes inlining it stale if the bodies they copied changed, so this settles
+	while (!this->staleInliningClasses.empty()) {
+		std::string className = *this->staleInliningClasses.begin();
+		this->staleInliningClasses.erase(this->staleInliningClasses.begin());
+		reloadClass(className);
+	}
+}
+
+std::size_t ClassRegistry::reclaimRetiredCode() {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	if (this->codeHeap.hasActiveInvocations()) return 0;
+	std::size_t reclaimedCount = this->retiredClasses.size();
+	this->retiredClasses.clear();
+	return reclaimedCount + this->codeHeap.reclaimRetired();
+}
+
+void ClassRegistry::addCallSite(const CallSite& callSite) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	this->callSites.insert({ callSite.callee, callSite });
+}
+
+void ClassRegistry::retargetCallSites(Method* callee) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	auto range = this->callSites.equal_range(callee);
+	for (auto itr = range.first; itr != range.second; ++itr) {
+		auto& callSite = itr->second;
+		if (callSite.inlined) {
+			// A copy of the old body cannot be patched, the calling class is linked again against the new one
+			std::uint64_t hash = callee->pInfo->inlinable ? CodeHeap::Hash(callee->pCode, callee->pInfo->inlineLength) : 0;
+			if (hash == callSite.inlinedHash) continue;
+			for (auto& clazz : this->classes)
+				if (clazz.second->ownsMethod(callSite.caller))
+					this->staleInliningClasses.insert(clazz.first);
+			continue;
+		}
+		if (auto pSlot = findImageSlot(callSite)) {
+			std::atomic_ref<std::uint8_t*>(*pSlot).store(callee->pCode);
+			continue;
+		}
+		// The caller might share its code with methods calling something else, its slot is written through the writable view
+		// of its region so the pages it runs from stay executable
+		std::uint8_t* pOldCode = callSite.caller->pCode;
+		callSite.caller->makeCodePatchable();
+		std::atomic_ref<std::uint8_t*>(*reinterpret_cast<std::uint8_t**>(callSite.caller->getWritableCode() + callSite.slotOffset)).store(callee->pCode);
+		// A near call has the old target encoded in the instruction, it goes back to calling through the slot
+		if (callSite.caller->pInfo->pBlock) callSite.caller->pInfo->pHeap->restoreIndirectCalls(callSite.caller->pInfo->pBlock, callSite.slotOffset);
+		// The callers of the caller still call the shared copy, which keeps calling the old code
+		if (callSite.caller->pCode != pOldCode) retargetCallSites(callSite.caller);
+	}
+}
+
+std::size_t ClassRegistry::applyCodeLayout(const CodeProfile& profile) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	std::vector<CodeBlock*> order;
+	std::unordered_set<CodeBlock*> placedBlocks;
+	auto placeMethod = [&](Method* method) {
+		if (method && method->pInfo->pBlock && placedBlocks.insert(method->pInfo->pBlock).second)
+			order.push_back(method->pInfo->pBlock);
+	};
+
+	// Hot code first, cold code after it
+	for (auto& entry : profile.getEntries())
+		if (Class* clazz = getClass(entry.className))
+			placeMethod(clazz->getMethodFromDescriptor(entry.methodDescriptor));
+	for (auto& clazz : this->classes)
+		for (auto& method : clazz.second->methods)
+			placeMethod(&method);
+	if (!this->codeHeap.relocate(order)) return 0;
+
+	// Every caller moved along, so patch the slots in place instead of splitting shared code apart
+	for (auto& callSite : this->callSites) {
+		if (callSite.second.inlined) continue;
+		Method* caller = callSite.second.caller;
+		Method* callee = callSite.second.callee;
+		auto pSlot     = findImageSlot(callSite.second);
+		if (!pSlot) pSlot = reinterpret_cast<std::uint8_t**>(caller->getWritableCode() + callSite.second.slotOffset);
+		std::atomic_ref<std::uint8_t*>(*pSlot).store(callee->pInfo->pBlock ? callee->pInfo->pBlock->pCode : callee->pCode);
+	}
+	// The near calls were placed while the slots still held the old targets, nothing runs the new copies yet
+	for (auto block : order)
+		this->codeHeap.relinkNearCalls(block);
+
+	for (auto& clazz : this->classes)
+		for (auto& method : clazz.second->methods)
+			if (method.pInfo->pBlock) method.pCode = method.pInfo->pBlock->pCode;
+
+	// The old copies might still be running
+	reclaimRetiredCode();
+	return order.size();
+}
+
+std::size_t ClassRegistry::applyCodeLayout(const std::filesystem::path& layoutFilename) {
+	CodeProfile profile;
+	if (!profile.readLayout(layoutFilename)) return 0;
+	return applyCodeLayout(profile);
+}
+
+std::size_t ClassRegistry::publishCodeImage(const std::filesystem::path& filename) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	if (this->codeImage || !CodeImage::publish(filename, getLoadedClasses())) return 0;
+	return mapCodeImage(filename);
+}
+
+std::size_t ClassRegistry::mapCodeImage(const std::filesystem::path& filename) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	// Methods switch over in place, which is only safe while none of them is running
+	if (this->codeImage || this->codeHeap.hasActiveInvocations()) return 0;
+	auto codeImage = std::make_unique<CodeImage>();
+	if (!codeImage->map(filename)) return 0;
+
+	// Only use the image if it holds exactly the code linked here, e.g. it was built from other class files
+	std::vector<std::pair<const CodeImageMethod*, Method*>> imageMethods;
+	for (auto& entry : codeImage->getMethods()) {
+		Class* clazz   = getClass(entry.className);
+		Method* method = clazz ? clazz->getMethodFromDescriptor(entry.methodDescriptor) : nullptr;
+		if (!method || !method->pInfo->pBlock || !codeImage->matches(entry, *method)) return 0;
+		imageMethods.push_back({ &entry, method });
+	}
+	for (auto& imageMethod : imageMethods)
+		codeImage->fillSlots(*imageMethod.first, *imageMethod.second);
+
+	// Run from the shared code and drop the private copies
+	for (auto& imageMethod : imageMethods) {
+		Method* method = imageMethod.second;
+		method->pInfo->pHeap->release(method->pInfo->pBlock);
+		method->pInfo->pBlock = nullptr;
+		method->pCode  = codeImage->getCode(*imageMethod.first);
+	}
+	this->codeImage = std::move(codeImage);
+
+	// Call site slots still point at the private copies
+	for (auto& imageMethod : imageMethods)
+		retargetCallSites(imageMethod.second);
+	relinkInliningClasses();
+	return imageMethods.size();
+}
+
 std::vector<Class*> ClassRegistry::getLoadedClasses() const {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
 	std::vector<Class*> classes;
 	classes.reserve(this->classes.size());
 	for (auto& clazz : this->classes)
@@ -139,6 +740,333 @@ std::filesystem::path ClassRegistry::findClass(std::string_view className) const
 	return {};
 }
 
+std::uint8_t** ClassRegistry::findImageSlot(const CallSite& callSite) const {
+	// Pointer slots of code in a shared image live in the private table of this process
+	if (!this->codeImage || !this->codeImage->owns(callSite.caller->pCode)) return nullptr;
+	return this->codeImage->findSlot(callSite.caller->pCode + callSite.slotOffset);
+}
+
+bool ClassRegistry::readClassFromSources(std::string_view className, ByteBuffer& buffer) {
+	std::vector<std::shared_ptr<ClassSource>> classSources;
+	{
+		std::lock_guard<std::recursive_mutex> lock(this->mutex);
+		classSources = this->classSources;
+	}
+	for (auto& classSource : classSources)
+		if (classSource->readClass(className, buffer))
+			return true;
+	return false;
+}
+
+//----------------
+// Method linking
+//----------------
+
+// A call to another method, the byte at 'byteOffset' in the method code is a placeholder for the call
+struct ClassMethodRef {
+	std::string className;
+	std::string methodDescriptor;
+	std::uint32_t byteOffset = 0;
+	// Resolved while linking, the vtable slot of the method in a loaded class or the LazyCall a get call stub goes through
+	std::uint32_t slot  = Class::InvalidSlot;
+	LazyCall* pLazyCall = nullptr;
+};
+
+// A RIP relative access to a static field, the 4 placeholder bytes at 'byteOffset' in the method code hold the number of
+// immediate bytes that follow them in the instruction and are replaced by the displacement of the field
+struct ClassFieldRef {
+	std::string className;
+	std::string fieldName;
+	std::uint32_t byteOffset = 0;
+};
+
+// A RIP relative access to the read only data section of the class, the placeholder works like the one of a fieldref
+struct ClassDataRef {
+	std::uint32_t dataOffset = 0;
+	std::uint32_t byteOffset = 0;
+};
+
+// Read only data sections are placed in page aligned code regions, so any power of two alignment up to a page holds, 0 asks
+// for the default of a cache line
+static bool isValidDataAlignment(std::uint32_t alignment) {
+	return alignment <= DataAlignment && (alignment & (alignment - 1)) == 0;
+}
+
+// Length of an instrumentation counter increment and of the one placed in method prologues
+static constexpr std::size_t CounterLength       = CounterStub.Length;
+static constexpr std::size_t MethodCounterLength = MethodCounterStub.Length;
+// Get call stubs call through the method they resolved without a displacement
+static_assert(offsetof(Method, pCode) == 0);
+
+// Rewrites the methodref placeholders in the code into calls and resolves the fieldrefs and datarefs, then allocates the final code of the method
+static void linkMethodCode(ClassRegistry* registry, Class& clazz, Method& method, std::vector<std::uint8_t>& code, std::vector<ClassMethodRef>& methodRefs, std::vector<ClassFieldRef>& fieldRefs, std::vector<ClassDataRef>& dataRefs, std::set<Class*>& dependencies, std::vector<CallSite>& callSites) {
+	// Constants
+	std::uintptr_t classRegistryAddr    = reinterpret_cast<std::uintptr_t>(registry);
+	std::uintptr_t resolveLazyCallcAddr = LavaUBCast<decltype(&ClassRegistry::resolveLazyCallc), std::uintptr_t>(&ClassRegistry::resolveLazyCallc).right;
+	std::size_t codeLength              = code.size();
+	std::size_t getCallLength           = GetCallStub.Length;
+	std::size_t directCallLength        = DirectCallStub.Length;
+	std::size_t callLength              = 0;
+	std::size_t dataLength              = 0;
+	std::unordered_map<std::uintptr_t, std::size_t> ptrs;
+	std::unordered_map<Method*, std::size_t> methodPtrs;
+	std::set<std::string> loadedClasses;
+	std::vector<std::uint32_t> slotReferences;
+	std::vector<CodeLiteral> literals;
+	std::vector<CodeNearCall> nearCalls;
+	std::vector<CodeDataReference> dataReferences;
+	std::size_t callSitesBegin = callSites.size();
+
+	// With literal pools the constants of get call stubs are shared by all code in the region instead of copied after every method
+	bool pooledLiterals = registry->getCodeHeap().getLiteralPools();
+	auto addLiteral     = [&](std::size_t stubBegin, StubPatchPoint patchPoint, const void* pValue, std::size_t length) {
+		literals.push_back({ static_cast<std::uint32_t>(stubBegin + patchPoint.offset), static_cast<std::uint32_t>(stubBegin + patchPoint.end), std::string(reinterpret_cast<const char*>(pValue), length) });
+	};
+
+	// Instrumented code increments a counter in front of every call and at the start of the method
+	bool instrumented         = registry->getInstrumented();
+	std::size_t counterLength = instrumented ? CounterLength : 0;
+	auto writeCounter         = [&](const auto& stub, std::size_t counterBegin, EInvocationCounterKind kind, const ClassMethodRef& methodRef) {
+		if (!instrumented) return;
+		auto counter = registry->getInvocationCounters().allocate({ kind, std::string(clazz.name), std::string(method.pInfo->descriptor), methodRef.className, methodRef.methodDescriptor, methodRef.byteOffset });
+		if (!counter) {
+			// Out of counters, leave the space as NOPs
+			std::memset(code.data() + counterBegin, 0x90, stub.Length);
+			return;
+		}
+		stub.emit(code.data() + counterBegin);
+		stub.patchImm64(code.data() + counterBegin, stub.patchPoints.counter, reinterpret_cast<std::uintptr_t>(counter));
+	};
+
+	// Small leaf methods of other classes are copied into their call sites, counting calls needs the call to stay
+	std::size_t inlineThreshold = instrumented ? 0 : registry->getInlineThreshold();
+	auto isInlined              = [&](const ClassMethodRef& methodRef, Method* callee) {
+		return inlineThreshold && callee->pInfo->inlinable && callee->pInfo->inlineLength <= inlineThreshold && methodRef.className != std::string_view(clazz.name);
+	};
+	// Instrumented code starts with its counter, so a copy of its first bytes would not be the body
+	method.pInfo->inlinable = !instrumented && methodRefs.empty() && fieldRefs.empty() && dataRefs.empty() && isInlinableLeaf(code.data(), codeLength, method.pInfo->inlineLength);
+
+	// Reads the placeholder at 'byteOffset' and lets the heap fill in the displacement of 'target' wherever it places the code
+	auto addDataReference = [&](std::uint32_t byteOffset, const std::uint8_t* target) -> bool {
+		// Immediates after the displacement are at most 4 bytes, an out of bounds placeholder fails the same check
+		std::uint32_t immediateLength = ~0U;
+		if (byteOffset <= codeLength && codeLength - byteOffset >= 4)
+			std::memcpy(&immediateLength, code.data() + byteOffset, 4);
+		if (immediateLength > 4 || codeLength - byteOffset - 4 < immediateLength) return false;
+		dataReferences.push_back({ byteOffset, byteOffset + 4 + immediateLength, reinterpret_cast<std::uintptr_t>(target) });
+		return true;
+	};
+
+	// Resolve the accessed static fields
+	for (auto& fieldRef : fieldRefs) {
+
+		// A class being reloaded keeps using the storage of the live version, so the values of its static fields survive
+		Class* fieldRefClass = nullptr;
+		if (fieldRef.className == std::string_view(clazz.name)) {
+			fieldRefClass = registry->getClass(fieldRef.className);
+			if (!fieldRefClass) fieldRefClass = &clazz;
+		} else {
+			fieldRefClass = &registry->loadClassError(fieldRef.className);
+			dependencies.insert(fieldRefClass);
+		}
+		Field* field = fieldRefClass->getField(fieldRef.fieldName);
+		if (!field || !(field->accessFlags & EAccessFlag::Static))
+			throw std::runtime_error("Method wants to access a nonexistant static field '" + fieldRef.fieldName + "' in class '" + fieldRef.className + "'");
+		if (!addDataReference(fieldRef.byteOffset, fieldRefClass->pStaticData + field->offset))
+			throw std::runtime_error("Method has an invalid reference to static field '" + fieldRef.fieldName + "' in class '" + fieldRef.className + "'");
+	}
+
+	// Resolve the accessed read only data, a reloaded class brings its own section which moves to the live class with the code
+	for (auto& dataRef : dataRefs) {
+		if (dataRef.dataOffset >= clazz.readOnlySize || !addDataReference(dataRef.byteOffset, clazz.pReadOnlyData + dataRef.dataOffset))
+			throw std::runtime_error("Method has an invalid reference to read only data at offset " + std::to_string(dataRef.dataOffset) + " in class '" + std::string(clazz.name) + "'");
+	}
+
+	// Keeps the data references on their instructions while the placeholder at 'callBegin' grows into 'length' bytes
+	auto expandPlaceholder = [&](std::size_t callBegin, std::size_t length) {
+		for (auto& dataReference : dataReferences) {
+			if (callBegin >= dataReference.referenceOffset && callBegin < dataReference.referenceEnd)
+				throw std::runtime_error("Method has a methodref inside of a static field or read only data access");
+			if (dataReference.referenceOffset < callBegin) continue;
+			dataReference.referenceOffset += static_cast<std::uint32_t>(length - 1);
+			dataReference.referenceEnd += static_cast<std::uint32_t>(length - 1);
+		}
+	};
+
+	// Sort method refs based on their byte offset
+	std::sort(methodRefs.begin(), methodRefs.end(), [](ClassMethodRef& lhs, ClassMethodRef& rhs) -> bool {
+		return lhs.byteOffset < rhs.byteOffset;
+	});
+
+	// Check how much space each method ref requires to call
+	for (auto& methodRef : methodRefs) {
+		Class* methodRefClass = registry->getClass(methodRef.className);
+		if (!methodRefClass && !registry->getPreloadRequiredClasses()) {
+			callLength += counterLength + getCallLength;
+			methodRef.pLazyCall = clazz.lazyCalls.emplace_back(std::make_unique<LazyCall>(methodRef.className, methodRef.methodDescriptor)).get();
+			if (pooledLiterals) continue;
+			ptrs.insert({ classRegistryAddr, 0 });
+			ptrs.insert({ reinterpret_cast<std::uintptr_t>(methodRef.pLazyCall), 0 });
+			ptrs.insert({ resolveLazyCallcAddr, 0 });
+			continue;
+		} else {
+			methodRefClass = &registry->loadClassError(methodRef.className);
+		}
+		loadedClasses.insert(methodRef.className);
+		dependencies.insert(methodRefClass);
+		// Loaded classes are linked, so the call is resolved through the vtable once and the slot is used from here on
+		methodRef.slot          = methodRefClass->getVTableSlot(methodRef.methodDescriptor);
+		Method* methodRefMethod = methodRefClass->getVirtualMethod(methodRef.slot);
+		if (!methodRefMethod)
+			throw std::runtime_error("Method wants to invoke a nonexistant method '" + methodRef.methodDescriptor + "' in class '" + methodRef.className + "'");
+		if (isInlined(methodRef, methodRefMethod)) {
+			callLength += methodRefMethod->pInfo->inlineLength;
+			continue;
+		}
+		callLength += counterLength + directCallLength;
+		methodPtrs.insert({ methodRefMethod, 0 });
+	}
+
+	// Check how much space the pointers require
+	dataLength += 8 * (ptrs.size() + methodPtrs.size());
+
+	// Keep the pointers 8 byte aligned so call sites can be retargeted with a single store
+	std::size_t dataBegin = (codeLength + callLength + 7) & ~static_cast<std::size_t>(7);
+	// Resize the code to the new length
+	code.resize(dataBegin + dataLength, 0);
+	auto pCode = code.data();
+
+	// Write the points into the code
+	std::size_t dataOffset = 0;
+	for (auto& ptr : ptrs) {
+		std::memcpy(pCode + dataBegin + dataOffset, &ptr.first, 8);
+		ptr.second = dataOffset;
+		dataOffset += 8;
+	}
+
+	// Write the addresses of directly called methods into the code, each callee gets its own slot so it can be retargeted
+	for (auto& methodPtr : methodPtrs) {
+		std::memcpy(pCode + dataBegin + dataOffset, &methodPtr.first->pCode, 8);
+		methodPtr.second = dataOffset;
+		callSites.push_back({ &method, methodPtr.first, dataBegin + dataOffset });
+		dataOffset += 8;
+	}
+
+	// Write the method invocations into the code
+	std::size_t offset = 0;
+	for (auto& methodRef : methodRefs) {
+		std::size_t callBegin = offset + methodRef.byteOffset;
+		// If method refers to an already loaded class optimize the call to the direct call, else use the get call
+		if (loadedClasses.find(methodRef.className) != loadedClasses.end()) {
+			Class* methodRefClass   = registry->getClass(methodRef.className);
+			Method* methodRefMethod = methodRefClass->getVirtualMethod(methodRef.slot);
+			if (isInlined(methodRef, methodRefMethod)) {
+				// Copy the body without its RET in place of the call, the registry relinks this class if the body changes
+				std::size_t inlineLength = methodRefMethod->pInfo->inlineLength;
+				std::memmove(pCode + callBegin + inlineLength, pCode + callBegin + 1, codeLength - methodRef.byteOffset - 1);
+				expandPlaceholder(callBegin, inlineLength);
+				std::memcpy(pCode + callBegin, methodRefMethod->pCode, inlineLength);
+				callSites.push_back({ &method, methodRefMethod, 0, true, CodeHeap::Hash(methodRefMethod->pCode, inlineLength) });
+				offset += inlineLength;
+				continue;
+			}
+
+			// Move bytes after call
+			std::memmove(pCode + callBegin + counterLength + directCallLength, pCode + callBegin + 1, codeLength - methodRef.byteOffset - 1);
+			expandPlaceholder(callBegin, counterLength + directCallLength);
+			writeCounter(CounterStub, callBegin, EInvocationCounterKind::DirectCalls, methodRef);
+			callBegin += counterLength;
+
+			// Create the call in assembly
+
+			auto& patchPoints = DirectCallStub.patchPoints;
+			DirectCallStub.emit(pCode + callBegin);
+			DirectCallStub.patchRipRelative(pCode + callBegin, patchPoints.slot, dataBegin + methodPtrs.find(methodRefMethod)->second - callBegin);
+			slotReferences.push_back(static_cast<std::uint32_t>(callBegin + patchPoints.slot.offset));
+			// The heap calls the target directly if the code ends up in reach of it, the slot stays as the fallback
+			nearCalls.push_back({ static_cast<std::uint32_t>(callBegin), static_cast<std::uint32_t>(dataBegin + methodPtrs.find(methodRefMethod)->second) });
+			offset += counterLength + directCallLength;
+		} else { // Use the worse in every way get call :|
+			// Move bytes after call
+			std::memmove(pCode + callBegin + counterLength + getCallLength, pCode + callBegin + 1, codeLength - methodRef.byteOffset - 1);
+			expandPlaceholder(callBegin, counterLength + getCallLength);
+
+			// Every call through this stub takes the slow path
+			writeCounter(CounterStub, callBegin, EInvocationCounterKind::SlowPathResolutions, methodRef);
+			callBegin += counterLength;
+
+			// Create the call from the stub and point it at the data after the code, or at the literal pool once the code is placed
+			auto& patchPoints = GetCallStub.patchPoints;
+			GetCallStub.emit(pCode + callBegin);
+			if (pooledLiterals) {
+				// Strings keep their terminator in the pool
+				addLiteral(callBegin, patchPoints.classRegistry, &classRegistryAddr, 8);
+				addLiteral(callBegin, patchPoints.lazyCall, &methodRef.pLazyCall, 8);
+				addLiteral(callBegin, patchPoints.resolve, &resolveLazyCallcAddr, 8);
+				offset += counterLength + getCallLength;
+				continue;
+			}
+			GetCallStub.patchRipRelative(pCode + callBegin, patchPoints.classRegistry, dataBegin + ptrs.find(classRegistryAddr)->second - callBegin);
+			GetCallStub.patchRipRelative(pCode + callBegin, patchPoints.lazyCall, dataBegin + ptrs.find(reinterpret_cast<std::uintptr_t>(methodRef.pLazyCall))->second - callBegin);
+			GetCallStub.patchRipRelative(pCode + callBegin, patchPoints.resolve, dataBegin + ptrs.find(resolveLazyCallcAddr)->second - callBegin);
+			slotReferences.push_back(static_cast<std::uint32_t>(callBegin + patchPoints.classRegistry.offset));
+			slotReferences.push_back(static_cast<std::uint32_t>(callBegin + patchPoints.lazyCall.offset));
+			slotReferences.push_back(static_cast<std::uint32_t>(callBegin + patchPoints.resolve.offset));
+			offset += counterLength + getCallLength;
+		}
+	}
+
+	if (instrumented) {
+		// Count calls into the method, padded to 16 bytes so the pointer slots stay 8 byte aligned
+		code.insert(code.begin(), MethodCounterLength, 0x90);
+		writeCounter(MethodCounterStub, 0, EInvocationCounterKind::MethodCalls, {});
+		for (std::size_t j = callSitesBegin; j < callSites.size(); j++)
+			callSites[j].slotOffset += MethodCounterLength;
+		for (auto& slotReference : slotReferences)
+			slotReference += MethodCounterLength;
+		for (auto& literal : literals) {
+			literal.referenceOffset += MethodCounterLength;
+			literal.referenceEnd += MethodCounterLength;
+		}
+		for (auto& nearCall : nearCalls) {
+			nearCall.callOffset += MethodCounterLength;
+			nearCall.slotOffset += MethodCounterLength;
+		}
+		for (auto& dataReference : dataReferences) {
+			dataReference.referenceOffset += MethodCounterLength;
+			dataReference.referenceEnd += MethodCounterLength;
+		}
+	}
+
+	method.pInfo->slotReferences.assign(slotReferences.begin(), slotReferences.end());
+	method.allocateCode(registry->getCodeHeap(), code, literals, nearCalls, dataReferences);
+}
+
+// Compressed code starts with its uncompressed length followed by an LZ block, it is decompressed straight into 'code'
+static bool decompressCode(const std::uint8_t* pData, std::size_t length, std::vector<std::uint8_t>& code) {
+	if (length < 4) return false;
+	std::size_t codeLength = pData[0] | pData[1] << 8 | pData[2] << 16 | static_cast<std::size_t>(pData[3]) << 24;
+	// No block expands a byte into more than 255 bytes, so reject lengths that cannot be real before allocating them
+	if (codeLength / 255 > length) return false;
+	code.resize(codeLength);
+	return decompressLZ(pData + 4, length - 4, code.data(), codeLength);
+}
+
+// Links a class whose methods all have their code and registers what it depends on, it can no longer fail to load
+static Class* finishClass(ClassRegistry* registry, std::unique_ptr<Class> clazz, const std::set<Class*>& dependencies, const std::vector<CallSite>& callSites, EClassLoadStatus* loadStatus) {
+	// Build the flattened dispatch table now that every method has its code
+	clazz->link();
+
+	for (auto dependency : dependencies)
+		registry->addDependency(clazz.get(), dependency);
+	for (auto& callSite : callSites)
+		registry->addCallSite(callSite);
+
+	// Return class
+	if (loadStatus) *loadStatus = EClassLoadStatus::Success;
+	return clazz.release();
+}
+
 //-------------------
 // LClass Version 1
 //-------------------
@@ -149,6 +1077,7 @@ static constexpr std::uint8_t ClassConstantUTF8EntryV1Tag  = 2;
 struct ClassConstantPoolEntryV1 {
 public:
 	ClassConstantPoolEntryV1(std::uint8_t tag) : tag(tag) { }
+	virtual ~ClassConstantPoolEntryV1() = default;
 
 	std::uint8_t getTag() const { return this->tag; }
 
@@ -172,32 +1101,44 @@ struct ClassConstantPoolV1 {
 public:
 	void reserve(std::size_t size) { this->entries.reserve(size); }
 	std::size_t size() const { return this->entries.size(); }
-	void addEntry(ClassConstantPoolEntryV1* entry) { this->entries.push_back(entry); }
+	void addEntry(std::unique_ptr<ClassConstantPoolEntryV1>&& entry) { this->entries.push_back(std::move(entry)); }
 	ClassConstantPoolEntryV1* getEntry(std::size_t index) const {
 		if (index == 0 || index > this->entries.size()) return nullptr;
-		return this->entries[index - 1];
+		return this->entries[index - 1].get();
 	}
 
 	bool validate() const {
 		// Loop through all entries in the constant pool
 		// Check if it is a valid tag and if the entry is valid
-		for (auto entry : this->entries) {
+		for (auto& entry : this->entries) {
 			switch (entry->getTag()) {
 			case ClassConstantClassEntryV1Tag: {
 				// Check if the Class tag is pointing to a UTF8 tag
-				auto clazzEntry = reinterpret_cast<ClassConstantClassEntryV1*>(entry);
+				auto clazzEntry = reinterpret_cast<ClassConstantClassEntryV1*>(entry.get());
 				auto nameEntry  = getEntry(clazzEntry->nameIndex);
 				if (!nameEntry || nameEntry->getTag() != ClassConstantUTF8EntryV1Tag)
 					return false;
 				break;
 			}
-			case ClassConstantUTF8EntryV1Tag: break; // UTF8 tag's are always valid
+			case ClassConstantUTF8EntryV1Tag: break; // UTF8 tag's are checked by validateStrings
 			default: return false;
 			}
 		}
 		return true;
 	}
 
+	bool validateStrings(std::size_t& validatedBytes) const {
+		// Check every string where it is, a sequence can not run into the next string
+		validatedBytes = 0;
+		for (auto& entry : this->entries) {
+			if (entry->getTag() != ClassConstantUTF8EntryV1Tag) continue;
+			auto& string = reinterpret_cast<ClassConstantUTF8EntryV1*>(entry.get())->string;
+			validatedBytes += string.size();
+			if (!validateUTF8(reinterpret_cast<const std::uint8_t*>(string.data()), string.size())) return false;
+		}
+		return true;
+	}
+
 	auto begin() { return this->entries.begin(); }
 	auto begin() const { return this->entries.begin(); }
 	auto cbegin() const { return this->entries.cbegin(); }
@@ -212,17 +1153,17 @@ public:
 	auto crend() const { return this->entries.crend(); }
 
 private:
-	std::vector<ClassConstantPoolEntryV1*> entries;
+	std::vector<std::unique_ptr<ClassConstantPoolEntryV1>> entries;
 };
 
-ClassConstantPoolEntryV1* readConstantPoolEntryV1(ByteBuffer& buffer, EClassLoadStatus* loadStatus) {
+std::unique_ptr<ClassConstantPoolEntryV1> readConstantPoolEntryV1(ByteBuffer& buffer, EClassLoadStatus* loadStatus) {
 	// Get tag and construct the specified entry
 	std::uint8_t tag = buffer.getUI1();
 	switch (tag) {
-	case ClassConstantClassEntryV1Tag: return new ClassConstantClassEntryV1(buffer.getUI2());
+	case ClassConstantClassEntryV1Tag: return std::make_unique<ClassConstantClassEntryV1>(buffer.getUI2());
 	case ClassConstantUTF8EntryV1Tag: {
 		std::uint32_t length = buffer.getUI4();
-		return new ClassConstantUTF8EntryV1(buffer.getString(length));
+		return std::make_unique<ClassConstantUTF8EntryV1>(buffer.getString(length));
 	}
 	default:
 		if (loadStatus) *loadStatus = EClassLoadStatus::InvalidConstantPoolEntry;
@@ -232,6 +1173,7 @@ ClassConstantPoolEntryV1* readConstantPoolEntryV1(ByteBuffer& buffer, EClassLoad
 
 struct ClassAttributeV1 {
 	ClassAttributeV1(std::string&& name) : name(std::move(name)) { }
+	virtual ~ClassAttributeV1() = default;
 
 	std::string name;
 };
@@ -256,27 +1198,43 @@ struct ClassAttributeMethodRefV1 : public ClassAttributeV1 {
 	std::uint32_t byteOffset;
 };
 
+struct ClassAttributeFieldRefV1 : public ClassAttributeV1 {
+	ClassAttributeFieldRefV1(std::uint16_t classNameIndex, std::uint16_t fieldNameIndex, std::uint32_t byteOffset) : ClassAttributeV1("fieldref"), classNameIndex(classNameIndex), fieldNameIndex(fieldNameIndex), byteOffset(byteOffset) { }
+
+	std::uint16_t classNameIndex;
+	std::uint16_t fieldNameIndex;
+	std::uint32_t byteOffset;
+};
+
+struct ClassAttributeReadOnlyDataV1 : public ClassAttributeV1 {
+	ClassAttributeReadOnlyDataV1(std::uint32_t alignment, std::vector<std::uint8_t>&& data) : ClassAttributeV1("rodata"), alignment(alignment), data(std::move(data)) { }
+
+	std::uint32_t alignment;
+	std::vector<std::uint8_t> data;
+};
+
+struct ClassAttributeDataRefV1 : public ClassAttributeV1 {
+	ClassAttributeDataRefV1(std::uint32_t dataOffset, std::uint32_t byteOffset) : ClassAttributeV1("dataref"), dataOffset(dataOffset), byteOffset(byteOffset) { }
+
+	std::uint32_t dataOffset;
+	std::uint32_t byteOffset;
+};
+
 struct ClassFieldEntryV1 {
 	EAccessFlags accessFlags = 0;
 	std::string name;
 	std::string descriptor;
-	std::vector<ClassAttributeV1*> attributes;
+	std::vector<std::unique_ptr<ClassAttributeV1>> attributes;
 };
 
 struct ClassMethodEntryV1 {
 	EAccessFlags accessFlags = 0;
 	std::string name;
 	std::string descriptor;
-	std::vector<ClassAttributeV1*> attributes;
+	std::vector<std::unique_ptr<ClassAttributeV1>> attributes;
 };
 
-struct ClassMethodRefV1 {
-	std::string className;
-	std::string methodDescriptor;
-	std::uint32_t byteOffset = 0;
-};
-
-ClassAttributeV1* readAttributeEntryV1(ByteBuffer& buffer, ClassConstantPoolV1& constantPool, EClassLoadStatus* loadStatus) {
+std::unique_ptr<ClassAttributeV1> readAttributeEntryV1(ByteBuffer& buffer, ClassConstantPoolV1& constantPool, EClassLoadStatus* loadStatus) {
 	// Get attribute name
 	auto attributeNameEntry = constantPool.getEntry(buffer.getUI2());
 	if (!attributeNameEntry || attributeNameEntry->getTag() != ClassConstantUTF8EntryV1Tag) {
@@ -293,17 +1251,73 @@ ClassAttributeV1* readAttributeEntryV1(ByteBuffer& buffer, ClassConstantPoolV1&
 	if (name == "code") {
 		std::vector<std::uint8_t> code;
 		buffer.getUI1s(code, attributeLength);
-		return new ClassAttributeMethodCodeV1(std::move(code));
+		return std::make_unique<ClassAttributeMethodCodeV1>(std::move(code));
+	} else if (name == "lzcode") {
+		std::size_t offset = buffer.getOffset();
+		if (attributeLength > buffer.size() - offset) {
+			if (loadStatus) *loadStatus = EClassLoadStatus::InvalidCompressedCode;
+			return {};
+		}
+		std::vector<std::uint8_t> code;
+		buffer.setOffset(offset + attributeLength);
+		if (!decompressCode(buffer.data() + offset, attributeLength, code)) {
+			if (loadStatus) *loadStatus = EClassLoadStatus::InvalidCompressedCode;
+			return {};
+		}
+		return std::make_unique<ClassAttributeMethodCodeV1>(std::move(code));
 	} else if (name == "methodref") {
 		std::uint16_t classNameIndex        = buffer.getUI2();
 		std::uint16_t methodDescriptorIndex = buffer.getUI2();
 		std::uint32_t byteOffset            = buffer.getUI4();
-		return new ClassAttributeMethodRefV1(classNameIndex, methodDescriptorIndex, byteOffset);
+		return std::make_unique<ClassAttributeMethodRefV1>(classNameIndex, methodDescriptorIndex, byteOffset);
+	} else if (name == "fieldref") {
+		std::uint16_t classNameIndex = buffer.getUI2();
+		std::uint16_t fieldNameIndex = buffer.getUI2();
+		std::uint32_t byteOffset     = buffer.getUI4();
+		return std::make_unique<ClassAttributeFieldRefV1>(classNameIndex, fieldNameIndex, byteOffset);
+	} else if (name == "rodata") {
+		if (attributeLength < 4 || attributeLength > buffer.size() - buffer.getOffset()) {
+			if (loadStatus) *loadStatus = EClassLoadStatus::InvalidReadOnlyData;
+			return {};
+		}
+		std::uint32_t alignment = buffer.getUI4();
+		std::vector<std::uint8_t> data;
+		buffer.getUI1s(data, attributeLength - 4);
+		return std::make_unique<ClassAttributeReadOnlyDataV1>(alignment, std::move(data));
+	} else if (name == "dataref") {
+		std::uint32_t dataOffset = buffer.getUI4();
+		std::uint32_t byteOffset = buffer.getUI4();
+		return std::make_unique<ClassAttributeDataRefV1>(dataOffset, byteOffset);
 	} else {
 		std::vector<std::uint8_t> info;
 		buffer.getUI1s(info, attributeLength);
-		return new ClassAttributeUnknownV1(std::string(name), std::move(info));
+		return std::make_unique<ClassAttributeUnknownV1>(std::string(name), std::move(info));
+	}
+}
+
+bool readClassNameV1(const ByteBuffer& buffer, std::string_view& className) {
+	// Only the offsets of the constant pool entries are needed to follow the this class entry to its name
+	std::size_t entryCount = buffer.getUI2(6);
+	std::size_t position   = 8;
+	std::vector<std::size_t> entries;
+	entries.reserve(entryCount);
+	for (std::size_t i = 1; i < entryCount; i++) {
+		if (position >= buffer.size()) return false;
+		entries.push_back(position);
+		switch (buffer.getUI1(position)) {
+		case ClassConstantClassEntryV1Tag: position += 3; break;
+		case ClassConstantUTF8EntryV1Tag: position += 5 + static_cast<std::size_t>(buffer.getUI4(position + 1)); break;
+		default: return false;
+		}
 	}
+
+	// The access flags come before the this class index
+	std::size_t thisClass = buffer.getUI2(position + 2);
+	if (thisClass == 0 || thisClass > entries.size() || buffer.getUI1(entries[thisClass - 1]) != ClassConstantClassEntryV1Tag) return false;
+	std::size_t name = buffer.getUI2(entries[thisClass - 1] + 1);
+	if (name == 0 || name > entries.size() || buffer.getUI1(entries[name - 1]) != ClassConstantUTF8EntryV1Tag) return false;
+	className = buffer.getString(entries[name - 1] + 5, buffer.getUI4(entries[name - 1] + 1));
+	return true;
 }
 
 Class* loadClassV1(ClassRegistry* registry, ByteBuffer& buffer, EClassLoadStatus* loadStatus) {
@@ -315,7 +1329,7 @@ Class* loadClassV1(ClassRegistry* registry, ByteBuffer& buffer, EClassLoadStatus
 		// Try to read a constant pool entry and add it to the constant pool
 		auto entry = readConstantPoolEntryV1(buffer, loadStatus);
 		if (!entry) return nullptr;
-		constantPool.addEntry(entry);
+		constantPool.addEntry(std::move(entry));
 	}
 
 	// Validate the constant pool
@@ -325,6 +1339,19 @@ Class* loadClassV1(ClassRegistry* registry, ByteBuffer& buffer, EClassLoadStatus
 		return nullptr;
 	}
 
+	// Validate the strings in the constant pool
+	auto validationStart       = std::chrono::steady_clock::now();
+	std::size_t validatedBytes = 0;
+	bool validStrings          = constantPool.validateStrings(validatedBytes);
+	auto& loadStats            = registry->getLoadStats();
+	loadStats.validationTime  += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - validationStart).count();
+	loadStats.validatedBytes  += validatedBytes;
+	if (!validStrings) {
+		// A string in the constant pool is not well formed UTF-8
+		if (loadStatus) *loadStatus = EClassLoadStatus::InvalidUTF8String;
+		return nullptr;
+	}
+
 	// Read class access flags and an index into the constant pool pointing to a Class tag
 	EAccessFlags accessFlags = buffer.getUI2();
 	auto thisClassEntry      = constantPool.getEntry(buffer.getUI2());
@@ -333,6 +1360,7 @@ Class* loadClassV1(ClassRegistry* registry, ByteBuffer& buffer, EClassLoadStatus
 		if (loadStatus) *loadStatus = EClassLoadStatus::InvalidThisClassEntry;
 		return nullptr;
 	}
+	std::string_view className = reinterpret_cast<ClassConstantUTF8EntryV1*>(constantPool.getEntry(reinterpret_cast<ClassConstantClassEntryV1*>(thisClassEntry)->nameIndex))->string;
 
 	// Read super classes
 	std::uint16_t superCount = buffer.getUI2();
@@ -348,6 +1376,12 @@ Class* loadClassV1(ClassRegistry* registry, ByteBuffer& buffer, EClassLoadStatus
 		}
 	}
 
+	// Start reading the files of the super classes while the rest of the class is parsed
+	for (auto super : supers) {
+		auto superEntry = reinterpret_cast<ClassConstantClassEntryV1*>(constantPool.getEntry(super));
+		registry->readaheadClass(reinterpret_cast<ClassConstantUTF8EntryV1*>(constantPool.getEntry(superEntry->nameIndex))->string);
+	}
+
 	// Read class fields
 	std::uint16_t fieldCount = buffer.getUI2();
 	std::vector<ClassFieldEntryV1> fields(fieldCount);
@@ -428,11 +1462,26 @@ Class* loadClassV1(ClassRegistry* registry, ByteBuffer& buffer, EClassLoadStatus
 				return nullptr;
 			}
 		}
+
+		// Directly called classes and classes whose static fields are accessed are loaded while linking, so start reading them too
+		for (auto& attribute : method.attributes) {
+			std::uint16_t refClassNameIndex = 0;
+			if (attribute->name == "methodref" && registry->getPreloadRequiredClasses())
+				refClassNameIndex = reinterpret_cast<ClassAttributeMethodRefV1*>(attribute.get())->classNameIndex;
+			else if (attribute->name == "fieldref")
+				refClassNameIndex = reinterpret_cast<ClassAttributeFieldRefV1*>(attribute.get())->classNameIndex;
+			else
+				continue;
+			auto refClassNameEntry = constantPool.getEntry(refClassNameIndex);
+			if (!refClassNameEntry || refClassNameEntry->getTag() != ClassConstantUTF8EntryV1Tag) continue;
+			auto& refClassName = reinterpret_cast<ClassConstantUTF8EntryV1*>(refClassNameEntry)->string;
+			if (refClassName != className) registry->readaheadClass(refClassName);
+		}
 	}
 
 	// Read class attributes
 	std::uint16_t attributeCount = buffer.getUI2();
-	std::vector<ClassAttributeV1*> attributes(attributeCount);
+	std::vector<std::unique_ptr<ClassAttributeV1>> attributes(attributeCount);
 	for (std::size_t i = 0; i < attributes.size(); i++) {
 		// Try to read an attribute
 		EClassLoadStatus loadStatus2 = EClassLoadStatus::Success;
@@ -444,8 +1493,8 @@ Class* loadClassV1(ClassRegistry* registry, ByteBuffer& buffer, EClassLoadStatus
 		}
 	}
 
-	// Construct a new class from the read data
-	Class* clazz       = new Class();
+	// Construct a new class from the read data, it is only handed out once it has been fully linked
+	auto clazz         = std::unique_ptr<Class>(registry->constructClass());
 	clazz->accessFlags = accessFlags;
 
 	// Get class name string
@@ -453,6 +1502,10 @@ Class* loadClassV1(ClassRegistry* registry, ByteBuffer& buffer, EClassLoadStatus
 	auto thisClassName = reinterpret_cast<ClassConstantUTF8EntryV1*>(constantPool.getEntry(thisClass->nameIndex));
 	clazz->name        = thisClassName->string;
 
+	// Classes this class links against and the call sites it contains
+	std::set<Class*> dependencies;
+	std::vector<CallSite> callSites;
+
 	// Try to load super classes
 	clazz->supers.resize(supers.size());
 	for (std::size_t i = 0; i < supers.size(); i++) {
@@ -462,6 +1515,7 @@ Class* loadClassV1(ClassRegistry* registry, ByteBuffer& buffer, EClassLoadStatus
 		if (!superClass) return nullptr;
 
 		clazz->supers[i] = superClass;
+		dependencies.insert(superClass);
 	}
 
 	clazz->fields.resize(fields.size());
@@ -472,25 +1526,52 @@ Class* loadClassV1(ClassRegistry* registry, ByteBuffer& buffer, EClassLoadStatus
 		field.accessFlags = entry.accessFlags;
 		field.name        = entry.name;
 		field.descriptor  = entry.descriptor;
-		// TODO: Apply field attributes
+		for (auto& attribute : entry.attributes) {
+			if (attribute->name == "hot")
+				field.hot = true;
+		}
+	}
+
+	// Compute the instance layout from the field descriptors and the super classes
+	if (!clazz->computeLayout()) {
+		// A field descriptor does not describe a known type
+		if (loadStatus) *loadStatus = EClassLoadStatus::InvalidFieldDescriptor;
+		return nullptr;
 	}
+	clazz->allocateStaticData(registry->getCodeHeap());
+
+	// Map the read only data section before the code that refers to it is linked, a class has at most one
+	ClassAttributeReadOnlyDataV1* readOnlyData = nullptr;
+	for (auto& attribute : attributes) {
+		if (attribute->name != "rodata") continue;
+		if (readOnlyData || !isValidDataAlignment(reinterpret_cast<ClassAttributeReadOnlyDataV1*>(attribute.get())->alignment)) {
+			if (loadStatus) *loadStatus = EClassLoadStatus::InvalidReadOnlyData;
+			return nullptr;
+		}
+		readOnlyData = reinterpret_cast<ClassAttributeReadOnlyDataV1*>(attribute.get());
+	}
+	if (readOnlyData)
+		clazz->allocateReadOnlyData(registry->getCodeHeap(), readOnlyData->data.data(), readOnlyData->data.size(), readOnlyData->alignment);
 
-	clazz->methods.resize(methods.size());
+	clazz->setMethodCount(methods.size());
 	for (std::size_t i = 0; i < methods.size(); i++) {
 		auto& method = clazz->methods[i];
 		auto& entry  = methods[i];
 		// Get method information
-		method.accessFlags = entry.accessFlags;
-		method.name        = entry.name;
-		method.descriptor  = entry.descriptor;
-		std::vector<ClassMethodRefV1> methodRefs;
+		method.pInfo->accessFlags = entry.accessFlags;
+		method.pInfo->name        = entry.name;
+		method.pInfo->descriptor  = entry.descriptor;
+		method.descriptorHash     = hashMethodDescriptor(method.pInfo->descriptor);
+		std::vector<ClassMethodRef> methodRefs;
+		std::vector<ClassFieldRef> fieldRefs;
+		std::vector<ClassDataRef> dataRefs;
 		std::vector<std::uint8_t> code;
 		for (auto& attribute : entry.attributes) {
 			if (attribute->name == "code") {
-				code = reinterpret_cast<ClassAttributeMethodCodeV1*>(attribute)->code;
+				code = std::move(reinterpret_cast<ClassAttributeMethodCodeV1*>(attribute.get())->code);
 			} else if (attribute->name == "methodref") {
-				auto ref = reinterpret_cast<ClassAttributeMethodRefV1*>(attribute);
-				ClassMethodRefV1 methodRef;
+				auto ref = reinterpret_cast<ClassAttributeMethodRefV1*>(attribute.get());
+				ClassMethodRef methodRef;
 				methodRef.byteOffset = ref->byteOffset;
 
 				auto methodRefClassNameEntry = constantPool.getEntry(ref->classNameIndex);
@@ -512,144 +1593,322 @@ Class* loadClassV1(ClassRegistry* registry, ByteBuffer& buffer, EClassLoadStatus
 				methodRef.methodDescriptor     = methodRefMethodDescriptor->string;
 
 				methodRefs.push_back(methodRef);
-			}
-		}
+			} else if (attribute->name == "fieldref") {
+				auto ref = reinterpret_cast<ClassAttributeFieldRefV1*>(attribute.get());
+				ClassFieldRef fieldRef;
+				fieldRef.byteOffset = ref->byteOffset;
+
+				auto fieldRefClassNameEntry = constantPool.getEntry(ref->classNameIndex);
+				if (!fieldRefClassNameEntry || fieldRefClassNameEntry->getTag() != ClassConstantUTF8EntryV1Tag) {
+					// Field-ref class is either invalid or is not pointing to a UTF8 tag
+					if (loadStatus) *loadStatus = EClassLoadStatus::InvalidFieldRefClassName;
+					return nullptr;
+				}
+				fieldRef.className = reinterpret_cast<ClassConstantUTF8EntryV1*>(fieldRefClassNameEntry)->string;
 
-		if (!code.empty()) {
-			// Constants
-			std::uintptr_t classRegistryAddr                 = reinterpret_cast<std::uintptr_t>(registry);
-			std::uintptr_t getMethodFromDescriptorErrorcAddr = LavaUBCast<decltype(&ClassRegistry::getMethodFromDescriptorErrorc), std::uintptr_t>(&ClassRegistry::getMethodFromDescriptorErrorc).right;
-			std::size_t pCodeOffset                          = offsetof(Method, pCode);
-			bool requireLargeCall                            = pCodeOffset > 255;
-			std::size_t codeLength                           = code.size();
-			std::size_t getCallLength                        = requireLargeCall ? 71 : 68;
-			std::size_t directCallLength                     = 6;
-			std::size_t callLength                           = 0;
-			std::size_t dataLength                           = 0;
-			std::unordered_map<std::string, std::size_t> strings;
-			std::unordered_map<std::uintptr_t, std::size_t> ptrs;
-			std::set<std::string> loadedClasses;
-
-			// Sort method refs based on their byte offset
-			std::sort(methodRefs.begin(), methodRefs.end(), [](ClassMethodRefV1& lhs, ClassMethodRefV1& rhs) -> bool {
-				return lhs.byteOffset < rhs.byteOffset;
-			});
-
-			// Check how much space each method ref requires to call
-			for (auto& methodRef : methodRefs) {
-				Class* methodRefClass = registry->getClass(methodRef.className);
-				if (!methodRefClass && !registry->getPreloadRequiredClasses()) {
-					strings.insert({ methodRef.className, 0 });
-					strings.insert({ methodRef.methodDescriptor, 0 });
-					ptrs.insert({ classRegistryAddr, 0 });
-					ptrs.insert({ getMethodFromDescriptorErrorcAddr, 0 });
-					callLength += getCallLength;
-					continue;
-				} else {
-					methodRefClass = &registry->loadClassError(methodRef.className);
+				auto fieldRefFieldNameEntry = constantPool.getEntry(ref->fieldNameIndex);
+				if (!fieldRefFieldNameEntry || fieldRefFieldNameEntry->getTag() != ClassConstantUTF8EntryV1Tag) {
+					// Field-ref field is either invalid or is not pointing to a UTF8 tag
+					if (loadStatus) *loadStatus = EClassLoadStatus::InvalidFieldRefFieldName;
+					return nullptr;
 				}
-				loadedClasses.insert(methodRef.className);
-				Method* methodRefMethod = methodRefClass->getMethodFromDescriptor(methodRef.methodDescriptor);
-				if (!methodRefMethod)
-					throw std::runtime_error("Method wants to invoke a nonexistant method '" + methodRef.methodDescriptor + "' in class '" + methodRef.className + "'");
-				callLength += directCallLength;
-				ptrs.insert({ LavaUBCast<std::uint8_t*, std::uintptr_t>(methodRefMethod->pCode).right, 0 });
-			}
+				fieldRef.fieldName = reinterpret_cast<ClassConstantUTF8EntryV1*>(fieldRefFieldNameEntry)->string;
 
-			// Check how much space each string requires
-			for (auto& string : strings) dataLength += string.first.size() + 1;
-			dataLength += 8 * ptrs.size();
-
-			std::size_t dataBegin = codeLength + callLength;
-			// Resize the code to the new length
-			code.resize(dataBegin + dataLength, 0);
-			auto pCode = code.data();
-
-			// Write the points into the code
-			std::size_t dataOffset = 0;
-			for (auto& ptr : ptrs) {
-				std::memcpy(pCode + dataBegin + dataOffset, &ptr.first, 8);
-				ptr.second = dataOffset;
-				dataOffset += 8;
+				fieldRefs.push_back(fieldRef);
+			} else if (attribute->name == "dataref") {
+				auto ref = reinterpret_cast<ClassAttributeDataRefV1*>(attribute.get());
+				dataRefs.push_back({ ref->dataOffset, ref->byteOffset });
 			}
+		}
 
-			// Write the strings into the code
-			for (auto& string : strings) {
-				std::memcpy(pCode + dataBegin + dataOffset, string.first.data(), string.first.size());
-				string.second = dataOffset;
-				dataOffset += string.first.size() + 1;
+		if (!code.empty()) linkMethodCode(registry, *clazz, method, code, methodRefs, fieldRefs, dataRefs, dependencies, callSites);
+	}
+
+	return finishClass(registry, std::move(clazz), dependencies, callSites, loadStatus);
+}
+
+//-------------------
+// LClass Version 2
+//-------------------
+
+// Version 2 lays a class out in aligned sections of fixed size entries, so the loader indexes straight into the file
+// instead of parsing it front to back. Every section starts on a 16 byte boundary:
+//   Strings:     u32 length, bytes, NUL, padded to 4 bytes, strings are referred to by their offset in the section
+//   Supers:      u32 name
+//   Fields:      u16 access flags, u16 flags, u32 name, u32 descriptor, u32 reserved
+//   Methods:     u16 access flags, u16 flags, u32 name, u32 descriptor, u32 descriptor hash,
+//                u32 code offset, u32 code length, u32 first relocation, u32 relocation count
+//   Relocations: u32 byte offset, u32 class name or data offset, u32 method descriptor or field name, u32 kind
+//   Code:        method code, each blob 16 byte aligned, compressed blobs hold the same data as an 'lzcode' attribute
+//   Data:        read only data of the class, the header holds its alignment at 18 and its offset and size at 56
+static constexpr std::size_t ClassHeaderV2Size                 = 64;
+static constexpr std::size_t ClassSuperEntryV2Size             = 4;
+static constexpr std::size_t ClassFieldEntryV2Size             = 16;
+static constexpr std::size_t ClassMethodEntryV2Size            = 32;
+static constexpr std::size_t ClassRelocationV2Size             = 16;
+static constexpr std::uint16_t ClassFieldHotFlagV2             = 0x0001;
+static constexpr std::uint16_t ClassMethodCompressedCodeFlagV2 = 0x0001;
+static constexpr std::uint32_t ClassRelocationCallV2           = 0;
+static constexpr std::uint32_t ClassRelocationFieldV2          = 1;
+static constexpr std::uint32_t ClassRelocationDataV2           = 2;
+
+bool readClassNameV2(const ByteBuffer& buffer, std::string_view& className) {
+	if (buffer.size() < ClassHeaderV2Size) return false;
+	std::size_t stringsOffset = buffer.getUI4(24);
+	std::size_t stringsSize   = buffer.getUI4(28);
+	std::size_t string        = buffer.getUI4(8);
+	if (string + 4 > stringsSize) return false;
+	std::size_t length = buffer.getUI4(stringsOffset + string);
+	if (length > stringsSize - string - 4) return false;
+	className = buffer.getString(stringsOffset + string + 4, length);
+	return true;
+}
+
+Class* loadClassV2(ClassRegistry* registry, ByteBuffer& buffer, EClassLoadStatus* loadStatus) {
+	// Read the header, the magic number and version have already been checked
+	std::size_t fileSize = buffer.size();
+	if (fileSize < ClassHeaderV2Size) {
+		if (loadStatus) *loadStatus = EClassLoadStatus::InvalidSection;
+		return nullptr;
+	}
+	EAccessFlags accessFlags      = buffer.getUI2(6);
+	std::uint32_t thisClassName   = buffer.getUI4(8);
+	std::size_t superCount        = buffer.getUI2(12);
+	std::size_t fieldCount        = buffer.getUI2(14);
+	std::size_t methodCount       = buffer.getUI2(16);
+	std::size_t relocationCount   = buffer.getUI4(20);
+	std::size_t stringsOffset     = buffer.getUI4(24);
+	std::size_t stringsSize       = buffer.getUI4(28);
+	std::size_t supersOffset      = buffer.getUI4(32);
+	std::size_t fieldsOffset      = buffer.getUI4(36);
+	std::size_t methodsOffset     = buffer.getUI4(40);
+	std::size_t relocationsOffset = buffer.getUI4(44);
+	std::size_t codeOffset        = buffer.getUI4(48);
+	std::size_t codeSize          = buffer.getUI4(52);
+	std::uint32_t dataAlignment   = buffer.getUI2(18);
+	std::size_t dataOffset        = buffer.getUI4(56);
+	std::size_t dataSize          = buffer.getUI4(60);
+
+	// Every section has to lie within the file
+	auto isInFile = [fileSize](std::size_t offset, std::size_t size) -> bool {
+		return offset <= fileSize && size <= fileSize - offset;
+	};
+	if (!isInFile(stringsOffset, stringsSize) ||
+	    !isInFile(supersOffset, superCount * ClassSuperEntryV2Size) ||
+	    !isInFile(fieldsOffset, fieldCount * ClassFieldEntryV2Size) ||
+	    !isInFile(methodsOffset, methodCount * ClassMethodEntryV2Size) ||
+	    !isInFile(relocationsOffset, relocationCount * ClassRelocationV2Size) ||
+	    !isInFile(codeOffset, codeSize) ||
+	    !isInFile(dataOffset, dataSize)) {
+		if (loadStatus) *loadStatus = EClassLoadStatus::InvalidSection;
+		return nullptr;
+	}
+
+	// Strings are packed one after another, length prefixed, NUL terminated and padded to 4 bytes. Check every string once up front,
+	// only the start of one of them can be referred to so no reference can read around the checked bytes.
+	auto validationStart = std::chrono::steady_clock::now();
+	std::vector<bool> stringStarts(stringsSize);
+	bool validStrings  = true;
+	std::size_t string = 0;
+	while (validStrings && string + 4 <= stringsSize) {
+		std::size_t length = buffer.getUI4(stringsOffset + string);
+		if (length > stringsSize - string - 4) break;
+		validStrings         = validateUTF8(buffer.data() + stringsOffset + string + 4, length);
+		stringStarts[string] = true;
+		string               = (string + 4 + length + 1 + 3) & ~std::size_t(3);
+	}
+	auto& loadStats            = registry->getLoadStats();
+	loadStats.validationTime  += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - validationStart).count();
+	loadStats.validatedBytes  += stringsSize;
+	if (!validStrings) {
+		if (loadStatus) *loadStatus = EClassLoadStatus::InvalidUTF8String;
+		return nullptr;
+	}
+
+	// Strings are referred to by the offset of their length in the string section
+	auto getString = [&](std::size_t string, std::string_view& out) -> bool {
+		if (string >= stringsSize || !stringStarts[string]) return false;
+		std::size_t length = buffer.getUI4(stringsOffset + string);
+		if (length > stringsSize - string - 4) return false;
+		out = buffer.getString(stringsOffset + string + 4, length);
+		return true;
+	};
+
+	// Construct a new class from the file, it is only handed out once it has been fully linked
+	auto clazz         = std::unique_ptr<Class>(registry->constructClass());
+	clazz->accessFlags = accessFlags;
+	std::string_view className;
+	if (!getString(thisClassName, className)) {
+		if (loadStatus) *loadStatus = EClassLoadStatus::InvalidThisClassEntry;
+		return nullptr;
+	}
+	clazz->name = className;
+
+	// Start reading the files of the super classes, the classes whose static fields are accessed and, if they are loaded while
+	// linking, the called classes
+	for (std::size_t i = 0; i < superCount; i++) {
+		std::string_view superName;
+		if (getString(buffer.getUI4(supersOffset + i * ClassSuperEntryV2Size), superName)) registry->readaheadClass(superName);
+	}
+	for (std::size_t i = 0; i < relocationCount; i++) {
+		std::size_t relocation = relocationsOffset + i * ClassRelocationV2Size;
+		std::string_view refClassName;
+		std::uint32_t kind     = buffer.getUI4(relocation + 12);
+		if (kind == ClassRelocationDataV2 || (kind == ClassRelocationCallV2 && !registry->getPreloadRequiredClasses())) continue;
+		if (getString(buffer.getUI4(relocation + 4), refClassName) && refClassName != className)
+			registry->readaheadClass(refClassName);
+	}
+
+	// Classes this class links against and the call sites it contains
+	std::set<Class*> dependencies;
+	std::vector<CallSite> callSites;
+
+	// Try to load super classes
+	clazz->supers.resize(superCount);
+	for (std::size_t i = 0; i < superCount; i++) {
+		std::string_view superName;
+		if (!getString(buffer.getUI4(supersOffset + i * ClassSuperEntryV2Size), superName)) {
+			if (loadStatus) *loadStatus = EClassLoadStatus::InvalidSuperClassEntry;
+			return nullptr;
+		}
+		auto superClass = registry->loadClass(std::string(superName), loadStatus);
+		if (!superClass) return nullptr;
+
+		clazz->supers[i] = superClass;
+		dependencies.insert(superClass);
+	}
+
+	clazz->fields.resize(fieldCount);
+	for (std::size_t i = 0; i < fieldCount; i++) {
+		auto& field       = clazz->fields[i];
+		std::size_t entry = fieldsOffset + i * ClassFieldEntryV2Size;
+		std::string_view name, descriptor;
+		if (!getString(buffer.getUI4(entry + 4), name)) {
+			if (loadStatus) *loadStatus = EClassLoadStatus::InvalidFieldName;
+			return nullptr;
+		}
+		if (!getString(buffer.getUI4(entry + 8), descriptor)) {
+			if (loadStatus) *loadStatus = EClassLoadStatus::InvalidFieldDescriptor;
+			return nullptr;
+		}
+		field.accessFlags = buffer.getUI2(entry);
+		field.hot         = buffer.getUI2(entry + 2) & ClassFieldHotFlagV2;
+		field.name        = name;
+		field.descriptor  = descriptor;
+	}
+
+	// Compute the instance layout from the field descriptors and the super classes
+	if (!clazz->computeLayout()) {
+		// A field descriptor does not describe a known type
+		if (loadStatus) *loadStatus = EClassLoadStatus::InvalidFieldDescriptor;
+		return nullptr;
+	}
+	clazz->allocateStaticData(registry->getCodeHeap());
+
+	// Map the read only data section before the code that refers to it is linked
+	if (!isValidDataAlignment(dataAlignment)) {
+		if (loadStatus) *loadStatus = EClassLoadStatus::InvalidReadOnlyData;
+		return nullptr;
+	}
+	clazz->allocateReadOnlyData(registry->getCodeHeap(), buffer.data() + dataOffset, dataSize, dataAlignment);
+
+	clazz->setMethodCount(methodCount);
+	for (std::size_t i = 0; i < methodCount; i++) {
+		auto& method      = clazz->methods[i];
+		std::size_t entry = methodsOffset + i * ClassMethodEntryV2Size;
+		std::string_view name, descriptor;
+		if (!getString(buffer.getUI4(entry + 4), name)) {
+			if (loadStatus) *loadStatus = EClassLoadStatus::InvalidMethodName;
+			return nullptr;
+		}
+		if (!getString(buffer.getUI4(entry + 8), descriptor)) {
+			if (loadStatus) *loadStatus = EClassLoadStatus::InvalidMethodDescriptor;
+			return nullptr;
+		}
+		method.pInfo->accessFlags = buffer.getUI2(entry);
+		method.pInfo->name        = name;
+		method.pInfo->descriptor  = descriptor;
+		method.descriptorHash     = buffer.getUI4(entry + 12);
+		// Lookups only compare descriptors whose hashes match, so a wrong hash would hide the method
+		if (method.descriptorHash != hashMethodDescriptor(method.pInfo->descriptor)) {
+			if (loadStatus) *loadStatus = EClassLoadStatus::InvalidMethodDescriptor;
+			return nullptr;
+		}
+
+		std::size_t methodCodeOffset = buffer.getUI4(entry + 16);
+		std::size_t methodCodeLength = buffer.getUI4(entry + 20);
+		std::size_t firstRelocation  = buffer.getUI4(entry + 24);
+		std::size_t methodRelocCount = buffer.getUI4(entry + 28);
+		if (methodCodeOffset > codeSize || methodCodeLength > codeSize - methodCodeOffset ||
+		    firstRelocation > relocationCount || methodRelocCount > relocationCount - firstRelocation) {
+			if (loadStatus) *loadStatus = EClassLoadStatus::InvalidSection;
+			return nullptr;
+		}
+
+		// Relocations refer to the uncompressed code
+		std::vector<std::uint8_t> code;
+		auto pMethodCode = buffer.data() + codeOffset + methodCodeOffset;
+		if (buffer.getUI2(entry + 2) & ClassMethodCompressedCodeFlagV2) {
+			if (!decompressCode(pMethodCode, methodCodeLength, code)) {
+				if (loadStatus) *loadStatus = EClassLoadStatus::InvalidCompressedCode;
+				return nullptr;
 			}
+		} else {
+			code.assign(pMethodCode, pMethodCode + methodCodeLength);
+		}
 
-			// Write the method invocations into the code
-			std::size_t offset = 0;
-			for (auto& methodRef : methodRefs) {
-				std::size_t callBegin = offset + methodRef.byteOffset;
-				// If method refers to an already loaded class optimize the call to the direct call, else use the get call
-				if (loadedClasses.find(methodRef.className) != loadedClasses.end()) {
-					// Move bytes after call
-					std::memmove(pCode + callBegin + directCallLength, pCode + callBegin + 1, codeLength - methodRef.byteOffset - 1);
-
-					// Create the call in assembly
-					Class* methodRefClass    = registry->getClass(methodRef.className);
-					Method* methodRefMethod  = methodRefClass->getMethodFromDescriptor(methodRef.methodDescriptor);
-					std::uintptr_t methodPtr = LavaUBCast<std::uint8_t*, std::uintptr_t>(methodRefMethod->pCode).right;
-
-					std::int32_t addrOffset = static_cast<std::int32_t>((dataBegin + ptrs.find(methodPtr)->second) - (callBegin + 6));
-					ByteBuffer call;
-					call.addUI1s({ 0xFF, 0x15 }); // CALL [REL ??]
-					call.addI4(addrOffset);       // Offset to address of method to call
-
-					// Copy the call into the code
-					std::memcpy(pCode + callBegin, call.data(), directCallLength);
-					offset += directCallLength;
-				} else { // Use the worse in every way get call :|
-					// Get string offsets
-					std::int32_t classRegistryOffset                 = static_cast<std::int32_t>((dataBegin + ptrs.find(classRegistryAddr)->second) - (callBegin + 26));
-					std::int32_t getMethodFromDescriptorErrorcOffset = static_cast<std::int32_t>((dataBegin + ptrs.find(getMethodFromDescriptorErrorcAddr)->second) - (callBegin + 46));
-					std::int32_t classNameOffset                     = static_cast<std::int32_t>((dataBegin + strings.find(methodRef.className)->second) - (callBegin + 33));
-					std::int32_t methodDescriptorOffset              = static_cast<std::int32_t>((dataBegin + strings.find(methodRef.methodDescriptor)->second) - (callBegin + 40));
-
-					// Move bytes after call
-					std::memmove(pCode + callBegin + getCallLength, pCode + callBegin + 1, codeLength - methodRef.byteOffset - 1);
-
-					// Create the call in assembly
-					ByteBuffer call;
-					call.addUI1s({ 0x48, 0x83, 0xEC, 0x38 });        // SUB RSP, 38h
-					call.addUI1s({ 0x48, 0x89, 0x4C, 0x24, 0x20 });  // MOV [RSP + 20h], rcx
-					call.addUI1s({ 0x48, 0x89, 0x54, 0x24, 0x28 });  // MOV [RSP + 28h], rdx
-					call.addUI1s({ 0x4C, 0x89, 0x44, 0x24, 0x30 });  // MOV [RSP + 30h], r8
-					call.addUI1s({ 0x48, 0x8B, 0x0D });              // MOV RCX, [REL ??]
-					call.addI4(classRegistryOffset);                 // classRegistry offset
-					call.addUI1s({ 0x48, 0x8D, 0x15 });              // LEA RDX, [REL ??]
-					call.addI4(classNameOffset);                     // className offset
-					call.addUI1s({ 0x4C, 0x8D, 0x05 });              // LEA R8, [REL ??]
-					call.addI4(methodDescriptorOffset);              // methodDescriptor offset
-					call.addUI1s({ 0xFF, 0x15 });                    // CALL [REL ??]
-					call.addI4(getMethodFromDescriptorErrorcOffset); // getMethodFromDescriptorErrorc offset
-					call.addUI1s({ 0x48, 0x8B, 0x4C, 0x24, 0x20 });  // MOV rcx, [RSP + 20h]
-					call.addUI1s({ 0x48, 0x8B, 0x54, 0x24, 0x28 });  // MOV rdx, [RSP + 28h]
-					call.addUI1s({ 0x4C, 0x8B, 0x44, 0x24, 0x30 });  // MOV r8,  [RSP + 30h]
-					call.addUI1s({ 0x48, 0x83, 0xC4, 0x38 });        // ADD RSP, 38h
-					if (requireLargeCall) {
-						call.addUI1s({ 0xFF, 0x90 });                         // CALL [RAX + ??]
-						call.addUI4(static_cast<std::uint32_t>(pCodeOffset)); // pCode offset
-					} else {
-						call.addUI1s({ 0xFF, 0x50 });                        // CALL [RAX + ??]
-						call.addUI1(static_cast<std::uint8_t>(pCodeOffset)); // pCode offset
-					}
-
-					// Copy the call into the code
-					std::memcpy(pCode + callBegin, call.data(), getCallLength);
-					offset += getCallLength;
+		std::vector<ClassMethodRef> methodRefs;
+		std::vector<ClassFieldRef> fieldRefs;
+		std::vector<ClassDataRef> dataRefs;
+		for (std::size_t j = 0; j < methodRelocCount; j++) {
+			std::size_t relocation = relocationsOffset + (firstRelocation + j) * ClassRelocationV2Size;
+			if (buffer.getUI4(relocation + 12) == ClassRelocationDataV2) {
+				// The linker checks the data offset and the placeholder
+				dataRefs.push_back({ buffer.getUI4(relocation + 4), buffer.getUI4(relocation) });
+				continue;
+			}
+			if (buffer.getUI4(relocation + 12) == ClassRelocationFieldV2) {
+				std::string_view refClassName, refFieldName;
+				if (!getString(buffer.getUI4(relocation + 4), refClassName)) {
+					if (loadStatus) *loadStatus = EClassLoadStatus::InvalidFieldRefClassName;
+					return nullptr;
+				}
+				if (!getString(buffer.getUI4(relocation + 8), refFieldName)) {
+					if (loadStatus) *loadStatus = EClassLoadStatus::InvalidFieldRefFieldName;
+					return nullptr;
+				}
+				std::uint32_t byteOffset = buffer.getUI4(relocation);
+				if (byteOffset > code.size() || code.size() - byteOffset < 4) {
+					// Field relocations patch a 32 bit displacement of the method's own code
+					if (loadStatus) *loadStatus = EClassLoadStatus::InvalidRelocation;
+					return nullptr;
 				}
+				fieldRefs.push_back({ std::string(refClassName), std::string(refFieldName), byteOffset });
+				continue;
 			}
 
-			method.allocateCode(code);
-			method.makeCodeExecutable();
+			auto& methodRef = methodRefs.emplace_back();
+			std::string_view refClassName, refMethodDescriptor;
+			if (!getString(buffer.getUI4(relocation + 4), refClassName)) {
+				if (loadStatus) *loadStatus = EClassLoadStatus::InvalidMethodRefClassName;
+				return nullptr;
+			}
+			if (!getString(buffer.getUI4(relocation + 8), refMethodDescriptor)) {
+				if (loadStatus) *loadStatus = EClassLoadStatus::InvalidMethodRefMethodDescriptor;
+				return nullptr;
+			}
+			methodRef.byteOffset = buffer.getUI4(relocation);
+			if (methodRef.byteOffset >= code.size() || buffer.getUI4(relocation + 12) != ClassRelocationCallV2) {
+				// Relocations have to patch a byte of the method's own code
+				if (loadStatus) *loadStatus = EClassLoadStatus::InvalidRelocation;
+				return nullptr;
+			}
+			methodRef.className        = refClassName;
+			methodRef.methodDescriptor = refMethodDescriptor;
 		}
+
+		if (!code.empty()) linkMethodCode(registry, *clazz, method, code, methodRefs, fieldRefs, dataRefs, dependencies, callSites);
 	}
 
-	// Return class
-	if (loadStatus) *loadStatus = EClassLoadStatus::Success;
-	return clazz;
+	return finishClass(registry, std::move(clazz), dependencies, callSites, loadStatus);
 }
\ No newline at end of file
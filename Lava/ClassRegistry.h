@@ -1,11 +1,26 @@
 #pragma once
 
+#include "ByteBuffer.h"
 #include "Class.h"
+#include "CodeHeap.h"
+#include "CodeImage.h"
+#include "CodeProfile.h"
+#include "InvocationCounters.h"
+#include "MetadataArena.h"
+#include "ThreadPool.h"
 
 #include <cstdint>
 
+#include <atomic>
+#include <coroutine>
 #include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <ostream>
+#include <set>
+#include <span>
 #include <string>
 #include <string_view>
 #include <unordered_map>
@@ -27,21 +42,173 @@ enum class EClassLoadStatus : std::uint32_t {
 	InvalidMethodDescriptor,
 	InvalidMethodRefClassName,
 	InvalidMethodRefMethodDescriptor,
+	InvalidFieldRefClassName,
+	InvalidFieldRefFieldName,
+	InvalidReadOnlyData,
+	InvalidSection,
+	InvalidRelocation,
+	InvalidCompressedCode,
+	InvalidUTF8String,
+	IncompatibleClassReload,
+	LinkFailed,
 };
 
 std::ostream& operator<<(std::ostream& stream, EClassLoadStatus status);
 
+enum class EClassUnloadStatus : std::uint32_t {
+	Success = 0,
+	NotLoaded,
+	HasDependents,
+	Deferred,
+};
+
+std::ostream& operator<<(std::ostream& stream, EClassUnloadStatus status);
+
+// A pointer slot inside the code of 'caller' that holds the address of the code of 'callee', or a copy of the body of
+// 'callee' inlined into the code of 'caller'
+struct CallSite {
+	Method* caller            = nullptr;
+	Method* callee            = nullptr;
+	std::size_t slotOffset    = 0;
+	bool inlined              = false;
+	std::uint64_t inlinedHash = 0; // Hash of the copied body, the caller is relinked once the body of the callee differs
+};
+
+// Supplies class files that do not live on the class paths, like classes fetched from a blob store or generated at runtime
+class ClassSource {
+public:
+	virtual ~ClassSource() = default;
+
+	// Fills 'buffer' with the class file of 'className' and returns true if the source has it, the buffer can view
+	// memory owned by the source as long as it stays valid until the load is done. Might be called from the load thread.
+	virtual bool readClass(std::string_view className, ByteBuffer& buffer) = 0;
+};
+
+// Time spent loading classes, classes loaded while loading another one count towards the outermost load
+struct ClassLoadStats {
+	std::size_t classCount       = 0;
+	std::uint64_t loadTime       = 0;
+	std::size_t validatedBytes   = 0;
+	std::uint64_t validationTime = 0;
+};
+
+// Outcome of an asynchronous class load
+struct ClassLoadResult {
+	Class* clazz            = nullptr;
+	EClassLoadStatus status = EClassLoadStatus::Success;
+};
+
 class ClassRegistry {
 public:
+	// Marks a thread as possibly running Lava code, retired code is only reclaimed while no scope is active
+	struct InvocationScope : CodeHeap::InvocationScope {
+	public:
+		InvocationScope(ClassRegistry& registry) : CodeHeap::InvocationScope(registry.codeHeap) {}
+	};
+
+	// Awaitable load of a class, the awaiting coroutine is resumed on the thread pool once the class is linked
+	struct ClassLoadAwaiter {
+	public:
+		ClassLoadAwaiter(ClassRegistry& registry, std::string className) : registry(registry), className(std::move(className)) {}
+
+		bool await_ready();
+		void await_suspend(std::coroutine_handle<> handle);
+		ClassLoadResult await_resume() { return this->result; }
+
+	private:
+		ClassRegistry& registry;
+		std::string className;
+		ClassLoadResult result;
+	};
+
+public:
+	ClassRegistry() = default;
+	ClassRegistry(const ClassRegistry&) = delete;
+	ClassRegistry(ClassRegistry&&)      = delete;
+	ClassRegistry& operator=(const ClassRegistry&) = delete;
+	ClassRegistry& operator=(ClassRegistry&&) = delete;
+	~ClassRegistry();
+
 	Class* newClass(const std::string& className);
+	// Allocates an unregistered class in a metadata region of its own, deleting the class frees the region
+	Class* constructClass();
 	void addClassPath(const std::filesystem::path classPath);
+	// Class sources are asked for classes in the order they were added once none of the class paths has them
+	void addClassSource(std::shared_ptr<ClassSource> classSource);
 	Class* getClass(const std::string& className);
 	Class* loadClass(const std::string& className, EClassLoadStatus* loadStatus = nullptr);
 	Class* loadClassc(const char* className, EClassLoadStatus* loadStatus = nullptr);
 	Class& loadClassError(const std::string& className);
 	Class& loadClassErrorc(const char* className);
+	// Loads a class straight from a class file in memory owned by the caller, the memory is only read during the call.
+	// Returns the loaded class instead if one with the same name is already loaded.
+	Class* loadClassFromMemory(std::span<const std::uint8_t> classFile, EClassLoadStatus* loadStatus = nullptr);
+	// Asynchronous loading, the file is read, parsed and linked on a background thread without blocking the caller,
+	// concurrent requests for the same class share one load and 'onLoaded' runs on the loading thread once it is done
+	std::shared_future<ClassLoadResult> loadClassAsync(const std::string& className, std::function<void(const ClassLoadResult&)> onLoaded = {});
+	ClassLoadAwaiter loadClassAwait(const std::string& className) { return ClassLoadAwaiter(*this, className); }
 	Method& getMethodErrorc(const char* className, const char* methodName);
 	LAVA_MICROSOFT_CALL_ABI Method& getMethodFromDescriptorErrorc(const char* className, const char* methodDescriptor);
+	// Called by get call stubs, loads the class on the first call through 'lazyCall' and resolves the method into it
+	LAVA_MICROSOFT_CALL_ABI Method& resolveLazyCallc(LazyCall* lazyCall);
+
+	template <class R, class... Ts>
+	void invokeBatch(const std::string& className, std::string_view methodDescriptor, std::type_identity_t<std::span<const std::tuple<Ts...>>> args, std::type_identity_t<std::span<R>> results, bool parallel = false) {
+		Method& method = loadClassError(className).getMethodFromDescriptorError(methodDescriptor);
+		method.invokeBatch<R, Ts...>(args, results, parallel ? &getThreadPool() : nullptr);
+	}
+
+	ThreadPool& getThreadPool();
+	auto& getCodeHeap() { return this->codeHeap; }
+	auto& getCodeHeap() const { return this->codeHeap; }
+	auto& getMetadataArena() { return this->metadataArena; }
+	auto& getMetadataArena() const { return this->metadataArena; }
+
+	// Hot reloading, classes loaded from files are reloaded when their file changes
+	std::vector<std::string> getModifiedClasses() const;
+	bool reloadClass(const std::string& className, EClassLoadStatus* loadStatus = nullptr);
+	std::size_t hotReload();
+	std::size_t reclaimRetiredCode();
+	auto getRetiredClassCount() const { return this->retiredClasses.size(); }
+
+	// Unloading, a class can only be unloaded once no other class inherits from it or calls it directly
+	EClassUnloadStatus unloadClass(const std::string& className);
+	std::vector<Class*> getDependents(Class* clazz) const;
+	void addDependency(Class* dependent, Class* dependency);
+
+	void addCallSite(const CallSite& callSite);
+	void retargetCallSites(Method* callee);
+
+	// Relinks the code of every loaded method into one contiguous region, methods in the profile come first in
+	// profile order and the rest are pushed to the end, returns the number of code blocks moved
+	std::size_t applyCodeLayout(const CodeProfile& profile);
+	std::size_t applyCodeLayout(const std::filesystem::path& layoutFilename);
+
+	// Shared code images, processes loading the same classes run the same code pages from a shared memory file like
+	// '/dev/shm/<name>', returns the number of methods that now run from the image
+	std::size_t publishCodeImage(const std::filesystem::path& filename);
+	std::size_t mapCodeImage(const std::filesystem::path& filename);
+	auto getCodeImage() const { return this->codeImage.get(); }
+
+	// Instrumented linking, classes loaded afterwards count calls into their methods and through their call sites
+	auto getInstrumented() const { return this->instrumented; }
+	void setInstrumented(bool instrumented) { this->instrumented = instrumented; }
+	auto& getInvocationCounters() { return this->invocationCounters; }
+	auto& getInvocationCounters() const { return this->invocationCounters; }
+
+	// Link time inlining, classes loaded afterwards copy leaf methods of up to 'inlineThreshold' bytes into their call sites,
+	// zero turns it off. Callers are relinked when an inlined method is reloaded, which needs them loaded from a file.
+	auto getInlineThreshold() const { return this->inlineThreshold; }
+	void setInlineThreshold(std::size_t inlineThreshold) { this->inlineThreshold = inlineThreshold; }
+
+	// Readahead, the files of classes a class refers to are read on the thread pool while it is still being parsed
+	auto getReadahead() const { return this->readahead; }
+	void setReadahead(bool readahead) { this->readahead = readahead; }
+	void readaheadClass(std::string_view className);
+
+	// Nanoseconds spent loading classes and validating the UTF-8 strings of their constant pools
+	auto& getLoadStats() { return this->loadStats; }
+	auto& getLoadStats() const { return this->loadStats; }
 
 	auto getPreloadRequiredClasses() const { return this->preloadRequiredClasses; }
 	void setPreloadRequiredClasses(bool preloadRequiredClasses) { this->preloadRequiredClasses = preloadRequiredClasses; }
@@ -49,12 +216,59 @@ public:
 	std::vector<Class*> getLoadedClasses() const;
 
 private:
+	struct ClassFile {
+		std::filesystem::path filename;
+		std::filesystem::file_time_type lastWriteTime;
+	};
+
+	// Whoever claims the file first reads it, so a loader never waits on a read still queued behind busy workers
+	struct ReadaheadFile {
+		ClassFile classFile;
+		std::shared_ptr<std::atomic<bool>> claimed;
+		std::future<ByteBuffer> buffer;
+	};
+
+	struct PendingLoad {
+		std::shared_future<ClassLoadResult> result;
+		std::vector<std::function<void(const ClassLoadResult&)>> onLoaded;
+	};
+
 	std::filesystem::path findClass(std::string_view className) const;
+	bool readClassFromSources(std::string_view className, ByteBuffer& buffer);
+	std::uint8_t** findImageSlot(const CallSite& callSite) const;
+	Class* loadClassFile(const std::filesystem::path& filename, EClassLoadStatus* loadStatus);
+	Class* loadClassBuffer(ByteBuffer& buffer, EClassLoadStatus* loadStatus);
+	ClassLoadResult loadClassInBackground(const std::string& className);
+	static ByteBuffer readReadaheadFile(ReadaheadFile& readaheadFile);
+	void forgetClass(Class* clazz);
+	void relinkInliningClasses();
 
 private:
+	CodeHeap codeHeap;
+	MetadataArena metadataArena;
+	std::unique_ptr<CodeImage> codeImage;
+	InvocationCounters invocationCounters;
 	bool preloadRequiredClasses = false;
+	bool instrumented           = false;
+	bool readahead              = true;
+	std::size_t inlineThreshold = 0;
+	std::size_t loadDepth       = 0;
+	ClassLoadStats loadStats;
 	std::vector<std::filesystem::path> classPaths;
+	std::vector<std::shared_ptr<ClassSource>> classSources;
 	std::unordered_map<std::string, Class*> classes;
+	std::unique_ptr<ThreadPool> threadPool;
+	std::unordered_map<std::string, ClassFile> classFiles;
+	std::unordered_map<std::string, ReadaheadFile> readaheadFiles;
+	std::unordered_multimap<Method*, CallSite> callSites;
+	std::set<std::string> staleInliningClasses;
+	std::unordered_multimap<Class*, Class*> dependents;
+	std::vector<std::unique_ptr<Class>> retiredClasses;
+	std::unordered_map<std::string, PendingLoad> pendingLoads;
+	std::mutex pendingLoadsMutex;
+	// Guards the registry, loaders hold it while parsing and linking and take it again when loading referenced classes
+	mutable std::recursive_mutex mutex;
+	std::unique_ptr<ThreadPool> loadThread;
 };
 
 extern ClassRegistry* globalClassRegistry;
\ No newline at end of file
@@ -0,0 +1,702 @@
+#include "CodeHeap.h"
+#include "StubTemplates.h"
+
+#include <cstring>
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#if LAVA_SYSTEM_windows
+	#include <Windows.h>
+#elif LAVA_SYSTEM_linux
+	#include <sys/mman.h>
+	#include <unistd.h>
+#else
+	#error Requires executable memory allocation, which isnt supported by your system
+#endif
+
+//-------------------
+// Executable memory
+//-------------------
+
+std::ostream& operator<<(std::ostream& stream, ECodeBacking backing) {
+	switch (backing) {
+	case ECodeBacking::Pages: return stream << "Pages";
+	case ECodeBacking::TransparentHugePages: return stream << "TransparentHugePages";
+	case ECodeBacking::ExplicitHugePages: return stream << "ExplicitHugePages";
+	}
+	return stream;
+}
+
+//-----------
+// Code heap
+//-----------
+
+// Regions of regular pages are bump allocated from in smaller steps than huge page backed ones
+static constexpr std::size_t PageRegionSize = 64 * 1024;
+// Static fields are kept apart by cache lines, so the fields of different classes never share one
+static constexpr std::size_t StaticDataAlignment = 64;
+
+static std::size_t alignUp(std::size_t value, std::size_t alignment) {
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// Space a block needs for its literals in the worst case, pointers are kept 8 byte aligned
+static std::size_t getLiteralBound(const std::vector<CodeLiteral>& literals) {
+	std::size_t bound = 0;
+	for (auto& literal : literals)
+		bound += literal.value.size() + 7;
+	return bound;
+}
+
+// Whether a rel32 displacement from 'pCode' reaches 'target'
+static bool isInReach(const std::uint8_t* pCode, std::uintptr_t target) {
+	std::intptr_t displacement = static_cast<std::intptr_t>(target - reinterpret_cast<std::uintptr_t>(pCode));
+	return static_cast<std::int32_t>(displacement) == displacement;
+}
+
+static void deallocateRegionMemory(CodeRegion* region) {
+	deallocateDualMappedMemory(region->pBase, region->pWritable, region->size, region->pData, region->dataSize);
+}
+
+CodeHeap::~CodeHeap() {
+	for (auto& retired : this->retiredCode)
+		if (!retired.pRegion) deallocateMemory(retired.pCode, retired.length);
+	for (auto block : this->blocks) {
+		if (!block->pRegion) deallocateMemory(block->pCode, block->length);
+		delete block;
+	}
+	for (auto region : this->regions) {
+		deallocateRegionMemory(region);
+		delete region;
+	}
+}
+
+CodeBlock* CodeHeap::allocate(const std::vector<std::uint8_t>& code) {
+	return allocate(code, {}, {}, {});
+}
+
+CodeBlock* CodeHeap::allocate(const std::vector<std::uint8_t>& code, const std::vector<CodeLiteral>& literals, const std::vector<CodeNearCall>& nearCalls, const std::vector<CodeDataReference>& dataReferences) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	if (!this->deduplicate || !literals.empty() || !dataReferences.empty()) return allocateBlock(code.data(), code.size(), 0, false, false, literals, nearCalls, dataReferences);
+
+	// Look for an executable copy with the exact same bytes
+	std::uint64_t hash = Hash(code.data(), code.size());
+	auto range         = this->sharedBlocks.equal_range(hash);
+	for (auto itr = range.first; itr != range.second; ++itr) {
+		CodeBlock* block = itr->second;
+		if (!matches(block, code, nearCalls)) continue;
+		block->refCount++;
+		this->stats.sharedMethods++;
+		this->stats.bytesSaved += block->length;
+		return block;
+	}
+
+	CodeBlock* block = allocateBlock(code.data(), code.size(), hash, true, false, literals, nearCalls, dataReferences);
+	this->sharedBlocks.insert({ hash, block });
+	return block;
+}
+
+CodeBlock* CodeHeap::allocateUnique(const CodeBlock* block) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	// The displacements of the copy are filled in again for wherever it ends up
+	return allocateBlock(block->pCode, block->length, 0, false, true, block->literals, block->nearCalls, block->dataReferences);
+}
+
+CodeBlock* CodeHeap::allocateNear(const std::uint8_t* pNear, const std::vector<std::uint8_t>& code, const std::vector<CodeNearCall>& nearCalls) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	auto region = std::find_if(this->regions.begin(), this->regions.end(), [&](const CodeRegion* region) -> bool {
+		return pNear >= region->pBase && pNear < region->pBase + region->size;
+	});
+	if (region == this->regions.end() || (*region)->size - (*region)->used - (*region)->poolUsed < alignUp(code.size(), 16))
+		return allocateBlock(code.data(), code.size(), 0, false, false, {}, nearCalls, {});
+
+	// Bump allocate from the region of 'pNear' as if it was the current one
+	CodeRegion* pCurrentRegion = std::exchange(this->pCurrentRegion, *region);
+	CodeBlock* block           = allocateBlock(code.data(), code.size(), 0, false, true, {}, nearCalls, {});
+	this->pCurrentRegion       = pCurrentRegion;
+	return block;
+}
+
+void CodeHeap::release(CodeBlock* block) {
+	releaseBlock(block, false);
+}
+
+void CodeHeap::retire(CodeBlock* block) {
+	releaseBlock(block, true);
+}
+
+void CodeHeap::releaseBlock(CodeBlock* block, bool retire) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	if (--block->refCount > 0) {
+		this->stats.sharedMethods--;
+		this->stats.bytesSaved -= block->length;
+		return;
+	}
+
+	// Last user is gone, return the pages to the system
+	if (block->shareable) {
+		auto range = this->sharedBlocks.equal_range(block->hash);
+		for (auto itr = range.first; itr != range.second; ++itr) {
+			if (itr->second == block) {
+				this->sharedBlocks.erase(itr);
+				break;
+			}
+		}
+	}
+	this->blocks.erase(block);
+	this->stats.blockCount--;
+	this->stats.codeBytes -= block->length;
+	this->stats.relaxedCalls -= block->relaxedCalls;
+	if (retire) {
+		// The copy keeps its region alive until it is reclaimed
+		this->retiredCode.push_back({ block->pCode, block->length, block->pRegion });
+	} else if (block->pRegion) {
+		block->pRegion->liveBlocks--;
+		releaseRegionIfUnused(block->pRegion);
+	} else {
+		deallocateMemory(block->pCode, block->length);
+	}
+	delete block;
+}
+
+std::uint8_t* CodeHeap::getWritable(CodeBlock* block) const {
+	if (block->pRegion) return block->pRegion->pWritable + (block->pCode - block->pRegion->pBase);
+	return block->pCode;
+}
+
+void CodeHeap::relinkNearCalls(CodeBlock* block) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	if (block->nearCalls.empty()) return;
+	placeNearCalls(block, getWritable(block));
+	if (block->pRegion) flushInstructionCache(block->pCode, block->length);
+}
+
+void CodeHeap::restoreIndirectCalls(CodeBlock* block, std::uint32_t slotOffset) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	std::uint8_t* pWritableCode = getWritable(block);
+	bool restored               = false;
+	for (auto& nearCall : block->nearCalls) {
+		if (nearCall.slotOffset != slotOffset || std::memcmp(pWritableCode + nearCall.callOffset, NearCallStub.bytes.data(), NearCallStub.patchPoints.target.offset) != 0)
+			continue;
+
+		// placeNearCalls only relaxes calls within one aligned qword, the views share their page offsets
+		std::size_t misalignment = reinterpret_cast<std::uintptr_t>(block->pCode + nearCall.callOffset) & 7;
+		std::atomic_ref<std::uint64_t> qword(*reinterpret_cast<std::uint64_t*>(pWritableCode + nearCall.callOffset - misalignment));
+		std::uint8_t bytes[8];
+		std::uint64_t value = qword.load();
+		std::memcpy(bytes, &value, 8);
+		DirectCallStub.emit(bytes + misalignment);
+		DirectCallStub.patchRipRelative(bytes + misalignment, DirectCallStub.patchPoints.slot, static_cast<std::ptrdiff_t>(nearCall.slotOffset) - nearCall.callOffset);
+		std::memcpy(&value, bytes, 8);
+		qword.store(value);
+		block->relaxedCalls--;
+		this->stats.relaxedCalls--;
+		restored = true;
+	}
+	if (restored && block->pRegion) flushInstructionCache(block->pCode, block->length);
+}
+
+bool CodeHeap::relocate(const std::vector<CodeBlock*>& order) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	std::size_t size        = 0;
+	std::size_t literalSize = 0;
+	for (auto block : order) {
+		size = alignUp(size + block->length, 16);
+		literalSize += getLiteralBound(block->literals);
+	}
+	if (size == 0) return false;
+	size += literalSize;
+
+	// The region is never bump allocated from, so huge page regions are only rounded up to whole huge pages
+	size = alignUp(size, this->backing != ECodeBacking::Pages ? HugePageSize : PageSize);
+	CodeRegion* region = newRegion(size, 0);
+	if (!region) return false;
+
+	// Leave every block where it is if the region is out of reach of data one of them refers to
+	for (auto block : order) {
+		for (auto& dataReference : block->dataReferences) {
+			if (!isInReach(region->pBase, dataReference.target) || !isInReach(region->pBase + region->size, dataReference.target)) {
+				releaseRegion(region);
+				return false;
+			}
+		}
+	}
+
+	for (auto block : order) {
+		std::uint8_t* pCode = region->pBase + region->used;
+		this->retiredCode.push_back({ block->pCode, block->length, block->pRegion });
+		std::uint8_t* pWritableCode = region->pWritable + region->used;
+		std::memcpy(pWritableCode, block->pCode, block->length);
+		block->pCode   = pCode;
+		block->pRegion = region;
+		placeLiterals(block, pWritableCode);
+		placeNearCalls(block, pWritableCode);
+		placeDataReferences(block, pWritableCode);
+		region->used   = alignUp(region->used + block->length, 16);
+		region->liveBlocks++;
+	}
+	flushInstructionCache(region->pBase, region->used);
+	return true;
+}
+
+std::size_t CodeHeap::reclaimRetired() {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	std::size_t reclaimedCount = this->retiredCode.size();
+	for (auto& retired : this->retiredCode) {
+		if (retired.pRegion) {
+			retired.pRegion->liveBlocks--;
+			releaseRegionIfUnused(retired.pRegion);
+		} else {
+			deallocateMemory(retired.pCode, retired.length);
+		}
+	}
+	this->retiredCode.clear();
+	return reclaimedCount;
+}
+
+std::uint8_t* CodeHeap::allocateData(std::size_t size) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	CodeRegion* region = getRegion(0, alignUp(size, StaticDataAlignment));
+	if (!region) return nullptr;
+	std::uint8_t* pData = region->pData + region->dataUsed;
+	region->dataUsed    = alignUp(region->dataUsed + size, StaticDataAlignment);
+	region->liveData++;
+	this->stats.dataBytes += size;
+	return pData;
+}
+
+void CodeHeap::releaseData(std::uint8_t* pData, std::size_t size) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	for (auto region : this->regions) {
+		if (pData >= region->pData && pData < region->pData + region->dataSize) {
+			region->liveData--;
+			this->stats.dataBytes -= size;
+			releaseRegionIfUnused(region);
+			return;
+		}
+	}
+}
+
+std::uint8_t* CodeHeap::allocateReadOnlyData(const std::uint8_t* pData, std::size_t size, std::size_t alignment) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	// Read only data goes into the code of the current region, where it is read only through the executable view and in reach
+	// of the code linked after it. Regions are page aligned, so aligning the offset aligns the address.
+	if (alignment == 0) alignment = StaticDataAlignment;
+	CodeRegion* region = getRegion(size + alignment);
+	if (!region) return nullptr;
+	std::size_t offset = alignUp(region->used, alignment);
+	std::memcpy(region->pWritable + offset, pData, size);
+	region->used = alignUp(offset + size, 16);
+	region->liveData++;
+	this->stats.dataBytes += size;
+	return region->pBase + offset;
+}
+
+void CodeHeap::releaseReadOnlyData(std::uint8_t* pData, std::size_t size) {
+	std::lock_guard<std::recursive_mutex> lock(this->mutex);
+	for (auto region : this->regions) {
+		if (pData >= region->pBase && pData < region->pBase + region->size) {
+			region->liveData--;
+			this->stats.dataBytes -= size;
+			releaseRegionIfUnused(region);
+			return;
+		}
+	}
+}
+
+std::uint64_t CodeHeap::Hash(const std::uint8_t* pData, std::size_t length) {
+	// FNV-1a over 8 byte words, seeded with the length
+	std::uint64_t hash = 0xCBF29CE484222325ULL ^ length;
+	std::size_t i      = 0;
+	for (; i + 8 <= length; i += 8) {
+		std::uint64_t word;
+		std::memcpy(&word, pData + i, 8);
+		hash = (hash ^ word) * 0x100000001B3ULL;
+	}
+	for (; i < length; i++)
+		hash = (hash ^ pData[i]) * 0x100000001B3ULL;
+	return hash ^ (hash >> 32);
+}
+
+void CodeHeap::writeIndirectCall(std::uint8_t* pCode, const CodeNearCall& nearCall) {
+	DirectCallStub.emit(pCode + nearCall.callOffset);
+	DirectCallStub.patchRipRelative(pCode + nearCall.callOffset, DirectCallStub.patchPoints.slot, static_cast<std::ptrdiff_t>(nearCall.slotOffset) - nearCall.callOffset);
+}
+
+CodeBlock* CodeHeap::allocateBlock(const std::uint8_t* pCode, std::size_t length, std::uint64_t hash, bool shareable, bool patchable, const std::vector<CodeLiteral>& literals, const std::vector<CodeNearCall>& nearCalls, const std::vector<CodeDataReference>& dataReferences) {
+	CodeBlock* block      = new CodeBlock();
+	block->length         = length;
+	block->refCount       = 1;
+	block->hash           = hash;
+	block->shareable      = shareable;
+	block->literals       = literals;
+	block->nearCalls      = nearCalls;
+	block->dataReferences = dataReferences;
+	bool reachable        = true;
+	// Literals are addressed RIP relatively, so code using them always goes into a region that has room for its pool entries,
+	// code that gets patched goes into a region to be written through its writable view and code referring to data goes next
+	// to the data areas of the regions
+	bool useRegion = this->backing != ECodeBacking::Pages || this->dualMapped || patchable || !literals.empty() || !dataReferences.empty();
+	block->pRegion = useRegion ? getRegion(alignUp(length, 16) + getLiteralBound(literals)) : nullptr;
+	if (block->pRegion) {
+		// Bump allocate from the region, keeping every block 16 byte aligned
+		CodeRegion* region = block->pRegion;
+		block->pCode       = region->pBase + region->used;
+		region->used       = alignUp(region->used + length, 16);
+		region->liveBlocks++;
+		std::uint8_t* pWritableCode = getWritable(block);
+		std::memcpy(pWritableCode, pCode, length);
+		placeLiterals(block, pWritableCode);
+		placeNearCalls(block, pWritableCode);
+		reachable = placeDataReferences(block, pWritableCode);
+		flushInstructionCache(block->pCode, length);
+	} else {
+		block->pCode = reinterpret_cast<std::uint8_t*>(allocateReadWriteMemory(length));
+		std::memcpy(block->pCode, pCode, length);
+		placeNearCalls(block, block->pCode);
+		reachable = placeDataReferences(block, block->pCode);
+		makeExecutableMemory(block->pCode, length);
+	}
+
+	this->blocks.insert(block);
+	this->stats.blockCount++;
+	this->stats.codeBytes += length;
+	if (!reachable) {
+		release(block);
+		throw std::runtime_error("Code was placed out of reach of data it refers to");
+	}
+	return block;
+}
+
+bool CodeHeap::matches(const CodeBlock* block, const std::vector<std::uint8_t>& code, const std::vector<CodeNearCall>& nearCalls) const {
+	if (block->length != code.size() || block->nearCalls != nearCalls) return false;
+	if (block->relaxedCalls == 0) return std::memcmp(block->pCode, code.data(), code.size()) == 0;
+
+	// Relaxed calls depend on where the block was placed, so compare the code as it was linked
+	std::vector<std::uint8_t> linked(block->pCode, block->pCode + block->length);
+	for (auto& nearCall : block->nearCalls)
+		writeIndirectCall(linked.data(), nearCall);
+	return std::memcmp(linked.data(), code.data(), code.size()) == 0;
+}
+
+void CodeHeap::placeLiterals(CodeBlock* block, std::uint8_t* pWritableCode) {
+	CodeRegion* region = block->pRegion;
+	for (auto& literal : block->literals) {
+		auto itr = region->literals.find(literal.value);
+		if (itr == region->literals.end()) {
+			// Carve the constant off the top of the free space, pointers stay aligned so they can be read in one access
+			std::size_t alignment = literal.value.size() == 8 ? 8 : 1;
+			std::size_t offset    = (region->size - region->poolUsed - literal.value.size()) & ~(alignment - 1);
+			std::memcpy(region->pWritable + offset, literal.value.data(), literal.value.size());
+			this->stats.literalBytes += region->size - offset - region->poolUsed;
+			region->poolUsed = region->size - offset;
+			itr              = region->literals.insert({ literal.value, offset }).first;
+		}
+		std::int32_t displacement = static_cast<std::int32_t>(region->pBase + itr->second - (block->pCode + literal.referenceEnd));
+		std::memcpy(pWritableCode + literal.referenceOffset, &displacement, 4);
+	}
+}
+
+void CodeHeap::placeNearCalls(CodeBlock* block, std::uint8_t* pWritableCode) {
+	this->stats.relaxedCalls -= block->relaxedCalls;
+	block->relaxedCalls = 0;
+	for (auto& nearCall : block->nearCalls) {
+		std::uintptr_t targetAddr;
+		std::memcpy(&targetAddr, pWritableCode + nearCall.slotOffset, 8);
+		// Target relative to the start of the call, the displacement is relative to its end
+		std::intptr_t target       = static_cast<std::intptr_t>(targetAddr - reinterpret_cast<std::uintptr_t>(block->pCode + nearCall.callOffset));
+		std::intptr_t displacement = target - static_cast<std::intptr_t>(NearCallStub.patchPoints.target.end);
+		// A call straddling a qword could not be restored with a single store once the block runs
+		bool straddles = (reinterpret_cast<std::uintptr_t>(block->pCode + nearCall.callOffset) & 7) > 8 - NearCallStub.Length;
+		if (static_cast<std::int32_t>(displacement) != displacement || straddles) {
+			writeIndirectCall(pWritableCode, nearCall);
+			continue;
+		}
+		NearCallStub.emit(pWritableCode + nearCall.callOffset);
+		NearCallStub.patchRipRelative(pWritableCode + nearCall.callOffset, NearCallStub.patchPoints.target, target);
+		block->relaxedCalls++;
+	}
+	this->stats.relaxedCalls += block->relaxedCalls;
+}
+
+bool CodeHeap::placeDataReferences(CodeBlock* block, std::uint8_t* pWritableCode) {
+	bool reachable = true;
+	for (auto& dataReference : block->dataReferences) {
+		const std::uint8_t* pEnd = block->pCode + dataReference.referenceEnd;
+		if (!isInReach(pEnd, dataReference.target)) {
+			reachable = false;
+			continue;
+		}
+		std::int32_t displacement = static_cast<std::int32_t>(dataReference.target - reinterpret_cast<std::uintptr_t>(pEnd));
+		std::memcpy(pWritableCode + dataReference.referenceOffset, &displacement, 4);
+	}
+	return reachable;
+}
+
+CodeRegion* CodeHeap::getRegion(std::size_t length, std::size_t dataLength) {
+	CodeRegion* current = this->pCurrentRegion;
+	if (current && current->size - current->used - current->poolUsed >= length && current->dataSize - current->dataUsed >= dataLength)
+		return current;
+
+	std::size_t regionSize = this->backing != ECodeBacking::Pages ? HugePageSize : PageRegionSize;
+	CodeRegion* region     = newRegion(alignUp(std::max(length, regionSize), regionSize), alignUp(std::max(dataLength, PageRegionSize), PageSize));
+	if (!region) return nullptr;
+
+	// The previous region can go once its last block and data are released
+	this->pCurrentRegion = region;
+	if (current) releaseRegionIfUnused(current);
+	return region;
+}
+
+CodeRegion* CodeHeap::newRegion(std::size_t size, std::size_t dataSize) {
+	// Map a new region, falling back to regular pages if no huge page backed memory could be mapped at all
+	ECodeBacking backing = this->backing;
+	void* pWritable      = nullptr;
+	void* pData          = nullptr;
+	// Regions hold the code of many methods, so they are always written through a second mapping instead of changing the
+	// protection of code that might be running. New regions are kept close to the current one, so code in them stays in
+	// reach of the data of the current one.
+	void* pBase = allocateDualMappedMemory(size, dataSize, this->pCurrentRegion ? this->pCurrentRegion->pBase : nullptr, pWritable, pData, backing);
+	if (!pBase) return nullptr;
+
+	CodeRegion* region = new CodeRegion();
+	region->pBase      = reinterpret_cast<std::uint8_t*>(pBase);
+	region->pWritable  = reinterpret_cast<std::uint8_t*>(pWritable);
+	region->pData      = reinterpret_cast<std::uint8_t*>(pData);
+	region->size       = size;
+	region->dataSize   = dataSize;
+	region->backing    = backing;
+	this->regions.push_back(region);
+	this->stats.regionCount++;
+	if (backing != ECodeBacking::Pages) this->stats.hugeRegions++;
+	this->stats.dualRegions++;
+	return region;
+}
+
+void CodeHeap::releaseRegion(CodeRegion* region) {
+	this->regions.erase(std::find(this->regions.begin(), this->regions.end(), region));
+	this->stats.regionCount--;
+	if (region->backing != ECodeBacking::Pages) this->stats.hugeRegions--;
+	this->stats.dualRegions--;
+	this->stats.literalBytes -= region->poolUsed;
+	deallocateRegionMemory(region);
+	delete region;
+}
+
+void CodeHeap::releaseRegionIfUnused(CodeRegion* region) {
+	if (region->liveBlocks == 0 && region->liveData == 0 && region != this->pCurrentRegion) releaseRegion(region);
+}
+
+//----------------------------
+// Windows execute allocation
+//----------------------------
+
+#if LAVA_SYSTEM_windows
+void* allocateReadWriteMemory(std::size_t bytes) {
+	return VirtualAlloc(nullptr, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+}
+
+void makeExecutableMemory(void* p, std::size_t bytes) {
+	DWORD old;
+	VirtualProtect(p, bytes, PAGE_EXECUTE_READ, &old);
+}
+
+void makeNonExecutableMemory(void* p, std::size_t bytes) {
+	DWORD old;
+	VirtualProtect(p, bytes, PAGE_READWRITE, &old);
+}
+
+void makeReadOnlyMemory(void* p, std::size_t bytes) {
+	DWORD old;
+	VirtualProtect(p, bytes, PAGE_READONLY, &old);
+}
+
+void deallocateMemory(void* p, std::size_t bytes) {
+	VirtualFree(p, 0, MEM_RELEASE);
+}
+
+// Maps a section twice, the section is closed either way
+static void* mapSectionTwice(HANDLE mapping, std::size_t bytes, DWORD viewFlags, void*& pWritable) {
+	pWritable = nullptr;
+	if (!mapping) return nullptr;
+	pWritable         = MapViewOfFile(mapping, FILE_MAP_WRITE | viewFlags, 0, 0, bytes);
+	void* pExecutable = MapViewOfFile(mapping, FILE_MAP_READ | FILE_MAP_EXECUTE | viewFlags, 0, 0, bytes);
+	// The views keep the mapping alive
+	CloseHandle(mapping);
+	if (!pWritable || !pExecutable) {
+		if (pWritable) UnmapViewOfFile(pWritable);
+		if (pExecutable) UnmapViewOfFile(pExecutable);
+		pWritable = nullptr;
+		return nullptr;
+	}
+	return pExecutable;
+}
+
+static void* mapCodeSection(std::size_t bytes, void*& pWritable, ECodeBacking& backing) {
+	DWORD sizeHigh = static_cast<DWORD>(static_cast<std::uint64_t>(bytes) >> 32);
+	DWORD sizeLow  = static_cast<DWORD>(bytes & 0xFFFFFFFF);
+	// Windows only has explicit large pages, which need the 'Lock pages in memory' privilege
+	SIZE_T largePageSize = GetLargePageMinimum();
+	if (backing != ECodeBacking::Pages && largePageSize && (bytes % largePageSize) == 0) {
+		HANDLE mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_EXECUTE_READWRITE | SEC_COMMIT | SEC_LARGE_PAGES, sizeHigh, sizeLow, nullptr);
+		if (void* p = mapSectionTwice(mapping, bytes, FILE_MAP_LARGE_PAGES, pWritable)) {
+			backing = ECodeBacking::ExplicitHugePages;
+			return p;
+		}
+	}
+	backing = ECodeBacking::Pages;
+	return mapSectionTwice(CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_EXECUTE_READWRITE, sizeHigh, sizeLow, nullptr), bytes, 0, pWritable);
+}
+
+void* allocateDualMappedMemory(std::size_t bytes, std::size_t dataBytes, const void* pNear, void*& pWritable, void*& pData, ECodeBacking& backing) {
+	// Views are placed by the system, only the data area can be asked for at an address
+	pData   = nullptr;
+	void* p = mapCodeSection(bytes, pWritable, backing);
+	if (!p || dataBytes == 0) return p;
+
+	// Right after the executable view if that is free, anywhere otherwise
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	void* pAfter = reinterpret_cast<std::uint8_t*>(p) + alignUp(bytes, info.dwAllocationGranularity);
+	pData        = VirtualAlloc(pAfter, dataBytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (!pData) pData = VirtualAlloc(nullptr, dataBytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	if (!pData) {
+		UnmapViewOfFile(p);
+		UnmapViewOfFile(pWritable);
+		pWritable = nullptr;
+		return nullptr;
+	}
+	return p;
+}
+
+void deallocateDualMappedMemory(void* p, void* pWritable, std::size_t bytes, void* pData, std::size_t dataBytes) {
+	UnmapViewOfFile(p);
+	UnmapViewOfFile(pWritable);
+	if (pData) VirtualFree(pData, 0, MEM_RELEASE);
+}
+
+void flushInstructionCache(void* p, std::size_t bytes) {
+	FlushInstructionCache(GetCurrentProcess(), p, bytes);
+}
+#endif
+
+//----------------------------
+// Linux execute allocation
+//----------------------------
+
+#if LAVA_SYSTEM_linux
+void* allocateReadWriteMemory(std::size_t bytes) {
+	return mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+}
+
+void makeExecutableMemory(void* p, std::size_t bytes) {
+	mprotect(p, bytes, PROT_EXEC | PROT_READ);
+}
+
+void makeNonExecutableMemory(void* p, std::size_t bytes) {
+	mprotect(p, bytes, PROT_READ | PROT_WRITE);
+}
+
+void makeReadOnlyMemory(void* p, std::size_t bytes) {
+	mprotect(p, bytes, PROT_READ);
+}
+
+void deallocateMemory(void* p, std::size_t bytes) {
+	munmap(p, bytes);
+}
+
+void deallocateDualMappedMemory(void* p, void* pWritable, std::size_t bytes, void* pData, std::size_t dataBytes) {
+	munmap(p, bytes);
+	munmap(pWritable, bytes);
+	if (pData) munmap(pData, dataBytes);
+}
+
+void flushInstructionCache(void* p, std::size_t bytes) {
+	// x86 keeps instruction fetch coherent with stores, this only matters for other architectures
+	__builtin___clear_cache(reinterpret_cast<char*>(p), reinterpret_cast<char*>(p) + bytes);
+}
+
+// Whether transparent huge pages can back advised shared memory, code regions are memory files mapped twice
+static bool isTransparentHugePageEnabled() {
+	// The active mode is the bracketed one, e.g. 'always within_size advise [never] deny force'
+	std::ifstream stream("/sys/kernel/mm/transparent_hugepage/shmem_enabled");
+	std::string modes;
+	if (!std::getline(stream, modes)) return false;
+	return modes.find("[never]") == std::string::npos && modes.find("[deny]") == std::string::npos;
+}
+
+// Maps a memory file at an address aligned to 'alignment', followed by 'dataBytes' of zeroed read write memory. Shared memory
+// only gets transparent huge pages at huge page aligned addresses.
+static void* mapMemoryFile(int fd, std::size_t bytes, int protection, std::size_t alignment, std::size_t dataBytes, const void* pNear) {
+	bytes     = alignUp(bytes, PageSize);
+	dataBytes = alignUp(dataBytes, PageSize);
+	// Reserve the file and its data in one go, over reserving so the mapping can be aligned, then trim the excess. The
+	// reservation goes right below 'pNear' if that is free, where the system would place it next anyway.
+	std::size_t mappedBytes = bytes + dataBytes + (alignment > PageSize ? alignment : 0);
+	std::uintptr_t near     = reinterpret_cast<std::uintptr_t>(pNear);
+	void* pHint             = near > mappedBytes ? reinterpret_cast<void*>(near - mappedBytes) : nullptr;
+	void* p                 = mmap(pHint, mappedBytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) return nullptr;
+	std::uintptr_t begin   = reinterpret_cast<std::uintptr_t>(p);
+	std::uintptr_t aligned = alignUp(begin, std::max(alignment, PageSize));
+	std::uintptr_t used    = aligned + bytes + dataBytes;
+	std::uintptr_t end     = begin + mappedBytes;
+	if (aligned > begin) munmap(p, aligned - begin);
+	if (end > used) munmap(reinterpret_cast<void*>(used), end - used);
+
+	if (mmap(reinterpret_cast<void*>(aligned), bytes, protection, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+	    (dataBytes && mmap(reinterpret_cast<void*>(aligned + bytes), dataBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)) {
+		munmap(reinterpret_cast<void*>(aligned), bytes + dataBytes);
+		return nullptr;
+	}
+	return reinterpret_cast<void*>(aligned);
+}
+
+// Maps a memory file twice, the data area follows the executable view, the file is closed either way
+static void* mapMemoryFileTwice(int fd, std::size_t bytes, std::size_t alignment, std::size_t dataBytes, const void* pNear, void*& pWritable, void*& pData) {
+	pWritable = nullptr;
+	pData     = nullptr;
+	if (fd < 0) return nullptr;
+	void* pExecutable = nullptr;
+	if (ftruncate(fd, static_cast<off_t>(alignUp(bytes, PageSize))) == 0) {
+		pWritable   = mapMemoryFile(fd, bytes, PROT_READ | PROT_WRITE, alignment, 0, nullptr);
+		pExecutable = mapMemoryFile(fd, bytes, PROT_READ | PROT_EXEC, alignment, dataBytes, pNear);
+	}
+	// The mappings keep the memory file alive
+	close(fd);
+	if (!pWritable || !pExecutable) {
+		if (pWritable) munmap(pWritable, bytes);
+		if (pExecutable) munmap(pExecutable, alignUp(bytes, PageSize) + dataBytes);
+		pWritable = nullptr;
+		return nullptr;
+	}
+	if (dataBytes) pData = reinterpret_cast<std::uint8_t*>(pExecutable) + alignUp(bytes, PageSize);
+	return pExecutable;
+}
+
+void* allocateDualMappedMemory(std::size_t bytes, std::size_t dataBytes, const void* pNear, void*& pWritable, void*& pData, ECodeBacking& backing) {
+	#if defined(MFD_HUGETLB) && defined(MAP_HUGE_SHIFT)
+	if (backing == ECodeBacking::ExplicitHugePages) {
+		// Memory files encode the huge page size like mmap does
+		void* p = mapMemoryFileTwice(memfd_create("lava-code", MFD_CLOEXEC | MFD_HUGETLB | (21 << MAP_HUGE_SHIFT)), bytes, HugePageSize, dataBytes, pNear, pWritable, pData);
+		if (p) return p;
+	}
+	#endif
+
+	void* p = mapMemoryFileTwice(memfd_create("lava-code", MFD_CLOEXEC), bytes, backing != ECodeBacking::Pages ? HugePageSize : PageSize, dataBytes, pNear, pWritable, pData);
+	if (!p || backing == ECodeBacking::Pages) return p;
+
+	backing = ECodeBacking::TransparentHugePages;
+	#if defined(MADV_HUGEPAGE)
+	if (!isTransparentHugePageEnabled() || madvise(p, bytes, MADV_HUGEPAGE) != 0)
+		backing = ECodeBacking::Pages;
+	#else
+	backing = ECodeBacking::Pages;
+	#endif
+	return p;
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,233 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <atomic>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+//-------------------
+// Executable memory
+//-------------------
+
+// How the pages holding code are backed
+enum class ECodeBacking : std::uint32_t {
+	Pages = 0,            // Regular pages, every block gets its own mapping
+	TransparentHugePages, // Shared 2 MiB regions advised to be backed by transparent huge pages
+	ExplicitHugePages     // Shared 2 MiB regions backed by reserved huge pages
+};
+
+std::ostream& operator<<(std::ostream& stream, ECodeBacking backing);
+
+// The smallest page size of the supported systems
+static constexpr std::size_t PageSize     = 4096;
+static constexpr std::size_t HugePageSize = 2 * 1024 * 1024;
+// Alignment of every data allocation of the code heap
+static constexpr std::size_t DataAlignment = PageSize;
+
+void* allocateReadWriteMemory(std::size_t bytes);
+void makeExecutableMemory(void* p, std::size_t bytes);
+void makeNonExecutableMemory(void* p, std::size_t bytes);
+void makeReadOnlyMemory(void* p, std::size_t bytes);
+void deallocateMemory(void* p, std::size_t bytes);
+// Maps the same memory twice, once executable and once writable at another address, returns the executable view.
+// Huge page backings are tried when asked for, 'backing' is updated to the backing that was obtained. 'dataBytes' of zeroed
+// read write memory are mapped right after the executable view, the executable view is placed close to 'pNear' if possible.
+void* allocateDualMappedMemory(std::size_t bytes, std::size_t dataBytes, const void* pNear, void*& pWritable, void*& pData, ECodeBacking& backing);
+void deallocateDualMappedMemory(void* p, void* pWritable, std::size_t bytes, void* pData, std::size_t dataBytes);
+// Makes sure instructions written to memory are seen by the next execution of it
+void flushInstructionCache(void* p, std::size_t bytes);
+
+//-----------
+// Code heap
+//-----------
+
+// A dual mapped range that code blocks are bump allocated from, its literal pool grows down from the end. The data of the
+// classes linked into it, like static fields, is bump allocated from the read write memory right after it.
+struct CodeRegion {
+	std::uint8_t* pBase     = nullptr;
+	std::uint8_t* pWritable = nullptr; // Writable view of the region
+	std::uint8_t* pData     = nullptr; // Data area, it follows the executable view
+	std::size_t size        = 0;
+	std::size_t used        = 0;
+	std::size_t poolUsed    = 0; // Bytes at the end of the region taken by the literal pool
+	std::size_t dataSize    = 0;
+	std::size_t dataUsed    = 0;
+	std::size_t liveBlocks  = 0;
+	std::size_t liveData    = 0; // Data allocations not yet released, the region stays mapped until they are
+	ECodeBacking backing    = ECodeBacking::Pages;
+	std::unordered_map<std::string, std::size_t> literals; // Offsets of the pooled constants from the base
+};
+
+// A constant a block addresses RIP relatively, it lives once in the literal pool of the region holding the block
+struct CodeLiteral {
+	std::uint32_t referenceOffset = 0; // Offset of the 32 bit displacement in the block
+	std::uint32_t referenceEnd    = 0; // End of the referencing instruction, the displacement is relative to it
+	std::string value;                 // Bytes of the constant, strings include their terminator
+};
+
+// A direct call through a pointer slot after the code, it is turned into a near call whenever the block is placed in reach of the target
+struct CodeNearCall {
+	std::uint32_t callOffset = 0; // Offset of the call instruction in the block
+	std::uint32_t slotOffset = 0; // Offset of the pointer slot holding the target
+
+	bool operator==(const CodeNearCall& other) const = default;
+};
+
+// A RIP relative reference to data outside of the heap, like the static fields of a class, filled in wherever the block is placed
+struct CodeDataReference {
+	std::uint32_t referenceOffset = 0; // Offset of the 32 bit displacement in the block
+	std::uint32_t referenceEnd    = 0; // End of the referencing instruction, the displacement is relative to it
+	std::uintptr_t target         = 0; // Address of the data
+};
+
+// An executable copy of method code, shared by every method whose final code is byte identical
+struct CodeBlock {
+	std::uint8_t* pCode  = nullptr;
+	std::size_t length   = 0;
+	std::size_t refCount = 0;
+	std::uint64_t hash   = 0;
+	bool shareable       = true;
+	CodeRegion* pRegion  = nullptr;
+	std::vector<CodeLiteral> literals;
+	std::vector<CodeNearCall> nearCalls;
+	std::vector<CodeDataReference> dataReferences;
+	std::size_t relaxedCalls = 0; // Near calls currently in their rel32 form
+};
+
+struct CodeHeapStats {
+	std::size_t blockCount    = 0; // Executable copies currently allocated
+	std::size_t codeBytes     = 0; // Bytes held by those copies
+	std::size_t sharedMethods = 0; // Methods currently using a copy that another method allocated
+	std::size_t bytesSaved    = 0; // Bytes that would have been allocated without deduplication
+	std::size_t regionCount   = 0; // Code regions currently mapped
+	std::size_t hugeRegions   = 0; // Code regions that obtained a huge page backing
+	std::size_t dualRegions   = 0; // Code regions mapped twice for W^X, which is every region
+	std::size_t literalBytes  = 0; // Bytes taken by the literal pools of the mapped regions
+	std::size_t relaxedCalls  = 0; // Direct calls currently made as near calls instead of through their slot
+	std::size_t dataBytes     = 0; // Bytes of data allocated for code to address, like static fields and constant tables
+};
+
+// Allocating and releasing code and data is thread safe, methods can allocate code of their own without holding the lock of
+// the class registry
+class CodeHeap {
+public:
+	// Marks a thread as possibly running code of the heap, retired code is only reclaimed while no scope is active
+	struct InvocationScope {
+	public:
+		InvocationScope(CodeHeap& heap) : heap(heap) { this->heap.activeInvocations++; }
+		InvocationScope(const InvocationScope&) = delete;
+		InvocationScope& operator=(const InvocationScope&) = delete;
+		~InvocationScope() { this->heap.activeInvocations--; }
+
+	private:
+		CodeHeap& heap;
+	};
+
+public:
+	CodeHeap() = default;
+	CodeHeap(const CodeHeap&) = delete;
+	CodeHeap(CodeHeap&&)      = delete;
+	CodeHeap& operator=(const CodeHeap&) = delete;
+	CodeHeap& operator=(CodeHeap&&) = delete;
+	~CodeHeap();
+
+	// Returns executable code with the given bytes, reusing an identical copy if one exists
+	CodeBlock* allocate(const std::vector<std::uint8_t>& code);
+	// Returns executable code with the given literals, near calls and data references, the code is linked with every near call in its
+	// indirect form. Code with literals or data references is never shared, the bytes addressing them depend on where it is placed.
+	// Throws if a data reference is out of rel32 reach of the code.
+	CodeBlock* allocate(const std::vector<std::uint8_t>& code, const std::vector<CodeLiteral>& literals, const std::vector<CodeNearCall>& nearCalls, const std::vector<CodeDataReference>& dataReferences);
+	// Returns a private executable copy of a block that is never shared, used for code that gets patched. The copy is placed in a
+	// region, so it can be patched through getWritable while it runs.
+	CodeBlock* allocateUnique(const CodeBlock* block);
+	// Returns private executable code placed right after the code at 'pNear' if its region has room, so near calls to it are
+	// made directly
+	CodeBlock* allocateNear(const std::uint8_t* pNear, const std::vector<std::uint8_t>& code, const std::vector<CodeNearCall>& nearCalls);
+	void release(CodeBlock* block);
+	// Releases a block that might still be running, its memory is kept until reclaimRetired
+	void retire(CodeBlock* block);
+	// Address to write the code of a block through, the code itself unless the block is in a region
+	std::uint8_t* getWritable(CodeBlock* block) const;
+	// Picks the form of every near call again after the slots of the block changed, only for blocks that are not running yet
+	void relinkNearCalls(CodeBlock* block);
+	// Turns the near calls through a slot back into calls through it, safe while the block runs as each call is switched over
+	// with one aligned store
+	void restoreIndirectCalls(CodeBlock* block, std::uint32_t slotOffset);
+	// Moves the blocks, in the given order, into one new contiguous region, the old copies might still be running and are
+	// kept until reclaimRetired
+	bool relocate(const std::vector<CodeBlock*>& order);
+	std::size_t reclaimRetired();
+	bool hasActiveInvocations() const { return this->activeInvocations.load() != 0; }
+	// Zeroed read write memory for data that code addresses RIP relatively, it is carved from the data area of the current
+	// region, so code allocated after it lands in the same region or one mapped close to it
+	std::uint8_t* allocateData(std::size_t size);
+	void releaseData(std::uint8_t* pData, std::size_t size);
+	// Read only copy of data that code addresses RIP relatively, like constant tables, aligned to 'alignment' or a cache line if 0
+	std::uint8_t* allocateReadOnlyData(const std::uint8_t* pData, std::size_t size, std::size_t alignment);
+	void releaseReadOnlyData(std::uint8_t* pData, std::size_t size);
+
+	auto getDeduplicate() const { return this->deduplicate; }
+	void setDeduplicate(bool deduplicate) { this->deduplicate = deduplicate; }
+	// Opt into huge page backed regions, only affects code allocated afterwards
+	auto getBacking() const { return this->backing; }
+	void setBacking(ECodeBacking backing) { this->backing = backing; }
+	// Opt into placing all code in regions, which are dual mapped, so code is never writable and executable at the same
+	// address and patching it needs no protection changes, only affects code allocated afterwards. Huge page backed code
+	// and code using literal pools is always placed in regions.
+	auto getDualMapped() const { return this->dualMapped; }
+	void setDualMapped(bool dualMapped) { this->dualMapped = dualMapped; }
+	// Opt into literal pools, linked code then addresses its constants in the pool of its region instead of carrying its own copy
+	auto getLiteralPools() const { return this->literalPools; }
+	void setLiteralPools(bool literalPools) { this->literalPools = literalPools; }
+	// The backing the most recent region actually obtained
+	auto getObtainedBacking() const { return this->pCurrentRegion ? this->pCurrentRegion->backing : ECodeBacking::Pages; }
+	auto& getStats() const { return this->stats; }
+
+	static std::uint64_t Hash(const std::uint8_t* pData, std::size_t length);
+	// Puts a near call back into its indirect form, giving the bytes as they were linked
+	static void writeIndirectCall(std::uint8_t* pCode, const CodeNearCall& nearCall);
+
+private:
+	// A copy left behind by relocate
+	struct RetiredCode {
+		std::uint8_t* pCode = nullptr;
+		std::size_t length  = 0;
+		CodeRegion* pRegion = nullptr;
+	};
+
+	CodeBlock* allocateBlock(const std::uint8_t* pCode, std::size_t length, std::uint64_t hash, bool shareable, bool patchable, const std::vector<CodeLiteral>& literals, const std::vector<CodeNearCall>& nearCalls, const std::vector<CodeDataReference>& dataReferences);
+	// Drops a reference to a block, the memory of its last one is either freed or kept until reclaimRetired
+	void releaseBlock(CodeBlock* block, bool retire);
+	bool matches(const CodeBlock* block, const std::vector<std::uint8_t>& code, const std::vector<CodeNearCall>& nearCalls) const;
+	// Interns the literals of a block in the pool of its region and points the code at them, the code is written through 'pWritableCode'
+	void placeLiterals(CodeBlock* block, std::uint8_t* pWritableCode);
+	// Calls targets in rel32 reach directly and everything else through its slot, the code is written through 'pWritableCode'
+	void placeNearCalls(CodeBlock* block, std::uint8_t* pWritableCode);
+	// Points the data references of a block at their targets, returns false if one of them is out of reach
+	bool placeDataReferences(CodeBlock* block, std::uint8_t* pWritableCode);
+	// The current region if it has room for 'length' bytes of code and 'dataLength' bytes of data, a new one otherwise
+	CodeRegion* getRegion(std::size_t length, std::size_t dataLength = 0);
+	CodeRegion* newRegion(std::size_t size, std::size_t dataSize);
+	void releaseRegion(CodeRegion* region);
+	void releaseRegionIfUnused(CodeRegion* region);
+
+private:
+	bool deduplicate           = true;
+	bool dualMapped            = false;
+	bool literalPools          = false;
+	ECodeBacking backing       = ECodeBacking::Pages;
+	CodeRegion* pCurrentRegion = nullptr;
+	std::vector<CodeRegion*> regions;
+	std::unordered_multimap<std::uint64_t, CodeBlock*> sharedBlocks;
+	std::unordered_set<CodeBlock*> blocks;
+	std::vector<RetiredCode> retiredCode;
+	CodeHeapStats stats;
+	std::atomic<std::size_t> activeInvocations = 0;
+	mutable std::recursive_mutex mutex;
+};
\ No newline at end of file
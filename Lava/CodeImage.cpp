@@ -0,0 +1,253 @@
+#include "CodeImage.h"
+#include "ByteBuffer.h"
+#include "Class.h"
+#include "CodeHeap.h"
+
+#include <cstring>
+
+#include <fstream>
+#include <span>
+#include <unordered_set>
+
+#if LAVA_SYSTEM_linux
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+// Header at the start of an image file, the directory follows it and the code starts at the next page boundary
+static constexpr std::uint32_t CodeImageMagic       = 0x4943564C; // "LVCI"
+static constexpr std::uint32_t CodeImageVersion     = 1;
+static constexpr std::size_t CodeImageHeaderSize    = 48;
+static constexpr std::size_t CodeImageCodeAlignment = 16;
+
+CodeImage::~CodeImage() {
+#if LAVA_SYSTEM_linux
+	if (this->pCode) munmap(this->pCode, this->mappedSize);
+#endif
+}
+
+void CodeImage::rewriteCode(std::uint8_t* pCode, const CodeImageMethod& entry, std::size_t tableOffset) {
+	for (auto& reference : entry.references) {
+		std::memset(pCode + reference.slotOffset, 0, 8);
+		std::int32_t displacement = static_cast<std::int32_t>(tableOffset + reference.slotIndex * 8 - (entry.codeOffset + reference.referenceOffset + 4));
+		std::memcpy(pCode + reference.referenceOffset, &displacement, 4);
+	}
+}
+
+// Gets the offset of the slot a displacement in the code addresses
+static std::size_t getSlotOffset(const std::uint8_t* pCode, std::uint32_t referenceOffset) {
+	std::int32_t displacement;
+	std::memcpy(&displacement, pCode + referenceOffset, 4);
+	return referenceOffset + 4 + displacement;
+}
+
+#if LAVA_SYSTEM_linux
+bool CodeImage::publish(const std::filesystem::path& filename, const std::vector<Class*>& classes) {
+	// Lay the code out back to back, methods sharing code share it in the image as well
+	std::vector<CodeImageMethod> methods;
+	std::vector<std::uint8_t> code;
+	std::unordered_map<const std::uint8_t*, std::uint32_t> codeOffsets;
+	std::unordered_map<std::size_t, std::uint32_t> slotIndices;
+	for (auto clazz : classes) {
+		for (auto& method : clazz->methods) {
+			if (!method.pInfo->pBlock) continue;
+			// Pooled literals live outside the method code, the image has nowhere to put them, and static data only exists in this process
+			if (!method.pInfo->pBlock->literals.empty() || !method.pInfo->pBlock->dataReferences.empty()) return false;
+
+			CodeImageMethod entry;
+			entry.className        = clazz->name;
+			entry.methodDescriptor = method.pInfo->descriptor;
+			entry.codeLength       = static_cast<std::uint32_t>(method.pInfo->codeLength);
+			auto codeItr           = codeOffsets.find(method.pCode);
+			if (codeItr != codeOffsets.end()) {
+				entry.codeOffset = codeItr->second;
+			} else {
+				code.resize((code.size() + CodeImageCodeAlignment - 1) & ~(CodeImageCodeAlignment - 1), 0xCC);
+				entry.codeOffset = static_cast<std::uint32_t>(code.size());
+				code.insert(code.end(), method.pCode, method.pCode + method.pInfo->codeLength);
+				// Near calls are only in reach inside this process, the image calls through the slots
+				for (auto& nearCall : method.pInfo->pBlock->nearCalls)
+					CodeHeap::writeIndirectCall(code.data() + entry.codeOffset, nearCall);
+				codeOffsets.insert({ method.pCode, entry.codeOffset });
+			}
+
+			for (auto referenceOffset : method.pInfo->slotReferences) {
+				std::size_t slotOffset = getSlotOffset(code.data() + entry.codeOffset, referenceOffset);
+				if (slotOffset + 8 > method.pInfo->codeLength) return false;
+				auto slotIndex = slotIndices.insert({ entry.codeOffset + slotOffset, static_cast<std::uint32_t>(slotIndices.size()) }).first->second;
+				entry.references.push_back({ referenceOffset, static_cast<std::uint32_t>(slotOffset), slotIndex });
+			}
+			methods.push_back(std::move(entry));
+		}
+	}
+
+	// The table starts on the page after the code so it can be mapped privately
+	std::size_t pageSize    = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+	std::size_t tableOffset = (code.size() + pageSize - 1) & ~(pageSize - 1);
+	std::unordered_set<std::uint32_t> rewrittenCode;
+	for (auto& entry : methods)
+		if (rewrittenCode.insert(entry.codeOffset).second)
+			rewriteCode(code.data() + entry.codeOffset, entry, tableOffset);
+
+	ByteBuffer directory;
+	for (auto& entry : methods) {
+		directory.addUI4(static_cast<std::uint32_t>(entry.className.size()));
+		directory.addString(entry.className);
+		directory.addUI4(static_cast<std::uint32_t>(entry.methodDescriptor.size()));
+		directory.addString(entry.methodDescriptor);
+		directory.addUI4(entry.codeOffset);
+		directory.addUI4(entry.codeLength);
+		directory.addUI4(static_cast<std::uint32_t>(entry.references.size()));
+		for (auto& reference : entry.references) {
+			directory.addUI4(reference.referenceOffset);
+			directory.addUI4(reference.slotOffset);
+			directory.addUI4(reference.slotIndex);
+		}
+	}
+	std::size_t codeFileOffset = (CodeImageHeaderSize + directory.size() + pageSize - 1) & ~(pageSize - 1);
+
+	ByteBuffer header;
+	header.addUI4(CodeImageMagic);
+	header.addUI4(CodeImageVersion);
+	header.addUI8(codeFileOffset);
+	header.addUI8(code.size());
+	header.addUI8(tableOffset);
+	header.addUI4(static_cast<std::uint32_t>(slotIndices.size()));
+	header.addUI4(static_cast<std::uint32_t>(methods.size()));
+	header.addUI8(directory.size());
+
+	// Write next to the final name and rename it over, processes mapping the old image keep their mapping
+	std::filesystem::path temporaryFilename = filename;
+	temporaryFilename += "." + std::to_string(getpid());
+	{
+		std::ofstream stream(temporaryFilename, std::ios::binary | std::ios::trunc);
+		if (!stream) return false;
+		std::vector<char> padding(codeFileOffset - CodeImageHeaderSize - directory.size(), 0);
+		stream.write(reinterpret_cast<const char*>(header.data()), header.size());
+		stream.write(reinterpret_cast<const char*>(directory.data()), directory.size());
+		stream.write(padding.data(), padding.size());
+		stream.write(reinterpret_cast<const char*>(code.data()), code.size());
+		if (!stream) {
+			stream.close();
+			std::filesystem::remove(temporaryFilename);
+			return false;
+		}
+	}
+	std::error_code error;
+	std::filesystem::rename(temporaryFilename, filename, error);
+	if (error) std::filesystem::remove(temporaryFilename, error);
+	return !error;
+}
+
+bool CodeImage::map(const std::filesystem::path& filename) {
+	if (this->pCode) return false;
+	int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return false;
+
+	auto fail = [&]() -> bool {
+		close(fd);
+		this->methods.clear();
+		return false;
+	};
+
+	// Read and check the header and directory before mapping anything
+	std::uint8_t headerBytes[CodeImageHeaderSize];
+	struct stat fileStat {};
+	if (pread(fd, headerBytes, CodeImageHeaderSize, 0) != static_cast<ssize_t>(CodeImageHeaderSize) || fstat(fd, &fileStat) != 0) return fail();
+	ByteBuffer header(std::span<const std::uint8_t>(headerBytes, CodeImageHeaderSize));
+	std::uint32_t magic          = header.getUI4();
+	std::uint32_t version        = header.getUI4();
+	std::uint64_t codeFileOffset = header.getUI8();
+	std::uint64_t codeSize       = header.getUI8();
+	std::uint64_t tableOffset    = header.getUI8();
+	std::uint32_t slotCount      = header.getUI4();
+	std::uint32_t methodCount    = header.getUI4();
+	std::uint64_t directorySize  = header.getUI8();
+	std::size_t pageSize         = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+	if (magic != CodeImageMagic || version != CodeImageVersion) return fail();
+	if (codeFileOffset % pageSize || tableOffset % pageSize || tableOffset < codeSize || tableOffset - codeSize >= pageSize) return fail();
+	if (directorySize > codeFileOffset - CodeImageHeaderSize || codeFileOffset > static_cast<std::uint64_t>(fileStat.st_size) || codeSize > fileStat.st_size - codeFileOffset) return fail();
+
+	std::vector<std::uint8_t> directoryBytes(directorySize);
+	if (pread(fd, directoryBytes.data(), directorySize, CodeImageHeaderSize) != static_cast<ssize_t>(directorySize)) return fail();
+	ByteBuffer directory(directoryBytes);
+	this->methods.resize(methodCount);
+	for (auto& entry : this->methods) {
+		entry.className              = directory.getString(directory.getUI4());
+		entry.methodDescriptor       = directory.getString(directory.getUI4());
+		entry.codeOffset             = directory.getUI4();
+		entry.codeLength             = directory.getUI4();
+		std::uint32_t referenceCount = directory.getUI4();
+		if (directory.getOffset() > directory.size() || static_cast<std::uint64_t>(entry.codeOffset) + entry.codeLength > codeSize || referenceCount > entry.codeLength) return fail();
+		entry.references.resize(referenceCount);
+		for (auto& reference : entry.references) {
+			reference.referenceOffset = directory.getUI4();
+			reference.slotOffset      = directory.getUI4();
+			reference.slotIndex       = directory.getUI4();
+			if (static_cast<std::uint64_t>(reference.referenceOffset) + 4 > entry.codeLength || static_cast<std::uint64_t>(reference.slotOffset) + 8 > entry.codeLength || reference.slotIndex >= slotCount) return fail();
+		}
+	}
+	if (directory.getOffset() > directory.size()) return fail();
+
+	// Reserve the whole range so the table ends up at the distance the code was linked for
+	std::size_t tableSize  = (static_cast<std::size_t>(slotCount) * 8 + pageSize - 1) & ~(pageSize - 1);
+	std::size_t mappedSize = tableOffset + tableSize;
+	if (mappedSize == 0) return fail();
+	void* pBase = mmap(nullptr, mappedSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pBase == MAP_FAILED) return fail();
+	auto pCode = reinterpret_cast<std::uint8_t*>(pBase);
+	// The shared mapping fails on file systems mounted noexec
+	if ((codeSize && mmap(pCode, codeSize, PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED, fd, codeFileOffset) == MAP_FAILED) ||
+	    (tableSize && mprotect(pCode + tableOffset, tableSize, PROT_READ | PROT_WRITE) != 0)) {
+		munmap(pBase, mappedSize);
+		return fail();
+	}
+	close(fd);
+
+	this->pCode       = pCode;
+	this->codeSize    = codeSize;
+	this->tableOffset = tableOffset;
+	this->mappedSize  = mappedSize;
+	this->slotCount   = slotCount;
+	for (auto& entry : this->methods)
+		for (auto& reference : entry.references)
+			this->slots.insert({ pCode + entry.codeOffset + reference.slotOffset, reinterpret_cast<std::uint8_t**>(pCode + tableOffset + reference.slotIndex * 8) });
+	return true;
+}
+#else
+// Shared code images rely on mapping a file read execute at a chosen address, which is only implemented for Linux
+bool CodeImage::publish(const std::filesystem::path& filename, const std::vector<Class*>& classes) {
+	return false;
+}
+
+bool CodeImage::map(const std::filesystem::path& filename) {
+	return false;
+}
+#endif
+
+bool CodeImage::matches(const CodeImageMethod& entry, const Method& method) const {
+	if (!this->pCode || !method.pCode || method.pInfo->codeLength != entry.codeLength || method.pInfo->slotReferences.size() != entry.references.size()) return false;
+
+	// Apply the same rewrite to a copy of the code as it was linked here and compare
+	std::vector<std::uint8_t> code(method.pCode, method.pCode + method.pInfo->codeLength);
+	for (auto& nearCall : method.pInfo->pBlock->nearCalls)
+		CodeHeap::writeIndirectCall(code.data(), nearCall);
+	for (std::size_t i = 0; i < entry.references.size(); i++) {
+		auto& reference = entry.references[i];
+		if (method.pInfo->slotReferences[i] != reference.referenceOffset || getSlotOffset(code.data(), reference.referenceOffset) != reference.slotOffset) return false;
+	}
+	rewriteCode(code.data(), entry, this->tableOffset);
+	return std::memcmp(code.data(), this->pCode + entry.codeOffset, code.size()) == 0;
+}
+
+void CodeImage::fillSlots(const CodeImageMethod& entry, const Method& method) {
+	for (auto& reference : entry.references)
+		std::memcpy(this->pCode + this->tableOffset + reference.slotIndex * 8, method.pCode + reference.slotOffset, 8);
+}
+
+std::uint8_t** CodeImage::findSlot(const std::uint8_t* pSlot) const {
+	auto itr = this->slots.find(pSlot);
+	return itr != this->slots.end() ? itr->second : nullptr;
+}
\ No newline at end of file
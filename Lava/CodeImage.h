@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct Class;
+struct Method;
+
+// A displacement in method code that addresses an absolute pointer slot, in the image it addresses 'slotIndex' in the
+// private table instead
+struct CodeImageReference {
+	std::uint32_t referenceOffset = 0;
+	std::uint32_t slotOffset      = 0;
+	std::uint32_t slotIndex       = 0;
+};
+
+struct CodeImageMethod {
+	std::string className;
+	std::string methodDescriptor;
+	std::uint32_t codeOffset = 0;
+	std::uint32_t codeLength = 0;
+	std::vector<CodeImageReference> references;
+};
+
+// Linked method code shared between processes through a file in shared memory. The code pages are mapped read execute
+// from the file, the absolute addresses it needs live in a private table mapped right behind the code, so every
+// process fills in its own addresses while the code itself stays byte identical.
+class CodeImage {
+public:
+	CodeImage() = default;
+	CodeImage(const CodeImage&) = delete;
+	CodeImage(CodeImage&&)      = delete;
+	CodeImage& operator=(const CodeImage&) = delete;
+	CodeImage& operator=(CodeImage&&) = delete;
+	~CodeImage();
+
+	// Writes the linked code of every method of the classes to 'filename', an existing image is replaced atomically
+	static bool publish(const std::filesystem::path& filename, const std::vector<Class*>& classes);
+	// Maps an image written by publish, the methods only run from it once their slots are filled in
+	bool map(const std::filesystem::path& filename);
+
+	// Checks that the image holds exactly the code 'method' was linked to in this process
+	bool matches(const CodeImageMethod& entry, const Method& method) const;
+	// Copies the absolute addresses of the code 'method' was linked to into the private table
+	void fillSlots(const CodeImageMethod& entry, const Method& method);
+	std::uint8_t* getCode(const CodeImageMethod& entry) const { return this->pCode + entry.codeOffset; }
+
+	bool owns(const std::uint8_t* p) const { return p >= this->pCode && p < this->pCode + this->codeSize; }
+	// Returns the table entry standing in for the pointer slot at 'pSlot' in the image code, or nullptr
+	std::uint8_t** findSlot(const std::uint8_t* pSlot) const;
+
+	auto& getMethods() const { return this->methods; }
+	auto getCodeSize() const { return this->codeSize; }
+	auto getSlotCount() const { return this->slotCount; }
+
+private:
+	// Zeroes the pointer slots in a copy of the method code and points its references at the table
+	static void rewriteCode(std::uint8_t* pCode, const CodeImageMethod& entry, std::size_t tableOffset);
+
+private:
+	std::uint8_t* pCode     = nullptr;
+	std::size_t codeSize    = 0;
+	std::size_t tableOffset = 0;
+	std::size_t mappedSize  = 0;
+	std::size_t slotCount   = 0;
+	std::vector<CodeImageMethod> methods;
+	std::unordered_map<const std::uint8_t*, std::uint8_t**> slots;
+};
\ No newline at end of file
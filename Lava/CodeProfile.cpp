@@ -0,0 +1,164 @@
+#include "CodeProfile.h"
+#include "ClassRegistry.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+
+#if LAVA_SYSTEM_linux
+	#include <csignal>
+	#include <sys/time.h>
+	#include <ucontext.h>
+#endif
+
+//----------
+// Sampling
+//----------
+
+// Samples are written from a signal handler, so they go into a fixed buffer without any locking or allocation
+static constexpr std::size_t MaxSampleCount = 65536;
+static std::uintptr_t sampledPCs[MaxSampleCount];
+static std::atomic<std::size_t> sampleCount       = 0;
+static std::atomic<CodeProfile*> samplingProfile = nullptr;
+
+#if LAVA_SYSTEM_linux
+// The handler SIGPROF had before sampling started, it is put back once sampling stops
+static struct sigaction previousAction;
+
+static void profileSignalHandler(int, siginfo_t*, void* pContext) {
+	auto context      = reinterpret_cast<ucontext_t*>(pContext);
+	std::size_t index = sampleCount.fetch_add(1, std::memory_order_relaxed);
+	if (index < MaxSampleCount) sampledPCs[index] = static_cast<std::uintptr_t>(context->uc_mcontext.gregs[REG_RIP]);
+}
+
+static bool startSampleTimer(std::chrono::microseconds interval) {
+	struct sigaction action {};
+	action.sa_sigaction = &profileSignalHandler;
+	action.sa_flags     = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGPROF, &action, &previousAction) != 0) return false;
+
+	itimerval timer {};
+	timer.it_interval.tv_sec  = static_cast<time_t>(interval.count() / 1000000);
+	timer.it_interval.tv_usec = static_cast<suseconds_t>(interval.count() % 1000000);
+	timer.it_value            = timer.it_interval;
+	if (setitimer(ITIMER_PROF, &timer, nullptr) == 0) return true;
+	sigaction(SIGPROF, &previousAction, nullptr);
+	return false;
+}
+
+static void stopSampleTimer() {
+	itimerval timer {};
+	setitimer(ITIMER_PROF, &timer, nullptr);
+	sigaction(SIGPROF, &previousAction, nullptr);
+}
+#else
+// No sampling support, profiles can still be built with addSamples or read from a layout file
+static bool startSampleTimer(std::chrono::microseconds interval) {
+	return false;
+}
+
+static void stopSampleTimer() {}
+#endif
+
+//--------------
+// Code profile
+//--------------
+
+bool CodeProfile::startSampling(std::chrono::microseconds interval) {
+	CodeProfile* expected = nullptr;
+	if (interval.count() <= 0 || !samplingProfile.compare_exchange_strong(expected, this)) return false;
+
+	sampleCount = 0;
+	if (!startSampleTimer(interval)) {
+		samplingProfile = nullptr;
+		return false;
+	}
+	this->sampling = true;
+	return true;
+}
+
+void CodeProfile::stopSampling() {
+	if (!this->sampling) return;
+	stopSampleTimer();
+	this->sampling  = false;
+	samplingProfile = nullptr;
+}
+
+void CodeProfile::collect(const ClassRegistry& registry) {
+	struct CodeRange {
+		std::uintptr_t begin;
+		std::uintptr_t end;
+		const Class* clazz;
+		const Method* method;
+	};
+
+	// Sort the code of every loaded method by address so each sample is a binary search
+	std::vector<CodeRange> ranges;
+	for (auto clazz : registry.getLoadedClasses()) {
+		for (auto& method : clazz->methods) {
+			if (!method.pInfo->codeLength) continue;
+			auto begin = reinterpret_cast<std::uintptr_t>(method.pCode);
+			ranges.push_back({ begin, begin + method.pInfo->codeLength, clazz, &method });
+		}
+	}
+	std::sort(ranges.begin(), ranges.end(), [](const CodeRange& lhs, const CodeRange& rhs) -> bool {
+		return lhs.begin < rhs.begin;
+	});
+
+	// Methods sharing a block all match the same samples, the first one takes them
+	std::size_t count = std::min(sampleCount.exchange(0), MaxSampleCount);
+	for (std::size_t i = 0; i < count; i++) {
+		std::uintptr_t pc = sampledPCs[i];
+		auto itr          = std::upper_bound(ranges.begin(), ranges.end(), pc, [](std::uintptr_t pc, const CodeRange& range) -> bool {
+			return pc < range.begin;
+		});
+		if (itr == ranges.begin()) continue;
+		--itr;
+		if (pc >= itr->end) continue;
+		addSamples(std::string(itr->clazz->name), std::string(itr->method->pInfo->descriptor), 1);
+	}
+	sortEntries();
+}
+
+void CodeProfile::addSamples(const std::string& className, const std::string& methodDescriptor, std::uint64_t samples) {
+	auto itr = std::find_if(this->entries.begin(), this->entries.end(), [&](const CodeProfileEntry& entry) -> bool {
+		return entry.className == className && entry.methodDescriptor == methodDescriptor;
+	});
+	if (itr != this->entries.end())
+		itr->samples += samples;
+	else
+		this->entries.push_back({ className, methodDescriptor, samples });
+}
+
+bool CodeProfile::writeLayout(const std::filesystem::path& filename) const {
+	// One method per line, hottest first: '<samples>\t<class name>\t<method descriptor>', names can contain spaces
+	std::ofstream stream(filename);
+	if (!stream) return false;
+	for (auto& entry : this->entries)
+		stream << entry.samples << '\t' << entry.className << '\t' << entry.methodDescriptor << '\n';
+	return static_cast<bool>(stream);
+}
+
+bool CodeProfile::readLayout(const std::filesystem::path& filename) {
+	std::ifstream stream(filename);
+	if (!stream) return false;
+
+	// The method descriptor is the rest of the line after the second tab
+	std::string line;
+	while (std::getline(stream, line)) {
+		std::istringstream lineStream(line);
+		CodeProfileEntry entry;
+		if (!(lineStream >> entry.samples) || lineStream.get() != '\t' || !std::getline(lineStream, entry.className, '\t') || !std::getline(lineStream, entry.methodDescriptor)) continue;
+		addSamples(entry.className, entry.methodDescriptor, entry.samples);
+	}
+	sortEntries();
+	return true;
+}
+
+void CodeProfile::sortEntries() {
+	std::stable_sort(this->entries.begin(), this->entries.end(), [](const CodeProfileEntry& lhs, const CodeProfileEntry& rhs) -> bool {
+		return lhs.samples > rhs.samples;
+	});
+}
\ No newline at end of file
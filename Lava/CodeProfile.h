@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+
+#include <chrono>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+class ClassRegistry;
+
+struct CodeProfileEntry {
+	std::string className;
+	std::string methodDescriptor;
+	std::uint64_t samples = 0;
+};
+
+// Call profile of Lava methods, hottest first, used to lay out method code so hot paths are packed together
+class CodeProfile {
+public:
+	// Samples the program counter of the running process on a CPU time interval, only one profile can sample at a time
+	bool startSampling(std::chrono::microseconds interval = std::chrono::microseconds(1000));
+	void stopSampling();
+	// Attributes the samples taken so far to the methods loaded in the registry
+	void collect(const ClassRegistry& registry);
+
+	void addSamples(const std::string& className, const std::string& methodDescriptor, std::uint64_t samples);
+	bool writeLayout(const std::filesystem::path& filename) const;
+	bool readLayout(const std::filesystem::path& filename);
+
+	auto& getEntries() const { return this->entries; }
+	bool isSampling() const { return this->sampling; }
+
+private:
+	void sortEntries();
+
+private:
+	bool sampling = false;
+	std::vector<CodeProfileEntry> entries;
+};
\ No newline at end of file
@@ -0,0 +1,109 @@
+#include "Compression.h"
+
+#include <cstring>
+
+static constexpr std::size_t MinMatchLength  = 4;
+static constexpr std::size_t MaxMatchOffset  = 65535;
+static constexpr std::size_t HashTableBits   = 12;
+static constexpr std::size_t HashTableSize   = 1 << HashTableBits;
+static constexpr std::uint32_t NoMatchOffset = 0xFFFFFFFF;
+
+static std::uint32_t hashSequence(const std::uint8_t* pData) {
+	std::uint32_t sequence;
+	std::memcpy(&sequence, pData, 4);
+	return (sequence * 2654435761U) >> (32 - HashTableBits);
+}
+
+static void writeLength(std::vector<std::uint8_t>& output, std::size_t length) {
+	for (; length >= 255; length -= 255)
+		output.push_back(255);
+	output.push_back(static_cast<std::uint8_t>(length));
+}
+
+static void writeSequence(std::vector<std::uint8_t>& output, const std::uint8_t* pLiterals, std::size_t literalLength, std::size_t matchOffset, std::size_t matchLength) {
+	std::size_t matchCode = matchLength ? matchLength - MinMatchLength : 0;
+	output.push_back(static_cast<std::uint8_t>((literalLength < 15 ? literalLength : 15) << 4 | (matchCode < 15 ? matchCode : 15)));
+	if (literalLength >= 15) writeLength(output, literalLength - 15);
+	output.insert(output.end(), pLiterals, pLiterals + literalLength);
+	if (!matchLength) return;
+
+	output.push_back(static_cast<std::uint8_t>(matchOffset & 0xFF));
+	output.push_back(static_cast<std::uint8_t>((matchOffset >> 8) & 0xFF));
+	if (matchCode >= 15) writeLength(output, matchCode - 15);
+}
+
+std::vector<std::uint8_t> compressLZ(const std::uint8_t* pData, std::size_t length) {
+	std::vector<std::uint8_t> output;
+	output.reserve(length / 2 + 16);
+
+	// Greedy matching against the most recent position of every hashed 4 byte sequence
+	std::uint32_t positions[HashTableSize];
+	for (auto& position : positions)
+		position = NoMatchOffset;
+
+	std::size_t literalBegin = 0;
+	std::size_t i            = 0;
+	while (i + MinMatchLength <= length) {
+		std::uint32_t hash      = hashSequence(pData + i);
+		std::uint32_t candidate = positions[hash];
+		positions[hash]         = static_cast<std::uint32_t>(i);
+		if (candidate == NoMatchOffset || i - candidate > MaxMatchOffset || std::memcmp(pData + candidate, pData + i, MinMatchLength) != 0) {
+			i++;
+			continue;
+		}
+
+		std::size_t matchLength = MinMatchLength;
+		while (i + matchLength < length && pData[candidate + matchLength] == pData[i + matchLength])
+			matchLength++;
+		writeSequence(output, pData + literalBegin, i - literalBegin, i - candidate, matchLength);
+		i += matchLength;
+		literalBegin = i;
+	}
+
+	// The remaining bytes go out as literals
+	writeSequence(output, pData + literalBegin, length - literalBegin, 0, 0);
+	return output;
+}
+
+bool decompressLZ(const std::uint8_t* pInput, std::size_t inputLength, std::uint8_t* pOutput, std::size_t outputLength) {
+	std::size_t in  = 0;
+	std::size_t out = 0;
+	auto readLength = [&](std::size_t& length) -> bool {
+		std::uint8_t byte;
+		do {
+			if (in >= inputLength) return false;
+			byte = pInput[in++];
+			length += byte;
+		} while (byte == 255);
+		return true;
+	};
+
+	while (in < inputLength) {
+		std::uint8_t token = pInput[in++];
+
+		std::size_t literalLength = token >> 4;
+		if (literalLength == 15 && !readLength(literalLength)) return false;
+		if (literalLength > inputLength - in || literalLength > outputLength - out) return false;
+		if (literalLength) std::memcpy(pOutput + out, pInput + in, literalLength);
+		in += literalLength;
+		out += literalLength;
+
+		// Only the last sequence ends without a match
+		if (in == inputLength) break;
+
+		if (inputLength - in < 2) return false;
+		std::size_t matchOffset = pInput[in] | pInput[in + 1] << 8;
+		in += 2;
+		std::size_t matchLength = token & 0xF;
+		if (matchLength == 15 && !readLength(matchLength)) return false;
+		matchLength += MinMatchLength;
+		if (matchOffset == 0 || matchOffset > out || matchLength > outputLength - out) return false;
+
+		// Matches may overlap their own output, so copy byte by byte
+		const std::uint8_t* pMatch = pOutput + out - matchOffset;
+		for (std::size_t j = 0; j < matchLength; j++)
+			pOutput[out + j] = pMatch[j];
+		out += matchLength;
+	}
+	return out == outputLength;
+}
\ No newline at end of file
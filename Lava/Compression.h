@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <vector>
+
+// LZ77 block codec in the style of LZ4, shared with LavaCompiler for compressed code.
+// A block is a list of sequences, each starting with a token holding the literal count in its high nibble and the
+// match length minus 4 in its low nibble. A nibble of 15 continues in following bytes, each adding up to 255.
+// The literals follow the token, then a 16 bit little endian match offset. The last sequence only holds literals.
+std::vector<std::uint8_t> compressLZ(const std::uint8_t* pData, std::size_t length);
+// Decompresses a block into exactly 'outputLength' bytes, returns false if the block is malformed
+bool decompressLZ(const std::uint8_t* pInput, std::size_t inputLength, std::uint8_t* pOutput, std::size_t outputLength);
\ No newline at end of file
@@ -0,0 +1,43 @@
+#include "InvocationCounters.h"
+
+#include <algorithm>
+
+std::ostream& operator<<(std::ostream& stream, EInvocationCounterKind kind) {
+	switch (kind) {
+	case EInvocationCounterKind::MethodCalls: return stream << "MethodCalls";
+	case EInvocationCounterKind::DirectCalls: return stream << "DirectCalls";
+	case EInvocationCounterKind::SlowPathResolutions: return stream << "SlowPathResolutions";
+	}
+	return stream;
+}
+
+std::atomic<std::uint64_t>* InvocationCounters::allocate(const InvocationCounter& counter) {
+	std::string key = std::to_string(static_cast<std::uint32_t>(counter.kind)) + ' ' + counter.className + ' ' + counter.methodDescriptor + ' ' + counter.targetClassName + ' ' + counter.targetMethodDescriptor + ' ' + std::to_string(counter.byteOffset);
+	auto itr        = this->counterIndices.find(key);
+	if (itr != this->counterIndices.end()) return &this->values[itr->second];
+
+	// The array is never resized, generated code holds the addresses of its counters
+	if (this->counters.size() >= this->capacity) return nullptr;
+	if (!this->values) this->values = std::make_unique<std::atomic<std::uint64_t>[]>(this->capacity);
+
+	std::size_t index = this->counters.size();
+	this->counters.push_back(counter);
+	this->counterIndices.insert({ std::move(key), index });
+	this->values[index].store(0, std::memory_order_relaxed);
+	return &this->values[index];
+}
+
+std::vector<InvocationCounter> InvocationCounters::snapshot() const {
+	std::vector<InvocationCounter> counters = this->counters;
+	for (std::size_t i = 0; i < counters.size(); i++)
+		counters[i].count = this->values[i].load(std::memory_order_relaxed);
+	std::stable_sort(counters.begin(), counters.end(), [](const InvocationCounter& lhs, const InvocationCounter& rhs) -> bool {
+		return lhs.count > rhs.count;
+	});
+	return counters;
+}
+
+void InvocationCounters::reset() {
+	for (std::size_t i = 0; i < this->counters.size(); i++)
+		this->values[i].store(0, std::memory_order_relaxed);
+}
\ No newline at end of file
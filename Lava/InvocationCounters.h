@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <atomic>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+enum class EInvocationCounterKind : std::uint32_t {
+	MethodCalls = 0,    // Calls entering a method
+	DirectCalls,        // Calls made through a linked call site
+	SlowPathResolutions // Calls made through a call site that resolves its target on every call
+};
+
+std::ostream& operator<<(std::ostream& stream, EInvocationCounterKind kind);
+
+struct InvocationCounter {
+	EInvocationCounterKind kind = EInvocationCounterKind::MethodCalls;
+	std::string className;
+	std::string methodDescriptor;
+	// The method refered to by a call site and the offset of the site in the original code
+	std::string targetClassName;
+	std::string targetMethodDescriptor;
+	std::uint32_t byteOffset = 0;
+	std::uint64_t count      = 0;
+};
+
+// Counters incremented by instrumented code, kept in one contiguous array so every increment is a single relaxed add
+class InvocationCounters {
+public:
+	InvocationCounters(std::size_t capacity = 65536) : capacity(capacity) { }
+	InvocationCounters(const InvocationCounters&) = delete;
+	InvocationCounters(InvocationCounters&&)      = delete;
+	InvocationCounters& operator=(const InvocationCounters&) = delete;
+	InvocationCounters& operator=(InvocationCounters&&) = delete;
+
+	// Returns the counter for the given method or call site, reloaded code keeps counting into the same counter,
+	// returns nullptr once every counter is in use
+	std::atomic<std::uint64_t>* allocate(const InvocationCounter& counter);
+	// Copies every counter that has been allocated, sorted by decreasing count
+	std::vector<InvocationCounter> snapshot() const;
+	void reset();
+
+	auto getCapacity() const { return this->capacity; }
+	auto getCount() const { return this->counters.size(); }
+
+private:
+	std::size_t capacity;
+	std::unique_ptr<std::atomic<std::uint64_t>[]> values;
+	std::vector<InvocationCounter> counters;
+	std::unordered_map<std::string, std::size_t> counterIndices;
+};
\ No newline at end of file
@@ -1,27 +1,38 @@
 #include "ClassRegistry.h"
+#include "UTF8.h"
 
+#include <cstdlib>
+
+#include <chrono>
 #include <filesystem>
 #include <iostream>
+#include <string>
+#include <tuple>
+#include <vector>
 
 void debugPrintClass(Class& clazz) {
 	std::cout << "Class '" << clazz.name << "'\n";
 	std::cout << "\tAccess Flags: '" << clazz.accessFlags << "'\n";
+	std::cout << "\tInstance Size: " << clazz.instanceSize << ", Alignment: " << clazz.instanceAlignment << "\n";
 	for (std::size_t i = 0; i < clazz.supers.size(); i++)
-		std::cout << "\tSuper '" << clazz.supers[i]->name << "'\n";
+		std::cout << "\tSuper '" << clazz.supers[i]->name << "' at offset " << clazz.superOffsets[i] << "\n";
 	for (std::size_t i = 0; i < clazz.fields.size(); i++) {
 		auto& field = clazz.fields[i];
 		std::cout << "\tField '" << field.name << "'\n";
 		std::cout << "\t\tDescriptor: '" << field.descriptor << "'\n";
 		std::cout << "\t\tAccessFlags: '" << field.accessFlags << "'\n";
+		std::cout << "\t\tOffset: " << field.offset << ", Size: " << field.size << (field.hot ? ", Hot" : "") << "\n";
 	}
+	for (std::size_t i = 0; i < clazz.vtable.size(); i++)
+		std::cout << "\tSlot " << i << ": '" << clazz.vtable[i]->pInfo->descriptor << "'\n";
 	for (std::size_t i = 0; i < clazz.methods.size(); i++) {
 		auto& method = clazz.methods[i];
-		std::cout << "\tMethod '" << method.name << "'\n";
-		std::cout << "\t\tDescriptor: '" << method.descriptor << "'\n";
-		std::cout << "\t\tAccessFlags: '" << method.accessFlags << "'\n";
+		std::cout << "\tMethod '" << method.pInfo->name << "'\n";
+		std::cout << "\t\tDescriptor: '" << method.pInfo->descriptor << "'\n";
+		std::cout << "\t\tAccessFlags: '" << method.pInfo->accessFlags << "'\n";
 		std::cout << "\t\tCode:" << std::hex << std::uppercase << "\n\t\t\t";
 		std::size_t column = 0;
-		for (std::size_t j = 0; j < method.codeLength; j++) {
+		for (std::size_t j = 0; j < method.pInfo->codeLength; j++) {
 			if (column > 0) {
 				if ((column % 8) == 0)
 					std::cout << "  ";
@@ -41,6 +52,42 @@ void debugPrintClass(Class& clazz) {
 	}
 }
 
+// Times every UTF-8 validator over string data shaped like a constant pool and relates it to the load time per validated byte
+void benchmarkUTF8Validation(const ClassLoadStats& loadStats) {
+	const char* asciiNames[] = { "Test", "Other", "P", "(JJJ)J", "getMethodFromDescriptor", "java/lang/Object", "instanceSize", "L" };
+	const char* mixedNames[] = { "Gr\xC3\xB6\xC3\x9F" "e", "\xE5\x90\x8D\xE5\x89\x8D", "caf\xC3\xA9", "(JJ)J", "\xF0\x9F\x93\xA6" "Box", "Test", "\xCE\xB1\xCE\xB2" };
+	auto makeStrings = [](auto& names) {
+		std::string strings;
+		for (std::size_t i = 0; strings.size() < 65536; i++)
+			strings += names[i % std::size(names)];
+		return strings;
+	};
+
+	std::pair<const char*, std::string> inputs[] = { { "ASCII", makeStrings(asciiNames) }, { "Mixed", makeStrings(mixedNames) } };
+	for (auto& input : inputs) {
+		auto pData = reinterpret_cast<const std::uint8_t*>(input.second.data());
+		for (auto validator : { EUTF8Validator::Scalar, EUTF8Validator::SSE2, EUTF8Validator::AVX2 }) {
+			if (!isUTF8ValidatorSupported(validator)) {
+				std::cout << "UTF-8 " << input.first << " " << validator << ": not supported\n";
+				continue;
+			}
+			// Best of several rounds, each long enough for the clock
+			double bestNsPerByte = 0.0;
+			std::size_t valid    = 0;
+			for (std::size_t round = 0; round < 5; round++) {
+				auto start = std::chrono::steady_clock::now();
+				for (std::size_t i = 0; i < 64; i++)
+					valid += validateUTF8(pData, input.second.size(), validator);
+				double nsPerByte = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / (64.0 * input.second.size());
+				if (round == 0 || nsPerByte < bestNsPerByte) bestNsPerByte = nsPerByte;
+			}
+			std::cout << "UTF-8 " << input.first << " " << validator << ": " << 1.0 / bestNsPerByte << " GB/s";
+			if (loadStats.loadTime) std::cout << ", " << 100.0 * bestNsPerByte * loadStats.validatedBytes / loadStats.loadTime << "% of load time";
+			std::cout << (valid == 5 * 64 ? "" : ", rejected") << "\n";
+		}
+	}
+}
+
 LAVA_MICROSOFT_CALL_ABI std::uint64_t returnFirstArg(std::uint64_t arg) {
 	return arg + 6;
 }
@@ -50,18 +97,43 @@ int main() {
 	globalClassRegistry->addClassPath(".");
 	globalClassRegistry->setPreloadRequiredClasses(true);
 
+	// Record a code layout profile when LAVA_PROFILE_LAYOUT names the file to write it to
+	const char* profileLayoutFilename = std::getenv("LAVA_PROFILE_LAYOUT");
+	CodeProfile profile;
+	if (profileLayoutFilename) profile.startSampling();
+	// Count method calls and call site invocations when LAVA_INVOCATION_COUNTERS is set
+	globalClassRegistry->setInstrumented(std::getenv("LAVA_INVOCATION_COUNTERS") != nullptr);
+	// Copy leaf methods of up to LAVA_INLINE_THRESHOLD bytes into their callers
+	if (const char* inlineThreshold = std::getenv("LAVA_INLINE_THRESHOLD")) globalClassRegistry->setInlineThreshold(std::strtoull(inlineThreshold, nullptr, 10));
+	// Keep code memory W^X by writing through a second mapping when LAVA_DUAL_MAPPED_CODE is set
+	globalClassRegistry->getCodeHeap().setDualMapped(std::getenv("LAVA_DUAL_MAPPED_CODE") != nullptr);
+	// Share the constants of lazy call stubs through per region literal pools when LAVA_LITERAL_POOLS is set
+	globalClassRegistry->getCodeHeap().setLiteralPools(std::getenv("LAVA_LITERAL_POOLS") != nullptr);
+
 #if 0
 	// Construct a new class before starting app
 	auto otherClazz = globalClassRegistry->newClass("Other");
-	Method otherClazzL;
-	otherClazzL.name       = "L";
-	otherClazzL.descriptor = "L";
+	otherClazz->setMethodCount(1);
+	Method& otherClazzL           = otherClazz->methods[0];
+	otherClazzL.pInfo->name       = "L";
+	otherClazzL.pInfo->descriptor = "L";
 	otherClazzL.setMethod(&returnFirstArg);
-	otherClazz->methods.push_back(otherClazzL);
+	otherClazz->link();
 #endif
 
 	// Load class "Test" from the "Test.lclass" file in the "Run" directory
 	auto& clazz = globalClassRegistry->loadClassErrorc("Test");
+	// Pack hot code together using the layout recorded by a previous run
+	if (!profileLayoutFilename && std::filesystem::exists("Lava.layout"))
+		std::cout << "Relinked " << globalClassRegistry->applyCodeLayout(std::filesystem::path("Lava.layout")) << " code blocks\n";
+	// Share the linked code with other processes through the image named by LAVA_CODE_IMAGE, publishing it if it does not exist yet
+	if (const char* codeImageFilename = std::getenv("LAVA_CODE_IMAGE")) {
+		std::size_t imageMethods = globalClassRegistry->mapCodeImage(codeImageFilename);
+		if (imageMethods)
+			std::cout << "Mapped " << imageMethods << " methods from code image\n";
+		else if ((imageMethods = globalClassRegistry->publishCodeImage(codeImageFilename)))
+			std::cout << "Published " << imageMethods << " methods to code image\n";
+	}
 	// Debug print class information
 	debugPrintClass(clazz);
 	// Invoke the method 'P' in the class
@@ -70,4 +142,46 @@ int main() {
 	std::uint64_t result = method.invoke<int, std::uint64_t, std::uint64_t, std::uint64_t>(1, 2, 3);
 	// Print the return value from the method
 	std::cout << "Returned: " << std::hex << std::uppercase << result << std::dec << std::nouppercase << "\n";
+	// Print how long loading took and how much of it went into validating strings
+	auto& loadStats = globalClassRegistry->getLoadStats();
+	std::cout << "Loaded " << loadStats.classCount << " classes in " << loadStats.loadTime << " ns, UTF-8 validation of " << loadStats.validatedBytes << " bytes took " << loadStats.validationTime << " ns\n";
+	// Compare the UTF-8 validators when LAVA_BENCHMARK_UTF8 is set
+	if (std::getenv("LAVA_BENCHMARK_UTF8")) benchmarkUTF8Validation(loadStats);
+
+	// Invoke the method 'P' once per argument tuple through a batch driver
+	std::vector<std::tuple<std::uint64_t, std::uint64_t, std::uint64_t>> batchArgs;
+	for (std::uint64_t i = 0; i < 8; i++)
+		batchArgs.emplace_back(i, i + 1, i + 2);
+	std::vector<std::uint64_t> batchResults(batchArgs.size());
+	globalClassRegistry->invokeBatch<std::uint64_t, std::uint64_t, std::uint64_t, std::uint64_t>("Test", "P", batchArgs, batchResults, true);
+	std::cout << "Batch returned:" << std::hex << std::uppercase;
+	for (auto batchResult : batchResults)
+		std::cout << " " << batchResult;
+	std::cout << std::dec << std::nouppercase << "\n";
+
+	// Print how much code memory identical method bodies share
+	auto& codeStats = globalClassRegistry->getCodeHeap().getStats();
+	std::cout << "Code: " << codeStats.blockCount << " blocks, " << codeStats.codeBytes << " bytes, " << codeStats.sharedMethods << " shared methods saving " << codeStats.bytesSaved << " bytes\n";
+	std::cout << "Near calls: " << codeStats.relaxedCalls << "\n";
+	std::cout << "Code backing: " << globalClassRegistry->getCodeHeap().getObtainedBacking() << ", " << codeStats.hugeRegions << "/" << codeStats.regionCount << " huge page regions\n";
+	if (globalClassRegistry->getCodeHeap().getDualMapped()) std::cout << "Dual mapped code regions: " << codeStats.dualRegions << "\n";
+	if (globalClassRegistry->getCodeHeap().getLiteralPools()) std::cout << "Literal pools: " << codeStats.literalBytes << " bytes\n";
+	// Print how compactly the class metadata is packed
+	auto metadataStats = globalClassRegistry->getMetadataArena().getStats();
+	std::cout << "Metadata: " << metadataStats.regionCount << " classes, " << metadataStats.bytesUsed << " bytes in " << metadataStats.chunkCount << " chunks\n";
+
+	if (globalClassRegistry->getInstrumented()) {
+		for (auto& counter : globalClassRegistry->getInvocationCounters().snapshot()) {
+			std::cout << counter.kind << " " << counter.className << "." << counter.methodDescriptor;
+			if (counter.kind != EInvocationCounterKind::MethodCalls)
+				std::cout << " -> " << counter.targetClassName << "." << counter.targetMethodDescriptor << " at " << counter.byteOffset;
+			std::cout << ": " << counter.count << "\n";
+		}
+	}
+
+	if (profileLayoutFilename) {
+		profile.stopSampling();
+		profile.collect(*globalClassRegistry);
+		profile.writeLayout(profileLayoutFilename);
+	}
 }
\ No newline at end of file
@@ -0,0 +1,131 @@
+#include "MetadataArena.h"
+
+#include <algorithm>
+#include <new>
+
+static std::size_t alignUp(std::size_t value, std::size_t alignment) {
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+void* MetadataRegion::do_allocate(std::size_t bytes, std::size_t alignment) {
+	return this->arena.allocate(*this, bytes, alignment);
+}
+
+MetadataArena::MetadataArena() : regionPool(sizeof(MetadataRegion), alignof(MetadataRegion)) {}
+
+MetadataArena::~MetadataArena() {
+	for (auto& chunk : this->chunks)
+		if (chunk.pBase) ::operator delete(chunk.pBase, std::align_val_t(ChunkAlignment));
+	for (auto pBase : this->spareChunks)
+		::operator delete(pBase, std::align_val_t(ChunkAlignment));
+}
+
+MetadataRegion* MetadataArena::newRegion() {
+	auto region = new (this->regionPool.allocate()) MetadataRegion(*this);
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->stats.regionCount++;
+	return region;
+}
+
+void MetadataArena::releaseRegion(MetadataRegion* region) {
+	if (!region) return;
+
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stats.regionCount--;
+		this->stats.bytesUsed -= region->used;
+		for (auto link = region->pChunks; link;) {
+			// The link lives in the chunk it refers to, so step past it before the chunk goes away
+			auto pNext   = link->pNext;
+			Chunk& chunk = this->chunks[link->chunkIndex];
+			if (--chunk.liveRegions == 0) {
+				if (link->chunkIndex == this->currentChunk)
+					chunk.used = 0;
+				else
+					releaseChunk(link->chunkIndex);
+			}
+			link = pNext;
+		}
+	}
+	region->~MetadataRegion();
+	this->regionPool.deallocate(region);
+}
+
+MetadataArenaStats MetadataArena::getStats() const {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->stats;
+}
+
+void* MetadataArena::allocate(MetadataRegion& region, std::size_t bytes, std::size_t alignment) {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	std::size_t linkSize = alignUp(sizeof(MetadataRegion::ChunkLink), alignof(MetadataRegion::ChunkLink));
+
+	// Large allocations get a chunk of their own instead of wasting the rest of the current one
+	std::uint32_t chunkIndex = this->currentChunk;
+	if (bytes + alignment > LargeAllocation) {
+		chunkIndex = newChunk(alignUp(linkSize + alignment + bytes, ChunkAlignment));
+	} else if (chunkIndex == InvalidChunk || alignUp(alignUp(this->chunks[chunkIndex].used, alignof(MetadataRegion::ChunkLink)) + linkSize, alignment) + bytes > this->chunks[chunkIndex].size) {
+		// Leave the full chunk to the regions still using it
+		if (chunkIndex != InvalidChunk && this->chunks[chunkIndex].liveRegions == 0) releaseChunk(chunkIndex);
+		chunkIndex = this->currentChunk = newChunk(ChunkSize);
+	}
+	Chunk& chunk = this->chunks[chunkIndex];
+
+	// Regions allocate from few chunks and mostly from the most recent one, so the list stays short
+	bool linked = false;
+	for (auto link = region.pChunks; link && !linked; link = link->pNext)
+		linked = link->chunkIndex == chunkIndex;
+	if (!linked) {
+		chunk.used       = alignUp(chunk.used, alignof(MetadataRegion::ChunkLink));
+		auto link        = new (chunk.pBase + chunk.used) MetadataRegion::ChunkLink();
+		link->pNext      = region.pChunks;
+		link->chunkIndex = chunkIndex;
+		region.pChunks   = link;
+		chunk.used += linkSize;
+		chunk.liveRegions++;
+		region.used += linkSize;
+		this->stats.bytesUsed += linkSize;
+	}
+
+	std::size_t offset = alignUp(chunk.used, alignment);
+	region.used += offset + bytes - chunk.used;
+	this->stats.bytesUsed += offset + bytes - chunk.used;
+	chunk.used = offset + bytes;
+	return chunk.pBase + offset;
+}
+
+std::uint32_t MetadataArena::newChunk(std::size_t size) {
+	std::uint8_t* pBase = nullptr;
+	if (size == ChunkSize && !this->spareChunks.empty()) {
+		pBase = this->spareChunks.back();
+		this->spareChunks.pop_back();
+	} else {
+		pBase = reinterpret_cast<std::uint8_t*>(::operator new(size, std::align_val_t(ChunkAlignment)));
+		this->stats.chunkAllocations++;
+	}
+
+	std::uint32_t chunkIndex = 0;
+	if (!this->freeChunkIndices.empty()) {
+		chunkIndex = this->freeChunkIndices.back();
+		this->freeChunkIndices.pop_back();
+	} else {
+		chunkIndex = static_cast<std::uint32_t>(this->chunks.size());
+		this->chunks.emplace_back();
+	}
+	this->chunks[chunkIndex] = { pBase, size, 0, 0 };
+	this->stats.chunkCount++;
+	return chunkIndex;
+}
+
+void MetadataArena::releaseChunk(std::uint32_t chunkIndex) {
+	Chunk& chunk = this->chunks[chunkIndex];
+	// Keep a few regular chunks around, classes are often unloaded and loaded again
+	if (chunk.size == ChunkSize && this->spareChunks.size() < MaxSpareChunks)
+		this->spareChunks.push_back(chunk.pBase);
+	else
+		::operator delete(chunk.pBase, std::align_val_t(ChunkAlignment));
+	chunk = {};
+	this->freeChunkIndices.push_back(chunkIndex);
+	if (this->currentChunk == chunkIndex) this->currentChunk = InvalidChunk;
+	this->stats.chunkCount--;
+}
\ No newline at end of file
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "SlabPool.h"
+
+#include <cstddef>
+#include <cstdint>
+
+#include <memory_resource>
+#include <mutex>
+#include <vector>
+
+class MetadataArena;
+
+// The allocations of one class, they are carved out of the arena chunks and freed together when the region is released
+class MetadataRegion : public std::pmr::memory_resource {
+public:
+	MetadataRegion(MetadataArena& arena) : arena(arena) {}
+	MetadataRegion(const MetadataRegion&) = delete;
+	MetadataRegion(MetadataRegion&&)      = delete;
+	MetadataRegion& operator=(const MetadataRegion&) = delete;
+	MetadataRegion& operator=(MetadataRegion&&) = delete;
+
+	auto& getArena() const { return this->arena; }
+	auto getUsed() const { return this->used; }
+
+private:
+	void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+	// Nothing is freed before the region is released, a container that reallocates keeps its old storage in the region
+	void do_deallocate(void*, std::size_t, std::size_t) override {}
+	bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+private:
+	friend class MetadataArena;
+
+	// Records a chunk the region allocated from, links live in the chunk they refer to
+	struct ChunkLink {
+		ChunkLink* pNext         = nullptr;
+		std::uint32_t chunkIndex = 0;
+	};
+
+	MetadataArena& arena;
+	ChunkLink* pChunks = nullptr;
+	std::size_t used   = 0;
+};
+
+struct MetadataArenaStats {
+	std::size_t chunkCount       = 0; // Chunks currently held by live regions or ready to allocate from
+	std::size_t chunkAllocations = 0; // Chunks requested from the system allocator
+	std::size_t regionCount      = 0; // Regions not yet released
+	std::size_t bytesUsed        = 0; // Bytes allocated by regions not yet released
+};
+
+// Bump allocator for class metadata, records and their strings are carved out of large chunks in load order so the
+// metadata of a class and the classes loaded after it are contiguous. Every class allocates from its own region and a
+// chunk is recycled once every region that allocated from it has been released.
+class MetadataArena {
+public:
+	static constexpr std::size_t ChunkSize = 65536;
+
+	MetadataArena();
+	MetadataArena(const MetadataArena&) = delete;
+	MetadataArena(MetadataArena&&)      = delete;
+	MetadataArena& operator=(const MetadataArena&) = delete;
+	MetadataArena& operator=(MetadataArena&&) = delete;
+	~MetadataArena();
+
+	MetadataRegion* newRegion();
+	void releaseRegion(MetadataRegion* region);
+
+	MetadataArenaStats getStats() const;
+
+private:
+	friend class MetadataRegion;
+
+	struct Chunk {
+		std::uint8_t* pBase     = nullptr;
+		std::size_t size        = 0;
+		std::size_t used        = 0;
+		std::size_t liveRegions = 0;
+	};
+
+	static constexpr std::uint32_t InvalidChunk  = ~0U;
+	static constexpr std::size_t MaxSpareChunks  = 4;
+	static constexpr std::size_t ChunkAlignment  = 64;
+	static constexpr std::size_t LargeAllocation = ChunkSize / 4;
+
+	void* allocate(MetadataRegion& region, std::size_t bytes, std::size_t alignment);
+	std::uint32_t newChunk(std::size_t size);
+	void releaseChunk(std::uint32_t chunkIndex);
+
+private:
+	std::vector<Chunk> chunks;
+	std::vector<std::uint32_t> freeChunkIndices;
+	std::vector<std::uint8_t*> spareChunks;
+	std::uint32_t currentChunk = InvalidChunk;
+	SlabPool regionPool;
+	MetadataArenaStats stats;
+	mutable std::mutex mutex;
+};
\ No newline at end of file
@@ -0,0 +1,59 @@
+#include "SlabPool.h"
+
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <new>
+
+SlabPool::SlabPool(std::size_t objectSize, std::size_t objectAlignment, std::size_t objectsPerSlab) {
+	// Every object must be able to hold a free list link while it is not in use
+	this->objectAlignment = std::max(objectAlignment, alignof(FreeObject));
+	this->objectSize      = std::max(objectSize, sizeof(FreeObject));
+	this->objectSize      = (this->objectSize + this->objectAlignment - 1) & ~(this->objectAlignment - 1);
+	// Default to slabs of roughly 64 KiB
+	this->objectsPerSlab = objectsPerSlab ? objectsPerSlab : std::max<std::size_t>(65536 / this->objectSize, 16);
+}
+
+SlabPool::~SlabPool() {
+	for (auto slab : this->slabs)
+		::operator delete(slab, std::align_val_t(this->objectAlignment));
+}
+
+void* SlabPool::allocate() {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	if (!this->pFreeList) allocateSlab();
+
+	FreeObject* object = this->pFreeList;
+	this->pFreeList    = object->pNext;
+	this->liveCount++;
+	std::memset(object, 0, this->objectSize);
+	return object;
+}
+
+void SlabPool::deallocate(void* object) {
+	if (!object) return;
+
+	std::lock_guard<std::mutex> lock(this->mutex);
+	auto freeObject   = reinterpret_cast<FreeObject*>(object);
+	freeObject->pNext = this->pFreeList;
+	this->pFreeList   = freeObject;
+	this->liveCount--;
+}
+
+std::size_t SlabPool::getLiveCount() const {
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->liveCount;
+}
+
+void SlabPool::allocateSlab() {
+	auto slab = reinterpret_cast<std::uint8_t*>(::operator new(this->objectSize * this->objectsPerSlab, std::align_val_t(this->objectAlignment)));
+	this->slabs.push_back(slab);
+
+	// Thread the new objects onto the free list in address order
+	for (std::size_t i = this->objectsPerSlab; i > 0; i--) {
+		auto object     = reinterpret_cast<FreeObject*>(slab + (i - 1) * this->objectSize);
+		object->pNext   = this->pFreeList;
+		this->pFreeList = object;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+
+#include <mutex>
+#include <vector>
+
+// Fixed size object allocator, objects are carved out of large slabs and recycled through a free list
+class SlabPool {
+public:
+	SlabPool(std::size_t objectSize, std::size_t objectAlignment, std::size_t objectsPerSlab = 0);
+	SlabPool(const SlabPool&) = delete;
+	SlabPool(SlabPool&&)      = delete;
+	SlabPool& operator=(const SlabPool&) = delete;
+	SlabPool& operator=(SlabPool&&) = delete;
+	~SlabPool();
+
+	void* allocate();
+	void deallocate(void* object);
+
+	auto getObjectSize() const { return this->objectSize; }
+	auto getObjectAlignment() const { return this->objectAlignment; }
+	auto getSlabCount() const { return this->slabs.size(); }
+	std::size_t getLiveCount() const;
+
+private:
+	struct FreeObject {
+		FreeObject* pNext;
+	};
+
+	void allocateSlab();
+
+private:
+	std::size_t objectSize;
+	std::size_t objectAlignment;
+	std::size_t objectsPerSlab;
+	std::size_t liveCount  = 0;
+	FreeObject* pFreeList = nullptr;
+	std::vector<void*> slabs;
+	mutable std::mutex mutex;
+};
\ No newline at end of file
@@ -0,0 +1,231 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <array>
+#include <stdexcept>
+#include <utility>
+
+//-----------------
+// x86-64 encoding
+//-----------------
+
+enum class EX64Register : std::uint8_t {
+	RAX = 0,
+	RCX,
+	RDX,
+	RBX,
+	RSP,
+	RBP,
+	RSI,
+	RDI,
+	R8,
+	R9,
+	R10,
+	R11,
+	R12,
+	R13,
+	R14,
+	R15
+};
+
+// A field inside a stub that is filled in every time the stub is emitted
+struct StubPatchPoint {
+	std::uint32_t offset = 0; // First byte of the field
+	std::uint32_t end    = 0; // End of the instruction holding the field, RIP relative fields are relative to it
+};
+
+// Encodes the few instructions the linker emits, it only runs at compile time so a stub that does not fit or an operand
+// the encoding cannot express fails the build instead of producing broken code
+class X64Encoder {
+public:
+	static constexpr std::size_t Capacity = 128;
+
+	constexpr auto getLength() const { return this->length; }
+	constexpr auto& getBytes() const { return this->bytes; }
+
+	constexpr void subRsp(std::uint8_t imm8) { emitRexW(0, 0); emit(0x83); emitModRM(3, 5, 4); emit(imm8); }
+	constexpr void addRsp(std::uint8_t imm8) { emitRexW(0, 0); emit(0x83); emitModRM(3, 0, 4); emit(imm8); }
+	// MOV [RSP + disp8], reg
+	constexpr void movToStack(std::uint8_t disp8, EX64Register reg) { emitRexW(reg, EX64Register::RSP); emit(0x89); emitStackOperand(reg, disp8); }
+	// MOV reg, [RSP + disp8]
+	constexpr void movFromStack(EX64Register reg, std::uint8_t disp8) { emitRexW(reg, EX64Register::RSP); emit(0x8B); emitStackOperand(reg, disp8); }
+	// MOV reg, [REL ??]
+	constexpr StubPatchPoint movFromRipRelative(EX64Register reg) { emitRexW(reg, EX64Register::RAX); emit(0x8B); return emitRipOperand(reg); }
+	// LEA reg, [REL ??]
+	constexpr StubPatchPoint leaRipRelative(EX64Register reg) { emitRexW(reg, EX64Register::RAX); emit(0x8D); return emitRipOperand(reg); }
+	// CALL [REL ??]
+	constexpr StubPatchPoint callRipRelative() { emit(0xFF); return emitRipOperand(2); }
+	// CALL rel32
+	constexpr StubPatchPoint callRelative() {
+		emit(0xE8);
+		StubPatchPoint patchPoint { static_cast<std::uint32_t>(this->length), static_cast<std::uint32_t>(this->length + 4) };
+		for (std::size_t i = 0; i < 4; i++) emit(0);
+		return patchPoint;
+	}
+	// CALL [reg], RSP and RBP would need a SIB byte or a displacement
+	constexpr void callIndirect(EX64Register reg) {
+		if (reg == EX64Register::RSP || reg == EX64Register::RBP || reg == EX64Register::R12 || reg == EX64Register::R13) throw std::invalid_argument("Register needs a SIB byte or displacement");
+		if (reg >= EX64Register::R8) emit(0x41);
+		emit(0xFF);
+		emitModRM(0, 2, reg);
+	}
+	// MOV reg, imm64
+	constexpr StubPatchPoint movImm64(EX64Register reg) {
+		emitRexW(0, reg);
+		emit(0xB8 + (static_cast<std::uint8_t>(reg) & 7));
+		StubPatchPoint patchPoint { static_cast<std::uint32_t>(this->length), static_cast<std::uint32_t>(this->length + 8) };
+		for (std::size_t i = 0; i < 8; i++) emit(0);
+		return patchPoint;
+	}
+	// LOCK INC QWORD [reg]
+	constexpr void lockIncIndirect(EX64Register reg) {
+		if (reg == EX64Register::RSP || reg == EX64Register::RBP || reg == EX64Register::R12 || reg == EX64Register::R13) throw std::invalid_argument("Register needs a SIB byte or displacement");
+		emit(0xF0);
+		emitRexW(0, reg);
+		emit(0xFF);
+		emitModRM(0, 0, reg);
+	}
+	// Single instruction NOPs of 1 to 3 bytes
+	constexpr void nop(std::size_t count) {
+		switch (count) {
+		case 1: emit(0x90); break;
+		case 2: emit(0x66); emit(0x90); break;
+		case 3: emit(0x0F); emit(0x1F); emit(0x00); break;
+		default: throw std::invalid_argument("NOP length not supported");
+		}
+	}
+
+private:
+	constexpr void emit(std::uint8_t byte) {
+		if (this->length >= Capacity) throw std::length_error("Stub does not fit the encoder");
+		this->bytes[this->length++] = byte;
+	}
+	constexpr void emitRexW(EX64Register reg, EX64Register rm) { emitRexW(static_cast<std::uint8_t>(reg), static_cast<std::uint8_t>(rm)); }
+	constexpr void emitRexW(std::uint8_t reg, EX64Register rm) { emitRexW(reg, static_cast<std::uint8_t>(rm)); }
+	constexpr void emitRexW(std::uint8_t reg, std::uint8_t rm) { emit(0x48 | (reg >> 3) << 2 | (rm >> 3)); }
+	constexpr void emitModRM(std::uint8_t mod, std::uint8_t reg, EX64Register rm) { emitModRM(mod, reg, static_cast<std::uint8_t>(rm)); }
+	constexpr void emitModRM(std::uint8_t mod, std::uint8_t reg, std::uint8_t rm) { emit(mod << 6 | (reg & 7) << 3 | (rm & 7)); }
+	constexpr void emitStackOperand(EX64Register reg, std::uint8_t disp8) {
+		emitModRM(1, static_cast<std::uint8_t>(reg), EX64Register::RSP);
+		emit(0x24); // SIB with RSP as base and no index
+		emit(disp8);
+	}
+	constexpr StubPatchPoint emitRipOperand(EX64Register reg) { return emitRipOperand(static_cast<std::uint8_t>(reg)); }
+	constexpr StubPatchPoint emitRipOperand(std::uint8_t reg) {
+		emitModRM(0, reg, 5);
+		StubPatchPoint patchPoint { static_cast<std::uint32_t>(this->length), static_cast<std::uint32_t>(this->length + 4) };
+		for (std::size_t i = 0; i < 4; i++) emit(0);
+		return patchPoint;
+	}
+
+private:
+	std::array<std::uint8_t, Capacity> bytes {};
+	std::size_t length = 0;
+};
+
+//----------------
+// Stub templates
+//----------------
+
+// Bytes of a stub and its patch points, emitting the stub is a copy followed by filling in the patch points
+template <std::size_t N, class PatchPoints>
+struct StubTemplate {
+	static constexpr std::size_t Length = N;
+
+	std::array<std::uint8_t, N> bytes {};
+	PatchPoints patchPoints {};
+
+	void emit(std::uint8_t* pStub) const { std::memcpy(pStub, this->bytes.data(), N); }
+	// Points a RIP relative field at 'target', given relative to the start of the stub
+	static void patchRipRelative(std::uint8_t* pStub, StubPatchPoint patchPoint, std::ptrdiff_t target) {
+		std::int32_t displacement = static_cast<std::int32_t>(target - static_cast<std::ptrdiff_t>(patchPoint.end));
+		std::memcpy(pStub + patchPoint.offset, &displacement, 4);
+	}
+	static void patchImm64(std::uint8_t* pStub, StubPatchPoint patchPoint, std::uint64_t value) { std::memcpy(pStub + patchPoint.offset, &value, 8); }
+};
+
+// Turns an encoder into a template of exactly its length, 'Encode' fills the encoder and returns the patch points
+template <auto Encode>
+consteval auto makeStubTemplate() {
+	constexpr auto Encoded = [] {
+		X64Encoder encoder;
+		auto patchPoints = Encode(encoder);
+		return std::pair { encoder, patchPoints };
+	}();
+	StubTemplate<Encoded.first.getLength(), decltype(Encoded.second)> stub;
+	for (std::size_t i = 0; i < stub.Length; i++) stub.bytes[i] = Encoded.first.getBytes()[i];
+	stub.patchPoints = Encoded.second;
+	return stub;
+}
+
+struct DirectCallPatchPoints {
+	StubPatchPoint slot; // Pointer slot holding the address of the called code
+};
+
+struct NearCallPatchPoints {
+	StubPatchPoint target; // Displacement of the called code
+};
+
+struct GetCallPatchPoints {
+	StubPatchPoint classRegistry; // Pointer slot holding the registry
+	StubPatchPoint lazyCall;      // Pointer slot holding the LazyCall of the call site
+	StubPatchPoint resolve;       // Pointer slot holding the address of ClassRegistry::resolveLazyCallc
+};
+
+struct CounterPatchPoints {
+	StubPatchPoint counter; // Address of the counter
+};
+
+// CALL [REL slot]
+static constexpr auto DirectCallStub = makeStubTemplate<[](X64Encoder& encoder) {
+	return DirectCallPatchPoints { encoder.callRipRelative() };
+}>();
+
+// CALL rel32 padded in front, it replaces a direct call whose target is in reach and returns to the same address
+static constexpr auto NearCallStub = makeStubTemplate<[](X64Encoder& encoder) {
+	encoder.nop(1);
+	return NearCallPatchPoints { encoder.callRelative() };
+}>();
+
+static_assert(NearCallStub.Length == DirectCallStub.Length);
+
+// Resolves the method through the LazyCall of the call site, which only looks it up on the first call. The register arguments
+// are preserved across the lookup and the resolved Method starts with its entry point
+static constexpr auto GetCallStub = makeStubTemplate<[](X64Encoder& encoder) {
+	GetCallPatchPoints patchPoints;
+	encoder.subRsp(0x38);
+	encoder.movToStack(0x20, EX64Register::RCX);
+	encoder.movToStack(0x28, EX64Register::RDX);
+	encoder.movToStack(0x30, EX64Register::R8);
+	patchPoints.classRegistry = encoder.movFromRipRelative(EX64Register::RCX);
+	patchPoints.lazyCall      = encoder.movFromRipRelative(EX64Register::RDX);
+	patchPoints.resolve       = encoder.callRipRelative();
+	encoder.movFromStack(EX64Register::RCX, 0x20);
+	encoder.movFromStack(EX64Register::RDX, 0x28);
+	encoder.movFromStack(EX64Register::R8, 0x30);
+	encoder.addRsp(0x38);
+	encoder.callIndirect(EX64Register::RAX);
+	return patchPoints;
+}>();
+
+// Counts an invocation, clobbers RAX which is free at every call
+static constexpr auto CounterStub = makeStubTemplate<[](X64Encoder& encoder) {
+	CounterPatchPoints patchPoints;
+	patchPoints.counter = encoder.movImm64(EX64Register::RAX);
+	encoder.lockIncIndirect(EX64Register::RAX);
+	return patchPoints;
+}>();
+
+// The counter in method prologues, padded to 16 bytes so the pointer slots after the code stay 8 byte aligned
+static constexpr auto MethodCounterStub = makeStubTemplate<[](X64Encoder& encoder) {
+	CounterPatchPoints patchPoints;
+	patchPoints.counter = encoder.movImm64(EX64Register::RAX);
+	encoder.lockIncIndirect(EX64Register::RAX);
+	encoder.nop(2);
+	return patchPoints;
+}>();
+
+static_assert(MethodCounterStub.Length % 8 == 0);
\ No newline at end of file
@@ -0,0 +1,77 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+// The pool the current thread works for, if any
+static thread_local const ThreadPool* pCurrentPool = nullptr;
+
+ThreadPool::ThreadPool(std::size_t threadCount) {
+	if (threadCount == 0) threadCount = std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+	this->threads.reserve(threadCount);
+	for (std::size_t i = 0; i < threadCount; i++)
+		this->threads.emplace_back(&ThreadPool::workerLoop, this);
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+	this->condition.notify_all();
+	for (auto& thread : this->threads)
+		thread.join();
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->tasks.push_back(std::move(task));
+	}
+	this->condition.notify_one();
+}
+
+void ThreadPool::parallelFor(std::size_t count, std::size_t grainSize, const std::function<void(std::size_t begin, std::size_t end)>& func) {
+	if (count == 0) return;
+	grainSize = std::max<std::size_t>(grainSize, 1);
+
+	// Split the range into at most one chunk per worker plus one for the calling thread
+	std::size_t chunkCount = std::min((count + grainSize - 1) / grainSize, this->threads.size() + 1);
+	if (chunkCount <= 1 || pCurrentPool == this) {
+		func(0, count);
+		return;
+	}
+	std::size_t chunkSize = (count + chunkCount - 1) / chunkCount;
+
+	std::mutex doneMutex;
+	std::condition_variable doneCondition;
+	std::size_t remaining = chunkCount - 1;
+	for (std::size_t i = 1; i < chunkCount; i++) {
+		std::size_t begin = i * chunkSize;
+		std::size_t end   = std::min(begin + chunkSize, count);
+		submit([&, begin, end]() {
+			if (begin < end) func(begin, end);
+			std::lock_guard<std::mutex> lock(doneMutex);
+			if (--remaining == 0) doneCondition.notify_one();
+		});
+	}
+
+	// Run the first chunk on the calling thread and wait for the rest
+	func(0, std::min(chunkSize, count));
+	std::unique_lock<std::mutex> lock(doneMutex);
+	doneCondition.wait(lock, [&]() { return remaining == 0; });
+}
+
+void ThreadPool::workerLoop() {
+	pCurrentPool = this;
+	while (true) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(this->mutex);
+			this->condition.wait(lock, [this]() { return this->stopping || !this->tasks.empty(); });
+			if (this->stopping && this->tasks.empty()) return;
+			task = std::move(this->tasks.front());
+			this->tasks.pop_front();
+		}
+		task();
+	}
+}
\ No newline at end of file
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+	ThreadPool(std::size_t threadCount = 0);
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool(ThreadPool&&)      = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+	ThreadPool& operator=(ThreadPool&&) = delete;
+	~ThreadPool();
+
+	void submit(std::function<void()> task);
+	// Splits [0, count) into ranges of at least 'grainSize' elements and runs them on the pool,
+	// the calling thread takes part in the work and only returns once every range has finished. Called from one of the
+	// workers it runs the whole range inline, waiting there could leave no worker to run the ranges.
+	void parallelFor(std::size_t count, std::size_t grainSize, const std::function<void(std::size_t begin, std::size_t end)>& func);
+
+	auto getThreadCount() const { return this->threads.size(); }
+
+private:
+	void workerLoop();
+
+private:
+	bool stopping = false;
+	std::vector<std::thread> threads;
+	std::deque<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable condition;
+};
\ No newline at end of file
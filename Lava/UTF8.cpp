@@ -0,0 +1,240 @@
+#include "UTF8.h"
+
+#include <cstring>
+
+#include <emmintrin.h>
+#include <immintrin.h>
+
+#if LAVA_TOOLSET_msc
+	#include <intrin.h>
+	#define LAVA_TARGET_AVX2
+#else
+	#define LAVA_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+std::ostream& operator<<(std::ostream& stream, EUTF8Validator validator) {
+	switch (validator) {
+	case EUTF8Validator::Scalar: return stream << "Scalar";
+	case EUTF8Validator::SSE2: return stream << "SSE2";
+	case EUTF8Validator::AVX2: return stream << "AVX2";
+	}
+	return stream;
+}
+
+//--------
+// Scalar
+//--------
+
+// Validates one sequence starting at 'pData[offset]', returns its length or 0 if it is malformed
+static std::size_t validateSequence(const std::uint8_t* pData, std::size_t length, std::size_t offset) {
+	std::uint8_t lead = pData[offset];
+	if (lead < 0x80) return 1;
+
+	std::size_t sequenceLength;
+	std::uint8_t secondMin = 0x80;
+	std::uint8_t secondMax = 0xBF;
+	if (lead >= 0xC2 && lead <= 0xDF) {
+		sequenceLength = 2;
+	} else if (lead >= 0xE0 && lead <= 0xEF) {
+		sequenceLength = 3;
+		if (lead == 0xE0) secondMin = 0xA0; // Overlong
+		if (lead == 0xED) secondMax = 0x9F; // Surrogates
+	} else if (lead >= 0xF0 && lead <= 0xF4) {
+		sequenceLength = 4;
+		if (lead == 0xF0) secondMin = 0x90; // Overlong
+		if (lead == 0xF4) secondMax = 0x8F; // Above U+10FFFF
+	} else {
+		return 0;
+	}
+	if (sequenceLength > length - offset) return 0;
+
+	if (pData[offset + 1] < secondMin || pData[offset + 1] > secondMax) return 0;
+	for (std::size_t i = 2; i < sequenceLength; i++)
+		if ((pData[offset + i] & 0xC0) != 0x80) return 0;
+	return sequenceLength;
+}
+
+static bool validateUTF8Scalar(const std::uint8_t* pData, std::size_t length) {
+	for (std::size_t offset = 0; offset < length;) {
+		std::size_t sequenceLength = validateSequence(pData, length, offset);
+		if (!sequenceLength) return false;
+		offset += sequenceLength;
+	}
+	return true;
+}
+
+//------
+// SSE2
+//------
+
+static bool validateUTF8SSE2(const std::uint8_t* pData, std::size_t length) {
+	std::size_t offset = 0;
+	while (offset < length) {
+		// Skip blocks of ASCII 16 bytes at a time
+		if (length - offset >= 16) {
+			__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pData + offset));
+			if (_mm_movemask_epi8(block) == 0) {
+				offset += 16;
+				continue;
+			}
+		}
+
+		// Decode the rest of the block one sequence at a time, the last one may run into the next block
+		std::size_t blockEnd = offset + 16 < length ? offset + 16 : length;
+		while (offset < blockEnd) {
+			std::size_t sequenceLength = validateSequence(pData, length, offset);
+			if (!sequenceLength) return false;
+			offset += sequenceLength;
+		}
+	}
+	return true;
+}
+
+//------
+// AVX2
+//------
+
+// Classifies every byte pair by the high and low nibble of the first byte and the high nibble of the second, the
+// three lookups only share a set bit when the pair is malformed. Continuations the pairs can not see are checked
+// against the lead bytes two and three positions back.
+static constexpr std::uint8_t TooShort     = 1 << 0;
+static constexpr std::uint8_t TooLong      = 1 << 1;
+static constexpr std::uint8_t Overlong3    = 1 << 2;
+static constexpr std::uint8_t TooLarge     = 1 << 3;
+static constexpr std::uint8_t Surrogate    = 1 << 4;
+static constexpr std::uint8_t Overlong2    = 1 << 5;
+static constexpr std::uint8_t TooLarge1000 = 1 << 6;
+static constexpr std::uint8_t Overlong4    = 1 << 6;
+static constexpr std::uint8_t TwoConts     = 1 << 7;
+static constexpr std::uint8_t Carry        = TooShort | TooLong | TwoConts;
+
+LAVA_TARGET_AVX2 static __m256i lookup16(__m256i indices, std::uint8_t (&table)[16]) {
+	return _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(table))), indices);
+}
+
+// Bytes of 'input' shifted back by N, with the last N bytes of 'previous' shifted in
+template <int N>
+LAVA_TARGET_AVX2 static __m256i previousBytes(__m256i input, __m256i previous) {
+	return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(previous, input, 0x21), 16 - N);
+}
+
+LAVA_TARGET_AVX2 static __m256i checkBlockAVX2(__m256i input, __m256i previous) {
+	static std::uint8_t firstHighTable[16] = {
+		TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong, TooLong,
+		TwoConts, TwoConts, TwoConts, TwoConts,
+		TooShort | Overlong2,
+		TooShort,
+		TooShort | Overlong3 | Surrogate,
+		TooShort | TooLarge | TooLarge1000 | Overlong4
+	};
+	static std::uint8_t firstLowTable[16] = {
+		Carry | Overlong3 | Overlong2 | Overlong4,
+		Carry | Overlong2,
+		Carry,
+		Carry,
+		Carry | TooLarge,
+		Carry | TooLarge | TooLarge1000,
+		Carry | TooLarge | TooLarge1000,
+		Carry | TooLarge | TooLarge1000,
+		Carry | TooLarge | TooLarge1000,
+		Carry | TooLarge | TooLarge1000,
+		Carry | TooLarge | TooLarge1000,
+		Carry | TooLarge | TooLarge1000,
+		Carry | TooLarge | TooLarge1000,
+		Carry | TooLarge | TooLarge1000 | Surrogate,
+		Carry | TooLarge | TooLarge1000,
+		Carry | TooLarge | TooLarge1000
+	};
+	static std::uint8_t secondHighTable[16] = {
+		TooShort, TooShort, TooShort, TooShort, TooShort, TooShort, TooShort, TooShort,
+		TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge1000 | Overlong4,
+		TooLong | Overlong2 | TwoConts | Overlong3 | TooLarge,
+		TooLong | Overlong2 | TwoConts | Surrogate | TooLarge,
+		TooLong | Overlong2 | TwoConts | Surrogate | TooLarge,
+		TooShort, TooShort, TooShort, TooShort
+	};
+
+	__m256i lowNibbles = _mm256_set1_epi8(0x0F);
+	__m256i previous1  = previousBytes<1>(input, previous);
+	__m256i firstHigh  = lookup16(_mm256_and_si256(_mm256_srli_epi16(previous1, 4), lowNibbles), firstHighTable);
+	__m256i firstLow   = lookup16(_mm256_and_si256(previous1, lowNibbles), firstLowTable);
+	__m256i secondHigh = lookup16(_mm256_and_si256(_mm256_srli_epi16(input, 4), lowNibbles), secondHighTable);
+	__m256i special    = _mm256_and_si256(_mm256_and_si256(firstHigh, firstLow), secondHigh);
+
+	// Bytes two after a 3 or 4 byte lead and three after a 4 byte lead must be continuations
+	__m256i thirdByte  = _mm256_subs_epu8(previousBytes<2>(input, previous), _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80)));
+	__m256i fourthByte = _mm256_subs_epu8(previousBytes<3>(input, previous), _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80)));
+	__m256i mustBeCont = _mm256_and_si256(_mm256_or_si256(thirdByte, fourthByte), _mm256_set1_epi8(static_cast<char>(0x80)));
+	return _mm256_xor_si256(mustBeCont, special);
+}
+
+// Non zero where the block ends in the middle of a sequence
+LAVA_TARGET_AVX2 static __m256i incompleteAVX2(__m256i input) {
+	__m256i maxValue = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	                                    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+	                                    static_cast<char>(0xF0 - 1), static_cast<char>(0xE0 - 1), static_cast<char>(0xC0 - 1));
+	return _mm256_subs_epu8(input, maxValue);
+}
+
+LAVA_TARGET_AVX2 static bool validateUTF8AVX2(const std::uint8_t* pData, std::size_t length) {
+	__m256i error      = _mm256_setzero_si256();
+	__m256i previous   = _mm256_setzero_si256();
+	__m256i incomplete = _mm256_setzero_si256();
+	auto checkBlock    = [&](__m256i input) LAVA_TARGET_AVX2 {
+		if (_mm256_movemask_epi8(input) == 0) {
+			// ASCII only has to finish the sequence of the previous block
+			error = _mm256_or_si256(error, incomplete);
+		} else {
+			error      = _mm256_or_si256(error, checkBlockAVX2(input, previous));
+			incomplete = incompleteAVX2(input);
+		}
+		previous = input;
+	};
+
+	std::size_t offset = 0;
+	for (; offset + 32 <= length; offset += 32)
+		checkBlock(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(pData + offset)));
+	if (offset < length) {
+		// Pad the tail with ASCII
+		std::uint8_t tail[32] {};
+		std::memcpy(tail, pData + offset, length - offset);
+		checkBlock(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(tail)));
+	}
+	error = _mm256_or_si256(error, incomplete);
+	return _mm256_testz_si256(error, error);
+}
+
+static bool hasAVX2() {
+#if LAVA_TOOLSET_msc
+	// The OS has to save the upper halves of the vector registers as well
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7) return false;
+	__cpuid(info, 1);
+	if ((info[2] & (1 << 27)) == 0 || (_xgetbv(0) & 6) != 6) return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+bool validateUTF8(const std::uint8_t* pData, std::size_t length) {
+	static const bool useAVX2 = hasAVX2();
+	if (useAVX2) return validateUTF8AVX2(pData, length);
+	return validateUTF8SSE2(pData, length);
+}
+
+bool validateUTF8(const std::uint8_t* pData, std::size_t length, EUTF8Validator validator) {
+	switch (validator) {
+	case EUTF8Validator::Scalar: return validateUTF8Scalar(pData, length);
+	case EUTF8Validator::SSE2: return validateUTF8SSE2(pData, length);
+	case EUTF8Validator::AVX2: return validateUTF8AVX2(pData, length);
+	}
+	return false;
+}
+
+bool isUTF8ValidatorSupported(EUTF8Validator validator) {
+	static const bool supportsAVX2 = hasAVX2();
+	return validator != EUTF8Validator::AVX2 || supportsAVX2;
+}
\ No newline at end of file
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <ostream>
+
+enum class EUTF8Validator : std::uint32_t {
+	Scalar = 0, // One sequence at a time
+	SSE2,       // Skips ASCII 16 bytes at a time, decodes the rest one sequence at a time
+	AVX2        // Checks 32 bytes at a time with nibble lookups
+};
+
+std::ostream& operator<<(std::ostream& stream, EUTF8Validator validator);
+
+// Checks that the bytes are well formed UTF-8, rejecting overlong forms, surrogates and code points above U+10FFFF.
+// Uses AVX2 when the processor supports it and an SSE2 ASCII fast path with a scalar decoder otherwise.
+bool validateUTF8(const std::uint8_t* pData, std::size_t length);
+// Runs one implementation regardless of the processor, for comparing them, check isUTF8ValidatorSupported first
+bool validateUTF8(const std::uint8_t* pData, std::size_t length, EUTF8Validator validator);
+bool isUTF8ValidatorSupported(EUTF8Validator validator);
\ No newline at end of file
@@ -0,0 +1,160 @@
+#include "X64Decoder.h"
+
+static constexpr std::uint8_t RexW = 0x08;
+static constexpr std::uint8_t RexR = 0x04;
+static constexpr std::uint8_t RexX = 0x02;
+static constexpr std::uint8_t RexB = 0x01;
+static constexpr std::uint8_t RSP  = 4;
+static constexpr std::uint8_t RBP  = 5;
+
+// Steps over a ModRM operand, rejecting RIP relative and absolute memory, memory based on RSP or RBP and RSP as a register.
+// SSE registers share the numbering, so XMM4 is rejected along with RSP.
+static bool decodeModRM(const std::uint8_t* pCode, std::size_t length, std::size_t& i, std::uint8_t rex, bool regIsOperand) {
+	if (i >= length) return false;
+	std::uint8_t modRM = pCode[i++];
+	std::uint8_t mod   = modRM >> 6;
+	std::uint8_t reg   = (modRM >> 3 & 7) | (rex & RexR ? 8 : 0);
+	std::uint8_t rm    = (modRM & 7) | (rex & RexB ? 8 : 0);
+	if (regIsOperand && reg == RSP) return false;
+	if (mod == 3) return rm != RSP;
+
+	if ((rm & 7) == 4) {
+		// SIB byte, a base of 5 without a displacement means an absolute address
+		if (i >= length) return false;
+		std::uint8_t sib  = pCode[i++];
+		std::uint8_t base = (sib & 7) | (rex & RexB ? 8 : 0);
+		if ((base & 7) == 5 && mod == 0) return false;
+		if (base == RSP || base == RBP) return false;
+	} else {
+		if ((rm & 7) == 5 && mod == 0) return false;
+		if (rm == RBP) return false;
+	}
+	i += mod == 1 ? 1 : mod == 2 ? 4 : 0;
+	return i <= length;
+}
+
+// Steps over one instruction of the supported subset
+static bool decodeInstruction(const std::uint8_t* pCode, std::size_t length, std::size_t& i, bool& isReturn) {
+	// Operand size and mandatory prefixes, then an optional REX prefix right before the opcode
+	bool operandSize16 = false;
+	for (; i < length && (pCode[i] == 0x66 || pCode[i] == 0xF2 || pCode[i] == 0xF3); i++)
+		operandSize16 |= pCode[i] == 0x66;
+	std::uint8_t rex = 0;
+	if (i < length && (pCode[i] & 0xF0) == 0x40) rex = pCode[i++];
+	if (i >= length) return false;
+
+	std::uint8_t opcode    = pCode[i++];
+	// REX.W takes precedence over the operand size prefix
+	std::size_t immZLength = operandSize16 && !(rex & RexW) ? 2 : 4;
+	std::size_t immLength  = 0;
+	if (opcode == 0x0F) {
+		if (i >= length) return false;
+		std::uint8_t opcode2 = pCode[i++];
+		switch (opcode2) {
+		case 0x1F:                                                 // NOP r/m
+		case 0x90: case 0x91: case 0x92: case 0x93: case 0x94: case 0x95: case 0x96: case 0x97:
+		case 0x98: case 0x99: case 0x9A: case 0x9B: case 0x9C: case 0x9D: case 0x9E: case 0x9F: // SETcc
+			if (!decodeModRM(pCode, length, i, rex, false)) return false;
+			break;
+		case 0x40: case 0x41: case 0x42: case 0x43: case 0x44: case 0x45: case 0x46: case 0x47:
+		case 0x48: case 0x49: case 0x4A: case 0x4B: case 0x4C: case 0x4D: case 0x4E: case 0x4F: // CMOVcc
+		case 0xAF:                                                 // IMUL
+		case 0xA5: case 0xAD:                                      // SHLD, SHRD by CL
+		case 0xB6: case 0xB7: case 0xBE: case 0xBF:                // MOVZX, MOVSX
+		case 0xB8: case 0xBC: case 0xBD:                           // POPCNT, BSF/TZCNT, BSR/LZCNT
+		case 0x10: case 0x11: case 0x28: case 0x29:                // SSE moves
+		case 0x2A: case 0x2C: case 0x2D: case 0x2E: case 0x2F:     // SSE conversions and compares
+		case 0x51: case 0x54: case 0x55: case 0x56: case 0x57:     // SSE square root and logic
+		case 0x58: case 0x59: case 0x5A: case 0x5C: case 0x5D: case 0x5E: case 0x5F: // SSE arithmetic
+		case 0x6E: case 0x7E: case 0xD6: case 0xEF:                // MOVD, MOVQ, PXOR
+			if (!decodeModRM(pCode, length, i, rex, true)) return false;
+			break;
+		case 0xA4: case 0xAC:                                      // SHLD, SHRD by imm8
+			if (!decodeModRM(pCode, length, i, rex, true)) return false;
+			immLength = 1;
+			break;
+		default: return false;
+		}
+		i += immLength;
+		return i <= length;
+	}
+
+	if (opcode == 0xC3) {
+		isReturn = true;
+		return true;
+	}
+	if (opcode < 0x40) {
+		// ALU operations, the rest of the range are prefixes and opcodes that are invalid in 64 bit mode
+		switch (opcode & 7) {
+		case 0: case 1: case 2: case 3:
+			if (!decodeModRM(pCode, length, i, rex, true)) return false;
+			break;
+		case 4: immLength = 1; break;
+		case 5: immLength = immZLength; break;
+		default: return false;
+		}
+	} else if (opcode >= 0x90 && opcode <= 0xBF) {
+		// Register encoded in the opcode
+		std::uint8_t reg = (opcode & 7) | (rex & RexB ? 8 : 0);
+		if (opcode == 0x98 || opcode == 0x99) {
+			// CWDE/CDQE, CDQ/CQO
+		} else if (opcode == 0xA8 || opcode == 0xA9) {
+			// TEST AL/EAX, imm
+			immLength = opcode == 0xA8 ? 1 : immZLength;
+		} else if (opcode <= 0x97 || opcode >= 0xB0) {
+			// XCHG with EAX, MOV imm
+			if (reg == RSP) return false;
+			if (opcode >= 0xB8)
+				immLength = rex & RexW ? 8 : immZLength;
+			else if (opcode >= 0xB0)
+				immLength = 1;
+		} else {
+			return false;
+		}
+	} else {
+		// Group opcodes use the reg field of the ModRM byte as an opcode extension
+		std::uint8_t extension = i < length ? pCode[i] >> 3 & 7 : 0;
+		switch (opcode) {
+		case 0x63:                                                 // MOVSXD
+		case 0x84: case 0x85: case 0x86: case 0x87:                // TEST, XCHG
+		case 0x88: case 0x89: case 0x8A: case 0x8B: case 0x8D:     // MOV, LEA
+			if (!decodeModRM(pCode, length, i, rex, true)) return false;
+			break;
+		case 0x69: case 0x6B:                                      // IMUL imm
+			if (!decodeModRM(pCode, length, i, rex, true)) return false;
+			immLength = opcode == 0x6B ? 1 : immZLength;
+			break;
+		case 0x80: case 0x81: case 0x83:                           // ALU imm
+		case 0xC0: case 0xC1:                                      // Shifts by imm8
+		case 0xD0: case 0xD1: case 0xD2: case 0xD3:                // Shifts by 1 and CL
+			if (!decodeModRM(pCode, length, i, rex, false)) return false;
+			immLength = opcode == 0x81 ? immZLength : opcode >= 0xD0 ? 0 : 1;
+			break;
+		case 0xC6: case 0xC7:                                      // MOV imm
+			if (extension != 0 || !decodeModRM(pCode, length, i, rex, false)) return false;
+			immLength = opcode == 0xC6 ? 1 : immZLength;
+			break;
+		case 0xF6: case 0xF7:                                      // TEST imm, NOT, NEG, MUL, IMUL, DIV, IDIV
+			if (!decodeModRM(pCode, length, i, rex, false)) return false;
+			if (extension <= 1) immLength = opcode == 0xF6 ? 1 : immZLength;
+			break;
+		case 0xFE: case 0xFF:                                      // INC, DEC, the other extensions branch or push
+			if (extension > 1 || !decodeModRM(pCode, length, i, rex, false)) return false;
+			break;
+		default: return false;
+		}
+	}
+	i += immLength;
+	return i <= length;
+}
+
+bool isInlinableLeaf(const std::uint8_t* pCode, std::size_t length, std::size_t& bodyLength) {
+	std::size_t i = 0;
+	while (i < length) {
+		bool isReturn = false;
+		bodyLength    = i;
+		if (!decodeInstruction(pCode, length, i, isReturn)) return false;
+		if (isReturn) return i == length;
+	}
+	return false;
+}
\ No newline at end of file
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Checks that a leaf method body can be copied into a call site in place of the call, the body must end in its only RET and
+// 'bodyLength' receives its length without the RET. The decoder knows a conservative subset of x86-64, a body with an
+// instruction outside of it, a branch, a RIP relative operand or anything that depends on the stack is rejected.
+bool isInlinableLeaf(const std::uint8_t* pCode, std::size_t length, std::size_t& bodyLength);
\ No newline at end of file
@@ -1,6 +1,13 @@
+#include "Compression.h"
+
+#include <cstdint>
+#include <cstring>
+
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -8,6 +15,7 @@ struct Field {
 	std::uint16_t accessFlag = 0x0001;
 	std::string name;
 	std::string descriptor;
+	bool hot = false;
 };
 
 struct MethodRef {
@@ -16,14 +24,508 @@ struct MethodRef {
 	std::uint32_t codeOffset;
 };
 
+// The 4 bytes at 'codeOffset' are a RIP relative displacement to a static field, they hold the number of immediate bytes after them
+struct FieldRef {
+	std::string className;
+	std::string fieldName;
+	std::uint32_t codeOffset;
+};
+
+// Like a field ref, but the displacement is to 'dataOffset' in the read only data of the class
+struct DataRef {
+	std::uint32_t dataOffset;
+	std::uint32_t codeOffset;
+};
+
 struct Method {
 	std::uint16_t accessFlag = 0x0001;
 	std::string name;
 	std::string descriptor;
 	std::vector<std::uint8_t> code;
+	// The uncompressed length followed by the LZ compressed code, empty if compression would not save anything
+	std::vector<std::uint8_t> compressedCode;
 	std::vector<MethodRef> methodRefs;
+	std::vector<FieldRef> fieldRefs;
+	std::vector<DataRef> dataRefs;
+};
+
+struct ClassDefinition {
+	std::uint16_t accessFlags = 0x0001;
+	std::string className;
+	std::vector<std::string> superClassNames;
+	std::vector<Field> fields;
+	std::vector<Method> methods;
+	std::vector<std::uint8_t> readOnlyData;
+	std::uint32_t readOnlyDataAlignment = 64;
 };
 
+static constexpr std::uint32_t ClassMagic = 0x484F544C;
+
+static bool writeClassV1(std::ofstream& lclassFile, const ClassDefinition& definition) {
+	std::uint16_t version = 1;
+	auto& className       = definition.className;
+	auto& superClassNames = definition.superClassNames;
+	auto& fields          = definition.fields;
+	auto& methods         = definition.methods;
+
+	lclassFile.write(reinterpret_cast<const char*>(&ClassMagic), 4);
+	lclassFile.write(reinterpret_cast<const char*>(&version), 2);
+	std::unordered_map<std::string, std::uint16_t> stringToConstantPoolIndex;
+	std::unordered_map<std::string, std::uint16_t> classToConstantPoolIndex;
+	classToConstantPoolIndex.insert({ className, 0 });
+	stringToConstantPoolIndex.insert({ className, 0 });
+	for (auto& superClass : superClassNames) {
+		classToConstantPoolIndex.insert({ superClass, 0 });
+		stringToConstantPoolIndex.insert({ superClass, 0 });
+	}
+	for (auto& field : fields) {
+		stringToConstantPoolIndex.insert({ field.name, 0 });
+		stringToConstantPoolIndex.insert({ field.descriptor, 0 });
+		if (field.hot) stringToConstantPoolIndex.insert({ "hot", 0 });
+	}
+	for (auto& method : methods) {
+		stringToConstantPoolIndex.insert({ method.name, 0 });
+		stringToConstantPoolIndex.insert({ method.descriptor, 0 });
+		if (!method.code.empty()) stringToConstantPoolIndex.insert({ method.compressedCode.empty() ? "code" : "lzcode", 0 });
+		if (!method.methodRefs.empty()) stringToConstantPoolIndex.insert({ "methodref", 0 });
+		for (auto& methodRef : method.methodRefs) {
+			stringToConstantPoolIndex.insert({ methodRef.className, 0 });
+			stringToConstantPoolIndex.insert({ methodRef.methodDescriptor, 0 });
+		}
+		if (!method.fieldRefs.empty()) stringToConstantPoolIndex.insert({ "fieldref", 0 });
+		for (auto& fieldRef : method.fieldRefs) {
+			stringToConstantPoolIndex.insert({ fieldRef.className, 0 });
+			stringToConstantPoolIndex.insert({ fieldRef.fieldName, 0 });
+		}
+		if (!method.dataRefs.empty()) stringToConstantPoolIndex.insert({ "dataref", 0 });
+	}
+	if (!definition.readOnlyData.empty()) stringToConstantPoolIndex.insert({ "rodata", 0 });
+	std::uint16_t constantPoolCount = stringToConstantPoolIndex.size() + classToConstantPoolIndex.size() + 1;
+	lclassFile.write(reinterpret_cast<const char*>(&constantPoolCount), 2);
+	std::uint16_t currentConstantPoolIndex = 1;
+	for (auto& stringConstant : stringToConstantPoolIndex) {
+		std::uint8_t tag = 2;
+		lclassFile.write(reinterpret_cast<const char*>(&tag), 1);
+		std::uint32_t stringLength = static_cast<std::uint32_t>(stringConstant.first.size());
+		lclassFile.write(reinterpret_cast<const char*>(&stringLength), 4);
+		lclassFile.write(stringConstant.first.data(), stringLength);
+		stringConstant.second = currentConstantPoolIndex++;
+	}
+	for (auto& classConstant : classToConstantPoolIndex) {
+		std::uint8_t tag = 1;
+		lclassFile.write(reinterpret_cast<const char*>(&tag), 1);
+		auto itr = stringToConstantPoolIndex.find(classConstant.first);
+		if (itr == stringToConstantPoolIndex.end()) {
+			std::cerr << "An unexpected error occured: Class name was not found in the constant pool, please try again." << std::endl;
+			return false;
+		}
+		std::uint16_t index = itr->second;
+		lclassFile.write(reinterpret_cast<const char*>(&index), 2);
+		classConstant.second = currentConstantPoolIndex++;
+	}
+	lclassFile.write(reinterpret_cast<const char*>(&definition.accessFlags), 2);
+	{
+		auto itr = classToConstantPoolIndex.find(className);
+		if (itr == classToConstantPoolIndex.end()) {
+			std::cerr << "An unexpected error occured: Class name was not found in the constant pool, please try again." << std::endl;
+			return false;
+		}
+		std::uint16_t index = itr->second;
+		lclassFile.write(reinterpret_cast<const char*>(&index), 2);
+	}
+	std::uint16_t superCount = static_cast<std::uint16_t>(superClassNames.size());
+	lclassFile.write(reinterpret_cast<const char*>(&superCount), 2);
+	for (auto& superClass : superClassNames) {
+		auto itr = classToConstantPoolIndex.find(superClass);
+		if (itr == classToConstantPoolIndex.end()) {
+			std::cerr << "An unexpected error occured: Super class name was not found in the constant pool, please try again." << std::endl;
+			return false;
+		}
+		std::uint16_t index = itr->second;
+		lclassFile.write(reinterpret_cast<const char*>(&index), 2);
+	}
+	std::uint16_t fieldCount = static_cast<std::uint16_t>(fields.size());
+	lclassFile.write(reinterpret_cast<const char*>(&fieldCount), 2);
+	for (auto& field : fields) {
+		lclassFile.write(reinterpret_cast<const char*>(&field.accessFlag), 2);
+		{
+			auto itr = stringToConstantPoolIndex.find(field.name);
+			if (itr == stringToConstantPoolIndex.end()) {
+				std::cerr << "An unexpected error occured: Field name was not found in the constant pool, please try again." << std::endl;
+				return false;
+			}
+			std::uint16_t index = itr->second;
+			lclassFile.write(reinterpret_cast<const char*>(&index), 2);
+		}
+		{
+			auto itr = stringToConstantPoolIndex.find(field.descriptor);
+			if (itr == stringToConstantPoolIndex.end()) {
+				std::cerr << "An unexpected error occured: Field descriptor was not found in the constant pool, please try again." << std::endl;
+				return false;
+			}
+			std::uint16_t index = itr->second;
+			lclassFile.write(reinterpret_cast<const char*>(&index), 2);
+		}
+		std::uint16_t attributeCount = field.hot;
+		lclassFile.write(reinterpret_cast<const char*>(&attributeCount), 2);
+		if (field.hot) {
+			{
+				auto itr = stringToConstantPoolIndex.find("hot");
+				if (itr == stringToConstantPoolIndex.end()) {
+					std::cerr << "An unexpected error occured: \"hot\" was not found in the constant pool, please try again." << std::endl;
+					return false;
+				}
+				std::uint16_t index = itr->second;
+				lclassFile.write(reinterpret_cast<const char*>(&index), 2);
+			}
+			std::uint32_t attributeLength = 0;
+			lclassFile.write(reinterpret_cast<const char*>(&attributeLength), 4);
+		}
+	}
+	std::uint16_t methodCount = static_cast<std::uint16_t>(methods.size());
+	lclassFile.write(reinterpret_cast<const char*>(&methodCount), 2);
+	for (auto& method : methods) {
+		lclassFile.write(reinterpret_cast<const char*>(&method.accessFlag), 2);
+		{
+			auto itr = stringToConstantPoolIndex.find(method.name);
+			if (itr == stringToConstantPoolIndex.end()) {
+				std::cerr << "An unexpected error occured: Method name was not found in the constant pool, please try again." << std::endl;
+				return false;
+			}
+			std::uint16_t index = itr->second;
+			lclassFile.write(reinterpret_cast<const char*>(&index), 2);
+		}
+		{
+			auto itr = stringToConstantPoolIndex.find(method.descriptor);
+			if (itr == stringToConstantPoolIndex.end()) {
+				std::cerr << "An unexpected error occured: Method descriptor was not found in the constant pool, please try again." << std::endl;
+				return false;
+			}
+			std::uint16_t index = itr->second;
+			lclassFile.write(reinterpret_cast<const char*>(&index), 2);
+		}
+		std::uint16_t attributeCount = (!method.code.empty()) + static_cast<std::uint16_t>(method.methodRefs.size() + method.fieldRefs.size() + method.dataRefs.size());
+		lclassFile.write(reinterpret_cast<const char*>(&attributeCount), 2);
+		if (!method.code.empty()) {
+			// Compressed code goes into an 'lzcode' attribute instead
+			auto& code = method.compressedCode.empty() ? method.code : method.compressedCode;
+			{
+				auto itr = stringToConstantPoolIndex.find(method.compressedCode.empty() ? "code" : "lzcode");
+				if (itr == stringToConstantPoolIndex.end()) {
+					std::cerr << "An unexpected error occured: \"code\" was not found in the constant pool, please try again." << std::endl;
+					return false;
+				}
+				std::uint16_t index = itr->second;
+				lclassFile.write(reinterpret_cast<const char*>(&index), 2);
+			}
+			std::uint32_t codeLength = static_cast<std::uint32_t>(code.size());
+			lclassFile.write(reinterpret_cast<const char*>(&codeLength), 4);
+			lclassFile.write(reinterpret_cast<const char*>(code.data()), codeLength);
+		}
+		for (auto& methodRef : method.methodRefs) {
+			{
+				auto itr = stringToConstantPoolIndex.find("methodref");
+				if (itr == stringToConstantPoolIndex.end()) {
+					std::cerr << "An unexpected error occured: \"methodref\" was not found in the constant pool, please try again." << std::endl;
+					return false;
+				}
+				std::uint16_t index = itr->second;
+				lclassFile.write(reinterpret_cast<const char*>(&index), 2);
+			}
+			std::uint32_t attributeLength = 8;
+			lclassFile.write(reinterpret_cast<const char*>(&attributeLength), 4);
+			{
+				auto itr = stringToConstantPoolIndex.find(methodRef.className);
+				if (itr == stringToConstantPoolIndex.end()) {
+					std::cerr << "An unexpected error occured: Method ref class name was not found in the constant pool, please try again." << std::endl;
+					return false;
+				}
+				std::uint16_t index = itr->second;
+				lclassFile.write(reinterpret_cast<const char*>(&index), 2);
+			}
+			{
+				auto itr = stringToConstantPoolIndex.find(methodRef.methodDescriptor);
+				if (itr == stringToConstantPoolIndex.end()) {
+					std::cerr << "An unexpected error occured: Method ref method descriptor was not found in the constant pool, please try again." << std::endl;
+					return false;
+				}
+				std::uint16_t index = itr->second;
+				lclassFile.write(reinterpret_cast<const char*>(&index), 2);
+			}
+			lclassFile.write(reinterpret_cast<const char*>(&methodRef.codeOffset), 4);
+		}
+		for (auto& fieldRef : method.fieldRefs) {
+			{
+				auto itr = stringToConstantPoolIndex.find("fieldref");
+				if (itr == stringToConstantPoolIndex.end()) {
+					std::cerr << "An unexpected error occured: \"fieldref\" was not found in the constant pool, please try again." << std::endl;
+					return false;
+				}
+				std::uint16_t index = itr->second;
+				lclassFile.write(reinterpret_cast<const char*>(&index), 2);
+			}
+			std::uint32_t attributeLength = 8;
+			lclassFile.write(reinterpret_cast<const char*>(&attributeLength), 4);
+			{
+				auto itr = stringToConstantPoolIndex.find(fieldRef.className);
+				if (itr == stringToConstantPoolIndex.end()) {
+					std::cerr << "An unexpected error occured: Field ref class name was not found in the constant pool, please try again." << std::endl;
+					return false;
+				}
+				std::uint16_t index = itr->second;
+				lclassFile.write(reinterpret_cast<const char*>(&index), 2);
+			}
+			{
+				auto itr = stringToConstantPoolIndex.find(fieldRef.fieldName);
+				if (itr == stringToConstantPoolIndex.end()) {
+					std::cerr << "An unexpected error occured: Field ref field name was not found in the constant pool, please try again." << std::endl;
+					return false;
+				}
+				std::uint16_t index = itr->second;
+				lclassFile.write(reinterpret_cast<const char*>(&index), 2);
+			}
+			lclassFile.write(reinterpret_cast<const char*>(&fieldRef.codeOffset), 4);
+		}
+		for (auto& dataRef : method.dataRefs) {
+			{
+				auto itr = stringToConstantPoolIndex.find("dataref");
+				if (itr == stringToConstantPoolIndex.end()) {
+					std::cerr << "An unexpected error occured: \"dataref\" was not found in the constant pool, please try again." << std::endl;
+					return false;
+				}
+				std::uint16_t index = itr->second;
+				lclassFile.write(reinterpret_cast<const char*>(&index), 2);
+			}
+			std::uint32_t attributeLength = 8;
+			lclassFile.write(reinterpret_cast<const char*>(&attributeLength), 4);
+			lclassFile.write(reinterpret_cast<const char*>(&dataRef.dataOffset), 4);
+			lclassFile.write(reinterpret_cast<const char*>(&dataRef.codeOffset), 4);
+		}
+	}
+	std::uint16_t classAttributeCount = !definition.readOnlyData.empty();
+	lclassFile.write(reinterpret_cast<const char*>(&classAttributeCount), 2);
+	if (!definition.readOnlyData.empty()) {
+		{
+			auto itr = stringToConstantPoolIndex.find("rodata");
+			if (itr == stringToConstantPoolIndex.end()) {
+				std::cerr << "An unexpected error occured: \"rodata\" was not found in the constant pool, please try again." << std::endl;
+				return false;
+			}
+			std::uint16_t index = itr->second;
+			lclassFile.write(reinterpret_cast<const char*>(&index), 2);
+		}
+		std::uint32_t attributeLength = 4 + static_cast<std::uint32_t>(definition.readOnlyData.size());
+		lclassFile.write(reinterpret_cast<const char*>(&attributeLength), 4);
+		lclassFile.write(reinterpret_cast<const char*>(&definition.readOnlyDataAlignment), 4);
+		lclassFile.write(reinterpret_cast<const char*>(definition.readOnlyData.data()), definition.readOnlyData.size());
+	}
+	return static_cast<bool>(lclassFile);
+}
+
+// Must match hashMethodDescriptor in Lava
+static std::uint32_t hashMethodDescriptor(std::string_view descriptor) {
+	std::uint32_t hash = 0x811C9DC5U;
+	for (char c : descriptor)
+		hash = (hash ^ static_cast<std::uint8_t>(c)) * 0x01000193U;
+	return hash;
+}
+
+static std::size_t alignUp(std::size_t value, std::size_t alignment) {
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static void putUI2(std::vector<std::uint8_t>& bytes, std::size_t position, std::uint16_t value) {
+	bytes[position]     = static_cast<std::uint8_t>(value & 0xFF);
+	bytes[position + 1] = static_cast<std::uint8_t>((value >> 8) & 0xFF);
+}
+
+static void putUI4(std::vector<std::uint8_t>& bytes, std::size_t position, std::uint32_t value) {
+	putUI2(bytes, position, static_cast<std::uint16_t>(value & 0xFFFF));
+	putUI2(bytes, position + 2, static_cast<std::uint16_t>((value >> 16) & 0xFFFF));
+}
+
+// Version 2 writes aligned sections of fixed size entries, see the version 2 loader in Lava for the layout
+static bool writeClassV2(std::ofstream& lclassFile, const ClassDefinition& definition) {
+	// Strings are stored once each, length prefixed and NUL terminated
+	std::vector<std::uint8_t> strings;
+	std::unordered_map<std::string, std::uint32_t> stringOffsets;
+	auto addString = [&](const std::string& string) -> std::uint32_t {
+		auto itr = stringOffsets.find(string);
+		if (itr != stringOffsets.end()) return itr->second;
+		std::uint32_t offset = static_cast<std::uint32_t>(strings.size());
+		strings.resize(alignUp(offset + 4 + string.size() + 1, 4), 0);
+		putUI4(strings, offset, static_cast<std::uint32_t>(string.size()));
+		std::memcpy(strings.data() + offset + 4, string.data(), string.size());
+		stringOffsets.insert({ string, offset });
+		return offset;
+	};
+
+	struct Relocation {
+		std::uint32_t byteOffset;
+		std::uint32_t className; // Data offset of read only data accesses
+		std::uint32_t name;      // Method descriptor of calls, field name of field accesses
+		std::uint32_t kind;
+	};
+
+	std::uint32_t thisClassName = addString(definition.className);
+	std::vector<std::uint32_t> superNames;
+	for (auto& superClass : definition.superClassNames)
+		superNames.push_back(addString(superClass));
+	std::vector<std::uint32_t> fieldStrings;
+	for (auto& field : definition.fields) {
+		fieldStrings.push_back(addString(field.name));
+		fieldStrings.push_back(addString(field.descriptor));
+	}
+	std::vector<std::uint32_t> methodStrings;
+	std::vector<std::size_t> methodCodeOffsets;
+	std::vector<Relocation> relocations;
+	std::size_t codeSize = 0;
+	for (auto& method : definition.methods) {
+		methodStrings.push_back(addString(method.name));
+		methodStrings.push_back(addString(method.descriptor));
+		for (auto& methodRef : method.methodRefs)
+			relocations.push_back({ methodRef.codeOffset, addString(methodRef.className), addString(methodRef.methodDescriptor), 0 });
+		for (auto& fieldRef : method.fieldRefs)
+			relocations.push_back({ fieldRef.codeOffset, addString(fieldRef.className), addString(fieldRef.fieldName), 1 });
+		for (auto& dataRef : method.dataRefs)
+			relocations.push_back({ dataRef.codeOffset, dataRef.dataOffset, 0, 2 });
+		codeSize = alignUp(codeSize, 16);
+		methodCodeOffsets.push_back(codeSize);
+		codeSize += method.compressedCode.empty() ? method.code.size() : method.compressedCode.size();
+	}
+
+	// Lay out the sections, each one starting on a 16 byte boundary
+	std::size_t stringsOffset     = 64;
+	std::size_t supersOffset      = alignUp(stringsOffset + strings.size(), 16);
+	std::size_t fieldsOffset      = alignUp(supersOffset + 4 * superNames.size(), 16);
+	std::size_t methodsOffset     = alignUp(fieldsOffset + 16 * definition.fields.size(), 16);
+	std::size_t relocationsOffset = alignUp(methodsOffset + 32 * definition.methods.size(), 16);
+	std::size_t codeOffset        = alignUp(relocationsOffset + 16 * relocations.size(), 16);
+	std::size_t dataOffset        = alignUp(codeOffset + codeSize, 16);
+	std::vector<std::uint8_t> image(dataOffset + definition.readOnlyData.size(), 0);
+
+	putUI4(image, 0, ClassMagic);
+	putUI2(image, 4, 2);
+	putUI2(image, 6, definition.accessFlags);
+	putUI4(image, 8, thisClassName);
+	putUI2(image, 12, static_cast<std::uint16_t>(superNames.size()));
+	putUI2(image, 14, static_cast<std::uint16_t>(definition.fields.size()));
+	putUI2(image, 16, static_cast<std::uint16_t>(definition.methods.size()));
+	putUI2(image, 18, static_cast<std::uint16_t>(definition.readOnlyData.empty() ? 0 : definition.readOnlyDataAlignment));
+	putUI4(image, 20, static_cast<std::uint32_t>(relocations.size()));
+	putUI4(image, 24, static_cast<std::uint32_t>(stringsOffset));
+	putUI4(image, 28, static_cast<std::uint32_t>(strings.size()));
+	putUI4(image, 32, static_cast<std::uint32_t>(supersOffset));
+	putUI4(image, 36, static_cast<std::uint32_t>(fieldsOffset));
+	putUI4(image, 40, static_cast<std::uint32_t>(methodsOffset));
+	putUI4(image, 44, static_cast<std::uint32_t>(relocationsOffset));
+	putUI4(image, 48, static_cast<std::uint32_t>(codeOffset));
+	putUI4(image, 52, static_cast<std::uint32_t>(codeSize));
+	putUI4(image, 56, static_cast<std::uint32_t>(dataOffset));
+	putUI4(image, 60, static_cast<std::uint32_t>(definition.readOnlyData.size()));
+
+	std::memcpy(image.data() + stringsOffset, strings.data(), strings.size());
+	for (std::size_t i = 0; i < superNames.size(); i++)
+		putUI4(image, supersOffset + i * 4, superNames[i]);
+	for (std::size_t i = 0; i < definition.fields.size(); i++) {
+		auto& field       = definition.fields[i];
+		std::size_t entry = fieldsOffset + i * 16;
+		putUI2(image, entry, field.accessFlag);
+		putUI2(image, entry + 2, field.hot ? 0x0001 : 0x0000);
+		putUI4(image, entry + 4, fieldStrings[i * 2]);
+		putUI4(image, entry + 8, fieldStrings[i * 2 + 1]);
+	}
+	std::uint32_t firstRelocation = 0;
+	for (std::size_t i = 0; i < definition.methods.size(); i++) {
+		auto& method      = definition.methods[i];
+		auto& code        = method.compressedCode.empty() ? method.code : method.compressedCode;
+		std::size_t entry = methodsOffset + i * 32;
+		putUI2(image, entry, method.accessFlag);
+		putUI2(image, entry + 2, method.compressedCode.empty() ? 0x0000 : 0x0001);
+		putUI4(image, entry + 4, methodStrings[i * 2]);
+		putUI4(image, entry + 8, methodStrings[i * 2 + 1]);
+		putUI4(image, entry + 12, hashMethodDescriptor(method.descriptor));
+		putUI4(image, entry + 16, static_cast<std::uint32_t>(methodCodeOffsets[i]));
+		putUI4(image, entry + 20, static_cast<std::uint32_t>(code.size()));
+		std::uint32_t relocationCount = static_cast<std::uint32_t>(method.methodRefs.size() + method.fieldRefs.size() + method.dataRefs.size());
+		putUI4(image, entry + 24, firstRelocation);
+		putUI4(image, entry + 28, relocationCount);
+		firstRelocation += relocationCount;
+		std::memcpy(image.data() + codeOffset + methodCodeOffsets[i], code.data(), code.size());
+	}
+	for (std::size_t i = 0; i < relocations.size(); i++) {
+		std::size_t entry = relocationsOffset + i * 16;
+		putUI4(image, entry, relocations[i].byteOffset);
+		putUI4(image, entry + 4, relocations[i].className);
+		putUI4(image, entry + 8, relocations[i].name);
+		putUI4(image, entry + 12, relocations[i].kind);
+	}
+	std::memcpy(image.data() + dataOffset, definition.readOnlyData.data(), definition.readOnlyData.size());
+
+	lclassFile.write(reinterpret_cast<const char*>(image.data()), image.size());
+	return static_cast<bool>(lclassFile);
+}
+
+// Reads lines of space separated hex bytes until an empty line
+static void readHexBytes(std::vector<std::uint8_t>& bytes) {
+	while (true) {
+		std::string line;
+		std::getline(std::cin, line);
+		if (line.empty()) break;
+		std::string_view bytesView = line;
+		std::size_t offset         = 0;
+		while (offset < line.size()) {
+			std::size_t end           = bytesView.find_first_of(' ', offset);
+			std::string_view byteView = bytesView.substr(offset, end - offset);
+			if ((byteView.size() % 2) == 1) {
+				std::cout << "Warning you passed an odd number of nibbles (4 bits), skipping '" << byteView << "'" << std::endl;
+				offset = bytesView.find_first_not_of(' ', end);
+				continue;
+			}
+
+			std::vector<std::uint8_t> code;
+			bool skip = false;
+			for (std::size_t i = 0; i < byteView.size(); i += 2) {
+				char hn = byteView[i];
+				char ln = byteView[i + 1];
+				std::uint8_t hv;
+				std::uint8_t lv;
+				if (hn >= '0' && hn <= '9')
+					hv = hn - '0';
+				else if (hn >= 'a' && hn <= 'f')
+					hv = 10 + hn - 'a';
+				else if (hn >= 'A' && hn <= 'F')
+					hv = 10 + hn - 'A';
+				else {
+					std::cout << "Warning Nibble " << i << " is not one of (0-9, a-f, A-F), skipping '" << byteView << "'" << std::endl;
+					skip = true;
+					break;
+				}
+				if (ln >= '0' && ln <= '9')
+					lv = ln - '0';
+				else if (ln >= 'a' && ln <= 'f')
+					lv = 10 + ln - 'a';
+				else if (ln >= 'A' && ln <= 'F')
+					lv = 10 + ln - 'A';
+				else {
+					std::cout << "Warning Nibble " << (i + 1) << " is not one of (0-9, a-f, A-F), skipping '" << byteView << "'" << std::endl;
+					skip = true;
+					break;
+				}
+				std::uint8_t byte = hv << 4 | lv;
+				code.push_back(byte);
+			}
+
+			if (skip) {
+				offset = bytesView.find_first_not_of(' ', end);
+				continue;
+			}
+			bytes.insert(bytes.end(), code.begin(), code.end());
+			offset = bytesView.find_first_not_of(' ', end);
+		}
+	}
+}
+
 int main(int argc, const char** argv) {
 	std::filesystem::path file;
 	if (argc < 2) {
@@ -33,15 +535,24 @@ int main(int argc, const char** argv) {
 		file = argv[1];
 	}
 
+	// Version 2 is written unless an older version is asked for
+	std::uint16_t version = 2;
+	if (argc >= 3) {
+		std::string_view versionArgument = argv[2];
+		if (versionArgument != "1" && versionArgument != "2") {
+			std::cerr << "Unsupported class file version '" << versionArgument << "', expected 1 or 2" << std::endl;
+			return EXIT_FAILURE;
+		}
+		version = versionArgument == "1" ? 1 : 2;
+	}
+
 	std::ofstream lclassFile(file, std::ios::binary);
 	if (lclassFile) {
-		std::uint32_t magic       = 0x484F544C;
-		std::uint16_t version     = 1;
-		std::uint16_t accessFlags = 0x0001;
-		std::string className;
-		std::vector<std::string> superClassNames;
-		std::vector<Field> fields;
-		std::vector<Method> methods;
+		ClassDefinition definition;
+		auto& className       = definition.className;
+		auto& superClassNames = definition.superClassNames;
+		auto& fields          = definition.fields;
+		auto& methods         = definition.methods;
 
 		char ws;
 		std::cout << "Class name: ";
@@ -63,6 +574,14 @@ int main(int argc, const char** argv) {
 			std::cout << "Field descriptor: ";
 			std::cin >> field.descriptor;
 			std::cin.ignore(1000, '\n');
+			std::string hot;
+			std::cout << "Field hot (y/n): ";
+			std::getline(std::cin, hot);
+			field.hot = !hot.empty() && (hot[0] == 'y' || hot[0] == 'Y');
+			std::string isStatic;
+			std::cout << "Field static (y/n): ";
+			std::getline(std::cin, isStatic);
+			if (!isStatic.empty() && (isStatic[0] == 'y' || isStatic[0] == 'Y')) field.accessFlag |= 0x0008;
 			fields.push_back(std::move(field));
 		}
 		while (true) {
@@ -75,62 +594,7 @@ int main(int argc, const char** argv) {
 			std::cin >> method.descriptor;
 			std::cin.ignore(1000, '\n');
 			std::cout << "Method code: ";
-			while (true) {
-				std::string bytes;
-				std::getline(std::cin, bytes);
-				if (bytes.empty()) break;
-				std::string_view bytesView = bytes;
-				std::size_t offset         = 0;
-				while (offset < bytes.size()) {
-					std::size_t end           = bytesView.find_first_of(' ', offset);
-					std::string_view byteView = bytesView.substr(offset, end - offset);
-					if ((byteView.size() % 2) == 1) {
-						std::cout << "Warning you passed an odd number of nibbles (4 bits), skipping '" << byteView << "'" << std::endl;
-						offset = bytesView.find_first_not_of(' ', end);
-						continue;
-					}
-
-					std::vector<std::uint8_t> code;
-					bool skip = false;
-					for (std::size_t i = 0; i < byteView.size(); i += 2) {
-						char hn = byteView[i];
-						char ln = byteView[i + 1];
-						std::uint8_t hv;
-						std::uint8_t lv;
-						if (hn >= '0' && hn <= '9')
-							hv = hn - '0';
-						else if (hn >= 'a' && hn <= 'f')
-							hv = 10 + hn - 'a';
-						else if (hn >= 'A' && hn <= 'F')
-							hv = 10 + hn - 'A';
-						else {
-							std::cout << "Warning Nibble " << i << " is not one of (0-9, a-f, A-F), skipping '" << byteView << "'" << std::endl;
-							skip = true;
-							break;
-						}
-						if (ln >= '0' && ln <= '9')
-							lv = ln - '0';
-						else if (ln >= 'a' && ln <= 'f')
-							lv = 10 + ln - 'a';
-						else if (ln >= 'A' && ln <= 'F')
-							lv = 10 + ln - 'A';
-						else {
-							std::cout << "Warning Nibble " << (i + 1) << " is not one of (0-9, a-f, A-F), skipping '" << byteView << "'" << std::endl;
-							skip = true;
-							break;
-						}
-						std::uint8_t byte = hv << 4 | lv;
-						code.push_back(byte);
-					}
-
-					if (skip) {
-						offset = bytesView.find_first_not_of(' ', end);
-						continue;
-					}
-					method.code.insert(method.code.end(), code.begin(), code.end());
-					offset = bytesView.find_first_not_of(' ', end);
-				}
-			}
+			readHexBytes(method.code);
 
 			while (true) {
 				MethodRef methodRef;
@@ -145,187 +609,61 @@ int main(int argc, const char** argv) {
 				method.methodRefs.push_back(std::move(methodRef));
 			}
 
-			methods.push_back(std::move(method));
-		}
-
-		lclassFile.write(reinterpret_cast<char*>(&magic), 4);
-		lclassFile.write(reinterpret_cast<char*>(&version), 2);
-		std::unordered_map<std::string, std::uint16_t> stringToConstantPoolIndex;
-		std::unordered_map<std::string, std::uint16_t> classToConstantPoolIndex;
-		classToConstantPoolIndex.insert({ className, 0 });
-		stringToConstantPoolIndex.insert({ className, 0 });
-		for (auto& superClass : superClassNames) {
-			classToConstantPoolIndex.insert({ superClass, 0 });
-			stringToConstantPoolIndex.insert({ superClass, 0 });
-		}
-		for (auto& field : fields) {
-			stringToConstantPoolIndex.insert({ field.name, 0 });
-			stringToConstantPoolIndex.insert({ field.descriptor, 0 });
-		}
-		for (auto& method : methods) {
-			stringToConstantPoolIndex.insert({ method.name, 0 });
-			stringToConstantPoolIndex.insert({ method.descriptor, 0 });
-			if (!method.code.empty()) stringToConstantPoolIndex.insert({ "code", 0 });
-			if (!method.methodRefs.empty()) stringToConstantPoolIndex.insert({ "methodref", 0 });
-			for (auto& methodRef : method.methodRefs) {
-				stringToConstantPoolIndex.insert({ methodRef.className, 0 });
-				stringToConstantPoolIndex.insert({ methodRef.methodDescriptor, 0 });
+			while (true) {
+				FieldRef fieldRef;
+				std::cout << "Field ref class name: ";
+				std::getline(std::cin, fieldRef.className);
+				if (fieldRef.className.empty()) break;
+				std::cout << "Field ref field name: ";
+				std::cin >> fieldRef.fieldName;
+				std::cout << "Field ref code offset: ";
+				std::cin >> fieldRef.codeOffset;
+				std::cin.ignore(1000, '\n');
+				method.fieldRefs.push_back(std::move(fieldRef));
 			}
-		}
-		std::uint16_t constantPoolCount = stringToConstantPoolIndex.size() + classToConstantPoolIndex.size() + 1;
-		lclassFile.write(reinterpret_cast<char*>(&constantPoolCount), 2);
-		std::uint16_t currentConstantPoolIndex = 1;
-		for (auto& stringConstant : stringToConstantPoolIndex) {
-			std::uint8_t tag = 2;
-			lclassFile.write(reinterpret_cast<char*>(&tag), 1);
-			std::uint32_t stringLength = static_cast<std::uint32_t>(stringConstant.first.size());
-			lclassFile.write(reinterpret_cast<char*>(&stringLength), 4);
-			lclassFile.write(stringConstant.first.data(), stringLength);
-			stringConstant.second = currentConstantPoolIndex++;
-		}
-		for (auto& classConstant : classToConstantPoolIndex) {
-			std::uint8_t tag = 1;
-			lclassFile.write(reinterpret_cast<char*>(&tag), 1);
-			auto itr = stringToConstantPoolIndex.find(classConstant.first);
-			if (itr == stringToConstantPoolIndex.end()) {
-				std::cerr << "An unexpected error occured: Class name was not found in the constant pool, please try again." << std::endl;
-				lclassFile.close();
-				return EXIT_FAILURE;
+
+			while (true) {
+				DataRef dataRef;
+				std::string dataOffset;
+				std::cout << "Data ref data offset: ";
+				std::getline(std::cin, dataOffset);
+				if (dataOffset.empty()) break;
+				dataRef.dataOffset = static_cast<std::uint32_t>(std::stoul(dataOffset));
+				std::cout << "Data ref code offset: ";
+				std::cin >> dataRef.codeOffset;
+				std::cin.ignore(1000, '\n');
+				method.dataRefs.push_back(dataRef);
 			}
-			std::uint16_t index = itr->second;
-			lclassFile.write(reinterpret_cast<char*>(&index), 2);
-			classConstant.second = currentConstantPoolIndex++;
-		}
-		lclassFile.write(reinterpret_cast<char*>(&accessFlags), 2);
-		{
-			auto itr = classToConstantPoolIndex.find(className);
-			if (itr == classToConstantPoolIndex.end()) {
-				std::cerr << "An unexpected error occured: Class name was not found in the constant pool, please try again." << std::endl;
-				lclassFile.close();
-				return EXIT_FAILURE;
+
+			// Only keep compressed code that is actually smaller, short methods rarely are
+			std::vector<std::uint8_t> compressedCode = compressLZ(method.code.data(), method.code.size());
+			if (compressedCode.size() + 4 < method.code.size()) {
+				std::uint32_t codeLength = static_cast<std::uint32_t>(method.code.size());
+				method.compressedCode.resize(4);
+				putUI4(method.compressedCode, 0, codeLength);
+				method.compressedCode.insert(method.compressedCode.end(), compressedCode.begin(), compressedCode.end());
 			}
-			std::uint16_t index = itr->second;
-			lclassFile.write(reinterpret_cast<char*>(&index), 2);
+
+			methods.push_back(std::move(method));
 		}
-		std::uint16_t superCount = static_cast<std::uint16_t>(superClassNames.size());
-		lclassFile.write(reinterpret_cast<char*>(&superCount), 2);
-		for (auto& superClass : superClassNames) {
-			auto itr = classToConstantPoolIndex.find(superClass);
-			if (itr == classToConstantPoolIndex.end()) {
-				std::cerr << "An unexpected error occured: Super class name was not found in the constant pool, please try again." << std::endl;
-				lclassFile.close();
+
+		std::cout << "Read only data: ";
+		readHexBytes(definition.readOnlyData);
+		if (!definition.readOnlyData.empty()) {
+			// Vector constants want at least 16 bytes, the default keeps a table on its own cache line
+			std::string alignment;
+			std::cout << "Read only data alignment (default 64): ";
+			std::getline(std::cin, alignment);
+			if (!alignment.empty()) definition.readOnlyDataAlignment = static_cast<std::uint32_t>(std::stoul(alignment));
+			if (definition.readOnlyDataAlignment == 0 || definition.readOnlyDataAlignment > 4096 || (definition.readOnlyDataAlignment & (definition.readOnlyDataAlignment - 1)) != 0) {
+				std::cerr << "Read only data alignment has to be a power of two of at most 4096" << std::endl;
 				return EXIT_FAILURE;
 			}
-			std::uint16_t index = itr->second;
-			lclassFile.write(reinterpret_cast<char*>(&index), 2);
-		}
-		std::uint16_t fieldCount = static_cast<std::uint16_t>(fields.size());
-		lclassFile.write(reinterpret_cast<char*>(&fieldCount), 2);
-		for (auto& field : fields) {
-			lclassFile.write(reinterpret_cast<char*>(&field.accessFlag), 2);
-			{
-				auto itr = stringToConstantPoolIndex.find(field.name);
-				if (itr == stringToConstantPoolIndex.end()) {
-					std::cerr << "An unexpected error occured: Field name was not found in the constant pool, please try again." << std::endl;
-					lclassFile.close();
-					return EXIT_FAILURE;
-				}
-				std::uint16_t index = itr->second;
-				lclassFile.write(reinterpret_cast<char*>(&index), 2);
-			}
-			{
-				auto itr = stringToConstantPoolIndex.find(field.descriptor);
-				if (itr == stringToConstantPoolIndex.end()) {
-					std::cerr << "An unexpected error occured: Field descriptor was not found in the constant pool, please try again." << std::endl;
-					lclassFile.close();
-					return EXIT_FAILURE;
-				}
-				std::uint16_t index = itr->second;
-				lclassFile.write(reinterpret_cast<char*>(&index), 2);
-			}
-			std::uint16_t attributeCount = 0;
-			lclassFile.write(reinterpret_cast<char*>(attributeCount), 2);
-		}
-		std::uint16_t methodCount = static_cast<std::uint16_t>(methods.size());
-		lclassFile.write(reinterpret_cast<char*>(&methodCount), 2);
-		for (auto& method : methods) {
-			lclassFile.write(reinterpret_cast<char*>(&method.accessFlag), 2);
-			{
-				auto itr = stringToConstantPoolIndex.find(method.name);
-				if (itr == stringToConstantPoolIndex.end()) {
-					std::cerr << "An unexpected error occured: Method name was not found in the constant pool, please try again." << std::endl;
-					lclassFile.close();
-					return EXIT_FAILURE;
-				}
-				std::uint16_t index = itr->second;
-				lclassFile.write(reinterpret_cast<char*>(&index), 2);
-			}
-			{
-				auto itr = stringToConstantPoolIndex.find(method.descriptor);
-				if (itr == stringToConstantPoolIndex.end()) {
-					std::cerr << "An unexpected error occured: Method descriptor was not found in the constant pool, please try again." << std::endl;
-					lclassFile.close();
-					return EXIT_FAILURE;
-				}
-				std::uint16_t index = itr->second;
-				lclassFile.write(reinterpret_cast<char*>(&index), 2);
-			}
-			std::uint16_t attributeCount = (!method.code.empty()) + (!method.methodRefs.empty());
-			lclassFile.write(reinterpret_cast<char*>(&attributeCount), 2);
-			if (!method.code.empty()) {
-				{
-					auto itr = stringToConstantPoolIndex.find("code");
-					if (itr == stringToConstantPoolIndex.end()) {
-						std::cerr << "An unexpected error occured: \"code\" was not found in the constant pool, please try again." << std::endl;
-						lclassFile.close();
-						return EXIT_FAILURE;
-					}
-					std::uint16_t index = itr->second;
-					lclassFile.write(reinterpret_cast<char*>(&index), 2);
-				}
-				std::uint32_t codeLength = static_cast<std::uint32_t>(method.code.size());
-				lclassFile.write(reinterpret_cast<char*>(&codeLength), 4);
-				lclassFile.write(reinterpret_cast<char*>(method.code.data()), codeLength);
-			}
-			for (auto& methodRef : method.methodRefs) {
-				{
-					auto itr = stringToConstantPoolIndex.find("methodref");
-					if (itr == stringToConstantPoolIndex.end()) {
-						std::cerr << "An unexpected error occured: \"methodref\" was not found in the constant pool, please try again." << std::endl;
-						lclassFile.close();
-						return EXIT_FAILURE;
-					}
-					std::uint16_t index = itr->second;
-					lclassFile.write(reinterpret_cast<char*>(&index), 2);
-				}
-				std::uint32_t attributeLength = 8;
-				lclassFile.write(reinterpret_cast<char*>(&attributeLength), 4);
-				{
-					auto itr = stringToConstantPoolIndex.find(methodRef.className);
-					if (itr == stringToConstantPoolIndex.end()) {
-						std::cerr << "An unexpected error occured: Method ref class name was not found in the constant pool, please try again." << std::endl;
-						lclassFile.close();
-						return EXIT_FAILURE;
-					}
-					std::uint16_t index = itr->second;
-					lclassFile.write(reinterpret_cast<char*>(&index), 2);
-				}
-				{
-					auto itr = stringToConstantPoolIndex.find(methodRef.methodDescriptor);
-					if (itr == stringToConstantPoolIndex.end()) {
-						std::cerr << "An unexpected error occured: Method ref method descriptor was not found in the constant pool, please try again." << std::endl;
-						lclassFile.close();
-						return EXIT_FAILURE;
-					}
-					std::uint16_t index = itr->second;
-					lclassFile.write(reinterpret_cast<char*>(&index), 2);
-				}
-				lclassFile.write(reinterpret_cast<char*>(&methodRef.codeOffset), 4);
-			}
 		}
 
+		bool written = version == 1 ? writeClassV1(lclassFile, definition) : writeClassV2(lclassFile, definition);
 		lclassFile.close();
-		return EXIT_SUCCESS;
+		return written ? EXIT_SUCCESS : EXIT_FAILURE;
 	}
 	return EXIT_FAILURE;
 }
\ No newline at end of file
@@ -30,6 +30,9 @@ workspace("LavaTest")
 	filter({ "toolset:gcc", "system:not windows" })
 		buildoptions({ "-maccumulate-outgoing-args" })
 	
+	filter("system:linux")
+		links({ "pthread" })
+	
 	filter({})
 	
 	startproject("LavaTest")
@@ -49,8 +52,9 @@ workspace("LavaTest")
 		targetdir("%{wks.location}/Bin/%{cfg.system}-%{cfg.platform}-%{cfg.buildcfg}")
 		objdir("%{wks.location}/BinInt/%{cfg.system}-%{cfg.platform}-%{cfg.buildcfg}/LavaCompiler")
 		debugdir("%{wks.location}/Run")
+		includedirs({ "%{wks.location}/Lava" })
 		
-		files({ "%{prj.location}/**" })
+		files({ "%{prj.location}/**", "%{wks.location}/Lava/Compression.h", "%{wks.location}/Lava/Compression.cpp" })
 		removefiles({ "**.vcxproj", "**.vcxproj.*", "**/Makefile", "**.make" })
 	
 	if _ACTION == "vs2019" then